@@ -0,0 +1,51 @@
+#ifndef _BACKOFF_H_
+#define _BACKOFF_H_
+
+#include <stdint.h>
+#include "Arduino.h"
+
+/*
+ * Exponential retry delay for reconnects. The first retry comes after
+ * minMs, so a blip costs milliseconds; each further failure doubles the
+ * wait up to maxMs, so a server that is down is not hammered. A success
+ * starts over.
+ */
+class Backoff
+{
+public:
+    Backoff(uint32_t minMs, uint32_t maxMs)
+        : _min(minMs), _max(maxMs), _delay(0), _since(0)
+    {
+    }
+
+    bool due() const
+    {
+        return millis() - _since >= _delay;
+    }
+
+    // Milliseconds until due().
+    uint32_t wait() const
+    {
+        uint32_t elapsed = millis() - _since;
+        return elapsed >= _delay ? 0 : _delay - elapsed;
+    }
+
+    void failed()
+    {
+        _delay = _delay ? (_delay * 2 < _max ? _delay * 2 : _max) : _min;
+        _since = millis();
+    }
+
+    void succeeded()
+    {
+        _delay = 0;
+    }
+
+private:
+    uint32_t _min;
+    uint32_t _max;
+    uint32_t _delay;
+    uint32_t _since;
+};
+
+#endif /* _BACKOFF_H_ */
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <string.h>
+#include "BlockCache.h"
+#include "Metrics.h"
+
+#define SECTOR_SIZE 512
+
+BlockCache::BlockCache()
+    : _device(nullptr), _lock(nullptr), _data(nullptr), _slotCount(0), _clock(0),
+      _metadataLimit(0), _local(*this, Local), _host(*this, Host),
+      _store(*this, Store)
+{
+    memset(_slots, 0, sizeof(_slots));
+    memset(_dirty, 0, sizeof(_dirty));
+    memset(_lastReadCached, 0, sizeof(_lastReadCached));
+}
+
+BlockCache::~BlockCache()
+{
+    detach();
+}
+
+bool BlockCache::attach(BlockDevice* device)
+{
+    detach();
+    if (!device || device->sectorSize() != SECTOR_SIZE) {
+        return false;
+    }
+    _lock = xSemaphoreCreateRecursiveMutex();
+    if (!_lock) {
+        return false;
+    }
+    // Without the buffer the ports still work, just without caching.
+    _data = (uint8_t*)malloc(BLOCK_CACHE_SLOTS * SECTOR_SIZE);
+    _slotCount = _data ? BLOCK_CACHE_SLOTS : 0;
+    _device = device;
+    invalidate();
+    return true;
+}
+
+void BlockCache::detach()
+{
+    _device = nullptr;
+    free(_data);
+    _data = nullptr;
+    _slotCount = 0;
+    if (_lock) {
+        vSemaphoreDelete(_lock);
+        _lock = nullptr;
+    }
+}
+
+BlockDevice* BlockCache::port(Owner owner)
+{
+    if (!_device) {
+        return nullptr;
+    }
+    return owner == Host ? &_host : owner == Store ? &_store : &_local;
+}
+
+void BlockCache::setMetadataLimit(uint32_t lba)
+{
+    _metadataLimit = lba;
+}
+
+bool BlockCache::takeDirty(Owner owner, uint32_t &first, uint32_t &last)
+{
+    if (!_lock) {
+        return false;
+    }
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    Span span = _dirty[owner];
+    _dirty[owner].any = false;
+    xSemaphoreGiveRecursive(_lock);
+
+    first = span.first;
+    last = span.last;
+    return span.any;
+}
+
+void BlockCache::invalidate()
+{
+    if (_lock) {
+        xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    }
+    memset(_slots, 0, sizeof(_slots));
+    memset(_dirty, 0, sizeof(_dirty));
+    _clock = 0;
+    if (_lock) {
+        xSemaphoreGiveRecursive(_lock);
+    }
+}
+
+int BlockCache::find(uint32_t sector)
+{
+    for (uint32_t i = 0; i < _slotCount; i++) {
+        if (_slots[i].used && _slots[i].sector == sector) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Caches a copy of one sector, evicting the least recently used slot.
+void BlockCache::fill(const uint8_t* data, uint32_t sector)
+{
+    if (!_slotCount) {
+        return;
+    }
+    int slot = find(sector);
+    if (slot < 0) {
+        slot = 0;
+        for (uint32_t i = 1; i < _slotCount; i++) {
+            if (_slots[i].used < _slots[slot].used) {
+                slot = i;
+            }
+        }
+        _slots[slot].sector = sector;
+    }
+    _slots[slot].used = ++_clock;
+    memcpy(_data + slot * SECTOR_SIZE, data, SECTOR_SIZE);
+}
+
+void BlockCache::markDirty(Owner owner, uint32_t first, uint32_t last)
+{
+    Span &span = _dirty[owner];
+    if (!span.any) {
+        span.first = first;
+        span.last = last;
+        span.any = true;
+        return;
+    }
+    if (first < span.first) {
+        span.first = first;
+    }
+    if (last > span.last) {
+        span.last = last;
+    }
+}
+
+bool BlockCache::readSectors(Owner owner, uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+
+    // All hits are served from RAM; anything else is one transfer from the
+    // card, which is never older than the cache.
+    METRIC_START(lookup);
+    uint32_t hits = 0;
+    while (hits < count) {
+        int slot = find(sector + hits);
+        if (slot < 0) {
+            break;
+        }
+        memcpy(buffer + hits * SECTOR_SIZE, _data + slot * SECTOR_SIZE, SECTOR_SIZE);
+        _slots[slot].used = ++_clock;
+        hits++;
+    }
+    METRIC_STOP(METRIC_CACHE_LOOKUP, lookup);
+    METRIC_COUNT(hits < count ? METRIC_CACHE_MISSES : METRIC_CACHE_HITS, 1);
+    _lastReadCached[owner] = hits == count;
+
+    bool ok = true;
+    if (hits < count) {
+        METRIC_START(io);
+        ok = _device->readSectors(buffer, sector, count);
+        METRIC_STOP(METRIC_SD_COMMAND, io);
+        if (ok) {
+            for (uint32_t i = 0; i < count; i++) {
+                if (sector + i < _metadataLimit || count == 1) {
+                    fill(buffer + i * SECTOR_SIZE, sector + i);
+                }
+            }
+        }
+    }
+
+    xSemaphoreGiveRecursive(_lock);
+    return ok;
+}
+
+bool BlockCache::writeSectors(Owner owner, const uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+
+    METRIC_START(io);
+    bool ok = _device->writeSectors(buffer, sector, count);
+    METRIC_STOP(METRIC_SD_COMMAND, io);
+    for (uint32_t i = 0; i < count; i++) {
+        int slot = find(sector + i);
+        if (slot < 0) {
+            continue;
+        }
+        if (ok) {
+            memcpy(_data + slot * SECTOR_SIZE, buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+        } else {
+            _slots[slot].used = 0;  // the card may hold either version now
+        }
+    }
+    markDirty(owner, sector, sector + count - 1);
+
+    xSemaphoreGiveRecursive(_lock);
+    return ok;
+}
+
+bool BlockCache::trim(Owner owner, uint32_t start, uint32_t end)
+{
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+
+    for (uint32_t i = 0; i < _slotCount; i++) {
+        if (_slots[i].sector >= start && _slots[i].sector <= end) {
+            _slots[i].used = 0;
+        }
+    }
+    markDirty(owner, start, end);
+    METRIC_START(io);
+    bool ok = _device->trim(start, end);
+    METRIC_STOP(METRIC_SD_COMMAND, io);
+
+    xSemaphoreGiveRecursive(_lock);
+    return ok;
+}
+
+
+bool BlockCache::Port::read(uint8_t* buffer, uint32_t sector)
+{
+    return _cache.readSectors(_owner, buffer, sector, 1);
+}
+
+bool BlockCache::Port::write(const uint8_t* buffer, uint32_t sector)
+{
+    return _cache.writeSectors(_owner, buffer, sector, 1);
+}
+
+bool BlockCache::Port::readSectors(uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    return _cache.readSectors(_owner, buffer, sector, count);
+}
+
+bool BlockCache::Port::writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    return _cache.writeSectors(_owner, buffer, sector, count);
+}
+
+bool BlockCache::Port::sync()
+{
+    return _cache._device->sync();
+}
+
+bool BlockCache::Port::trim(uint32_t start, uint32_t end)
+{
+    return _cache.trim(_owner, start, end);
+}
+
+sdcard_type_t BlockCache::Port::type()
+{
+    return _cache._device->type();
+}
+
+uint32_t BlockCache::Port::sectorCount()
+{
+    return _cache._device->sectorCount();
+}
+
+uint32_t BlockCache::Port::sectorSize()
+{
+    return SECTOR_SIZE;
+}
+
+// A session keeps the cache locked as well as the bus, so the lock order is
+// always cache then bus, whichever port a task goes through.
+bool BlockCache::Port::beginSession()
+{
+    xSemaphoreTakeRecursive(_cache._lock, portMAX_DELAY);
+    if (!_cache._device->beginSession()) {
+        xSemaphoreGiveRecursive(_cache._lock);
+        return false;
+    }
+    return true;
+}
+
+void BlockCache::Port::endSession()
+{
+    _cache._device->endSession();
+    xSemaphoreGiveRecursive(_cache._lock);
+}
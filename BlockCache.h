@@ -0,0 +1,118 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "BlockDevice.h"
+
+// Sectors kept in RAM. Each slot costs one sector plus a few bytes of tag.
+#ifndef BLOCK_CACHE_SLOTS
+#define BLOCK_CACHE_SLOTS 32
+#endif
+
+/*
+ * Single sector cache in front of the card, shared by everyone who writes
+ * it. FatFs and the USB host each get their own port; both see the same
+ * cached sectors, so neither reads back what the other just wrote.
+ *
+ * Writes go straight through to the card and refresh any cached copy, so
+ * the card is never behind the cache. Every port keeps the span of sectors
+ * it changed since the owner last asked (takeDirty()), which tells the
+ * firmware when the host's view of the metadata went stale and when its
+ * own FatFs view did.
+ *
+ * The cache lock is recursive and a session on either port holds it, so a
+ * task inside a session never waits on the other port.
+ *
+ * Sectors below the metadata limit (reserved area and FATs) are cached
+ * whatever the transfer size; above it only single sector reads are, which
+ * is how FatFs reads directories.
+ */
+class BlockCache
+{
+public:
+    enum Owner {
+        Local,      // FatFs and the firmware
+        Host,       // USB mass storage
+        Store,      // remote file data kept on the card, never metadata
+        OwnerCount
+    };
+
+    class Port : public BlockDevice
+    {
+    public:
+        Port(BlockCache &cache, Owner owner) : _cache(cache), _owner(owner) {}
+
+        bool read(uint8_t* buffer, uint32_t sector) override;
+        bool write(const uint8_t* buffer, uint32_t sector) override;
+        bool readSectors(uint8_t* buffer, uint32_t sector, uint32_t count) override;
+        bool writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count) override;
+        bool sync() override;
+        bool trim(uint32_t start, uint32_t end) override;
+
+        sdcard_type_t type() override;
+        uint32_t sectorCount() override;
+        uint32_t sectorSize() override;
+
+        bool beginSession() override;
+        void endSession() override;
+
+    private:
+        BlockCache &_cache;
+        Owner _owner;
+    };
+
+    BlockCache();
+    ~BlockCache();
+
+    bool attach(BlockDevice* device);
+    void detach();
+    BlockDevice* port(Owner owner);
+
+    // Sectors below lba are metadata and always worth caching.
+    void setMetadataLimit(uint32_t lba);
+    // Range of sectors written or trimmed through owner's port since the
+    // last call. Returns false when there were none.
+    bool takeDirty(Owner owner, uint32_t &first, uint32_t &last);
+    // Whether the last read through owner's port came entirely from RAM.
+    // Only meaningful for a port used by a single task.
+    bool lastReadCached(Owner owner) const { return _lastReadCached[owner]; }
+    void invalidate();
+
+private:
+    BlockCache(BlockCache const&);
+    BlockCache& operator=(BlockCache const&);
+
+    struct Slot {
+        uint32_t sector;
+        uint32_t used;      // LRU stamp, 0: empty
+    };
+    struct Span {
+        uint32_t first;
+        uint32_t last;
+        bool any;
+    };
+
+    bool readSectors(Owner owner, uint8_t* buffer, uint32_t sector, uint32_t count);
+    bool writeSectors(Owner owner, const uint8_t* buffer, uint32_t sector, uint32_t count);
+    bool trim(Owner owner, uint32_t start, uint32_t end);
+    int find(uint32_t sector);
+    void fill(const uint8_t* data, uint32_t sector);
+    void markDirty(Owner owner, uint32_t first, uint32_t last);
+
+    BlockDevice* _device;
+    SemaphoreHandle_t _lock;
+    uint8_t* _data;
+    Slot _slots[BLOCK_CACHE_SLOTS];
+    uint32_t _slotCount;
+    uint32_t _clock;
+    uint32_t _metadataLimit;
+    Span _dirty[OwnerCount];
+    bool _lastReadCached[OwnerCount];
+    Port _local;
+    Port _host;
+    Port _store;
+};
+
+#endif /* _BLOCK_CACHE_H_ */
@@ -0,0 +1,56 @@
+#ifndef _BLOCK_DEVICE_H_
+#define _BLOCK_DEVICE_H_
+
+#include <stdint.h>
+#include "sd_defines.h"
+
+/*
+ * Sector-addressed storage behind SDFS. The FatFs glue (diskio.cpp) and the
+ * MSC callbacks only talk to this interface, so the card can sit on the SPI
+ * bus or on the SDMMC peripheral without either of them knowing.
+ */
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    virtual bool read(uint8_t* buffer, uint32_t sector) = 0;
+    virtual bool write(const uint8_t* buffer, uint32_t sector) = 0;
+    virtual bool readSectors(uint8_t* buffer, uint32_t sector, uint32_t count) = 0;
+    virtual bool writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count) = 0;
+    virtual bool sync() = 0;
+    // Sectors start..end (inclusive) no longer hold data and may be erased.
+    virtual bool trim(uint32_t start, uint32_t end) = 0;
+
+    virtual sdcard_type_t type() = 0;
+    virtual uint32_t sectorCount() = 0;
+    virtual uint32_t sectorSize() = 0;
+
+    // Keep the bus claimed by the calling task across several operations.
+    // Sessions nest. Backends without per-transfer setup cost ignore them.
+    virtual bool beginSession() { return true; }
+    virtual void endSession() {}
+};
+
+class BlockDeviceSession
+{
+public:
+    explicit BlockDeviceSession(BlockDevice* device)
+        : _device(device), _active(device && device->beginSession())
+    {
+    }
+    ~BlockDeviceSession()
+    {
+        if (_active) {
+            _device->endSession();
+        }
+    }
+private:
+    BlockDeviceSession(BlockDeviceSession const&);
+    BlockDeviceSession& operator=(BlockDeviceSession const&);
+
+    BlockDevice* _device;
+    bool _active;
+};
+
+#endif /* _BLOCK_DEVICE_H_ */
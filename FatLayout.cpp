@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <string.h>
+#include <set>
+#include "ff.h"
+#include "FatLayout.h"
+
+#define LAYOUT_SECTOR_SIZE  512
+#define LAYOUT_ALIGN        8192    // partition start, 4 MiB like SD card factory formats
+#define LAYOUT_RESERVED     32
+#define LAYOUT_CLUSTER      64      // largest cluster tried, in sectors
+#define LAYOUT_MIN_CLUSTERS 65526   // fewer clusters would make the volume FAT16
+#define LAYOUT_MAX_CLUSTERS 0x0FFFFFF5
+#define LAYOUT_MAX_DIR      65536   // directory entries FatFs will index
+#define LAYOUT_LFN_CHARS    13      // UTF-16 units per LFN entry
+#define LAYOUT_MAX_LFN      255
+#define LAYOUT_EOC          0x0FFFFFFF
+
+static void st16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void st32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+// Decodes up to max UTF-16 units. Malformed sequences become '_' so a bad
+// name from the catalog still gets a usable directory entry.
+static size_t utf8ToUtf16(const std::string &in, uint16_t* out, size_t max)
+{
+    size_t n = 0, i = 0;
+
+    while (i < in.size()) {
+        uint8_t c = (uint8_t)in[i];
+        uint32_t cp;
+        size_t len;
+
+        if (c < 0x80) {
+            cp = c; len = 1;
+        } else if ((c & 0xE0) == 0xC0) {
+            cp = c & 0x1F; len = 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            cp = c & 0x0F; len = 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            cp = c & 0x07; len = 4;
+        } else {
+            cp = '_'; len = 1;
+        }
+        if (len > 1) {
+            if (i + len > in.size()) {
+                cp = '_'; len = in.size() - i;
+            } else {
+                for (size_t k = 1; k < len; k++) {
+                    uint8_t cc = (uint8_t)in[i + k];
+                    if ((cc & 0xC0) != 0x80) {
+                        cp = '_'; len = k;
+                        break;
+                    }
+                    cp = (cp << 6) | (cc & 0x3F);
+                }
+            }
+        }
+        i += len;
+
+        if (cp >= 0x10000 && cp <= 0x10FFFF) {
+            if (n + 2 > max) break;
+            cp -= 0x10000;
+            out[n++] = (uint16_t)(0xD800 | (cp >> 10));
+            out[n++] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+        } else {
+            if (n + 1 > max) break;
+            out[n++] = (cp > 0xFFFF || (cp >= 0xD800 && cp <= 0xDFFF)) ? '_' : (uint16_t)cp;
+        }
+    }
+    return n;
+}
+
+// The UTF-16 name upper-cased the way FatFs does before comparing.
+static std::u16string nameKey(const std::string &name)
+{
+    uint16_t lfn[LAYOUT_MAX_LFN];
+    size_t units = utf8ToUtf16(name, lfn, LAYOUT_MAX_LFN);
+    std::u16string key;
+
+    for (size_t i = 0; i < units; i++) {
+        key += (char16_t)ff_wtoupper(lfn[i]);
+    }
+    return key;
+}
+
+static size_t utf16Length(const std::string &name)
+{
+    uint16_t lfn[LAYOUT_MAX_LFN + 1];
+    return utf8ToUtf16(name, lfn, LAYOUT_MAX_LFN + 1);
+}
+
+static uint8_t sfnChar(uint8_t c)
+{
+    if (c >= 'a' && c <= 'z') return c - 'a' + 'A';
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return c;
+    if (c < 0x80 && strchr("!#$%&'()-@^_`{}", c)) return c;
+    return '_';
+}
+
+// Every short name carries a numeric tail made from the catalog index, and
+// '~' never survives into the basis, so short names are unique by
+// construction and need no collision search.
+static void makeShortName(const std::string &name, uint32_t index, uint8_t* sfn)
+{
+    char tail[12];
+    size_t dot = name.find_last_of('.');
+    size_t baseEnd = (dot == std::string::npos || dot == 0) ? name.size() : dot;
+    size_t n = 0;
+
+    memset(sfn, ' ', 11);
+    int tailLen = 0;
+    for (uint32_t v = index + 1; v; v /= 10) tailLen++;
+    size_t baseMax = 8 - 1 - tailLen;
+
+    for (size_t i = 0; i < baseEnd && n < baseMax; i++) {
+        uint8_t c = (uint8_t)name[i];
+        if (c == ' ' || c == '.' || (c & 0xC0) == 0x80) continue;
+        sfn[n++] = sfnChar(c);
+    }
+    snprintf(tail, sizeof tail, "~%u", (unsigned)(index + 1));
+    memcpy(sfn + n, tail, tailLen + 1);
+
+    if (baseEnd < name.size()) {
+        n = 0;
+        for (size_t i = baseEnd + 1; i < name.size() && n < 3; i++) {
+            uint8_t c = (uint8_t)name[i];
+            if (c == ' ' || (c & 0xC0) == 0x80) continue;
+            sfn[8 + n++] = sfnChar(c);
+        }
+    }
+}
+
+static uint8_t shortNameSum(const uint8_t* sfn)
+{
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 11; i++) {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + sfn[i]);
+    }
+    return sum;
+}
+
+// Cylinder/head/sector address for the MBR, clamped the usual way past 8 GiB.
+static void storeChs(uint8_t* p, uint32_t lba)
+{
+    uint32_t cyl = lba / (255 * 63);
+    uint32_t head = lba / 63 % 255;
+    uint32_t sec = lba % 63 + 1;
+
+    if (cyl > 1023) {
+        cyl = 1023; head = 254; sec = 63;
+    }
+    p[0] = (uint8_t)head;
+    p[1] = (uint8_t)(sec | ((cyl >> 2) & 0xC0));
+    p[2] = (uint8_t)cyl;
+}
+
+FatLayout::FatLayout()
+    : _partStart(0), _partSectors(0), _reservedSectors(0), _fatSectors(0),
+      _clusterSectors(0), _clusterCount(0), _dataStart(0), _dirClusters(0),
+      _nextCluster(2), _timestamp(0), _serial(0),
+      _device(NULL), _work(NULL), _workSectors(0), _workUsed(0), _workLba(0)
+{
+}
+
+std::string FatLayout::longName(const std::string &name)
+{
+    std::string out;
+
+    for (size_t i = 0; i < name.size(); i++) {
+        uint8_t c = (uint8_t)name[i];
+        if (c == ' ' && out.empty()) continue;
+        out += (c < 0x20 || c == 0x7F || strchr("\\/:*?\"<>|", c)) ? '_' : (char)c;
+    }
+    while (!out.empty() && (out.back() == '.' || out.back() == ' ')) {
+        out.pop_back();
+    }
+    return out.empty() ? "_" : out;
+}
+
+void FatLayout::uniqueNames(std::vector<std::string> &names)
+{
+    std::set<std::u16string> seen;
+
+    for (std::string &name : names) {
+        if (name.empty()) continue;
+        std::u16string key = nameKey(name);
+        if (seen.count(key)) {
+            size_t dot = name.find_last_of('.');
+            if (dot == std::string::npos || dot == 0) dot = name.size();
+            std::string base = name.substr(0, dot), ext = name.substr(dot);
+            for (unsigned n = 2;; n++) {
+                char tail[16];
+                snprintf(tail, sizeof tail, " (%u)", n);
+                // Make room for the tail, whole UTF-8 sequences at a time.
+                while (!base.empty() && utf16Length(base + tail + ext) > LAYOUT_MAX_LFN) {
+                    while (base.size() > 1 && ((uint8_t)base.back() & 0xC0) == 0x80) base.pop_back();
+                    base.pop_back();
+                }
+                name = base + tail + ext;
+                key = nameKey(name);
+                if (!seen.count(key)) break;
+            }
+        }
+        seen.insert(key);
+    }
+}
+
+void FatLayout::clear()
+{
+    _entries.clear();
+    _clusterSectors = 0;
+    _nextCluster = 2;
+}
+
+void FatLayout::add(const std::string &name, uint64_t size)
+{
+    Entry entry;
+    entry.name = name;
+    entry.size = size;
+    entry.cluster = 0;
+    entry.clusters = 0;
+    entry.sector = 0;
+    entry.lfnCount = 0;
+    _entries.push_back(entry);
+}
+
+bool FatLayout::plan(uint32_t deviceSectors)
+{
+    _clusterSectors = 0;
+    if (deviceSectors <= LAYOUT_ALIGN) {
+        return false;
+    }
+    _partStart = LAYOUT_ALIGN;
+    _partSectors = deviceSectors - LAYOUT_ALIGN;
+
+    // Largest cluster that still leaves a FAT32-sized cluster count; big
+    // clusters keep the FATs short and every file in few, long runs.
+    uint32_t spc;
+    for (spc = LAYOUT_CLUSTER; spc; spc >>= 1) {
+        uint32_t rsv = LAYOUT_RESERVED;
+        uint32_t fat = (uint32_t)(((uint64_t)(_partSectors / spc) + 2) * 4 / LAYOUT_SECTOR_SIZE + 1);
+        if (_partSectors <= rsv + 2 * fat) continue;
+        uint32_t clusters = (_partSectors - rsv - 2 * fat) / spc;
+        fat = (uint32_t)(((uint64_t)clusters + 2) * 4 / LAYOUT_SECTOR_SIZE + 1);
+        // Pad the reserved area so clusters sit on erase-friendly boundaries.
+        rsv += (spc - (_partStart + rsv + 2 * fat) % spc) % spc;
+        clusters = (_partSectors - rsv - 2 * fat) / spc;
+        if (clusters < LAYOUT_MIN_CLUSTERS) continue;
+        if (clusters > LAYOUT_MAX_CLUSTERS) return false;
+
+        _reservedSectors = rsv;
+        _fatSectors = fat;
+        _clusterCount = clusters;
+        break;
+    }
+    if (!spc) {
+        return false;
+    }
+    _dataStart = _partStart + _reservedSectors + 2 * _fatSectors;
+
+    // Invalid or case-only different names would make a directory FatFs and
+    // Windows take for corrupt.
+    std::vector<std::string> names;
+    for (const Entry &entry : _entries) {
+        names.push_back(entry.name.empty() ? entry.name : longName(entry.name));
+    }
+    uniqueNames(names);
+
+    uint16_t lfn[LAYOUT_MAX_LFN];
+    uint32_t dirEntries = 0;
+    for (size_t i = 0; i < _entries.size(); i++) {
+        Entry &entry = _entries[i];
+        entry.name = names[i];
+        entry.cluster = entry.clusters = entry.sector = 0;
+        entry.lfnCount = 0;
+        // FAT32 sizes are 32 bits; such files are left out of the directory.
+        if (entry.name.empty() || entry.size > 0xFFFFFFFFULL) continue;
+        size_t units = utf8ToUtf16(entry.name, lfn, LAYOUT_MAX_LFN);
+        if (!units) continue;
+        entry.lfnCount = (uint8_t)((units + LAYOUT_LFN_CHARS - 1) / LAYOUT_LFN_CHARS);
+        dirEntries += entry.lfnCount + 1;
+    }
+    if (dirEntries > LAYOUT_MAX_DIR) {
+        return false;
+    }
+
+    uint32_t clusterBytes = spc * LAYOUT_SECTOR_SIZE;
+    _clusterSectors = spc;
+    _dirClusters = (dirEntries * 32 + clusterBytes - 1) / clusterBytes;
+    if (!_dirClusters) _dirClusters = 1;
+    _nextCluster = 2 + _dirClusters;
+
+    for (Entry &entry : _entries) {
+        if (!entry.lfnCount || !entry.size) continue;
+        uint32_t n = (uint32_t)((entry.size + clusterBytes - 1) / clusterBytes);
+        if (n > _clusterCount + 2 - _nextCluster) {
+            _clusterSectors = 0;
+            return false;
+        }
+        entry.cluster = _nextCluster;
+        entry.clusters = n;
+        entry.sector = _dataStart + (entry.cluster - 2) * spc;
+        _nextCluster += n;
+    }
+    if (_nextCluster > _clusterCount + 2) {
+        _clusterSectors = 0;
+        return false;
+    }
+
+#if FF_FS_NORTC
+    _timestamp = (uint32_t)(FF_NORTC_YEAR - 1980) << 25 | (uint32_t)FF_NORTC_MON << 21 | (uint32_t)FF_NORTC_MDAY << 16;
+#else
+    _timestamp = get_fattime();
+#endif
+    // A different catalog gets a different serial, so anything keyed by it
+    // treats the rebuilt card as a new volume.
+    _serial = _timestamp ^ (uint32_t)_entries.size() * 0x9E3779B1u ^ _nextCluster;
+    return true;
+}
+
+uint8_t* FatLayout::nextSector(uint32_t lba)
+{
+    if (_workUsed && (lba != _workLba + _workUsed || _workUsed == _workSectors)) {
+        if (!flush()) {
+            return NULL;
+        }
+    }
+    if (!_workUsed) {
+        _workLba = lba;
+    }
+    uint8_t* sector = _work + (size_t)_workUsed++ * LAYOUT_SECTOR_SIZE;
+    memset(sector, 0, LAYOUT_SECTOR_SIZE);
+    return sector;
+}
+
+bool FatLayout::flush()
+{
+    if (!_workUsed) {
+        return true;
+    }
+    bool ok = _device->writeSectors(_work, _workLba, _workUsed);
+    _workUsed = 0;
+    return ok;
+}
+
+void FatLayout::buildBootSector(uint8_t* s) const
+{
+    memcpy(s + 0, "\xEB\x58\x90" "MSDOS5.0", 11);  // jump code, OEM name
+    st16(s + 11, LAYOUT_SECTOR_SIZE);               // bytes per sector
+    s[13] = (uint8_t)_clusterSectors;
+    st16(s + 14, (uint16_t)_reservedSectors);
+    s[16] = 2;                                      // number of FATs
+    s[21] = 0xF8;                                   // media descriptor
+    st16(s + 24, 63);                               // sectors per track
+    st16(s + 26, 255);                              // heads
+    st32(s + 28, _partStart);                       // hidden sectors
+    st32(s + 32, _partSectors);
+    st32(s + 36, _fatSectors);
+    st32(s + 44, 2);                                // root directory cluster
+    st16(s + 48, 1);                                // FSInfo sector
+    st16(s + 50, 6);                                // backup boot sector
+    s[64] = 0x80;                                   // drive number
+    s[66] = 0x29;                                   // extended boot signature
+    st32(s + 67, _serial);
+    memcpy(s + 71, "NO NAME    " "FAT32   ", 19);   // label, file system type
+    st16(s + 510, 0xAA55);
+}
+
+void FatLayout::buildFsInfo(uint8_t* s) const
+{
+    st32(s + 0, 0x41615252);
+    st32(s + 484, 0x61417272);
+    st32(s + 488, freeClusters());
+    st32(s + 492, _nextCluster - 1);    // last allocated cluster
+    st16(s + 510, 0xAA55);
+}
+
+// FAT sector index holds the entries for clusters index * 128 onwards.
+// cursor walks _entries forward, so a whole FAT costs one pass.
+void FatLayout::fillFatSector(uint8_t* s, uint32_t index, size_t &cursor) const
+{
+    uint32_t first = index * (LAYOUT_SECTOR_SIZE / 4);
+    uint32_t dirEnd = 2 + _dirClusters;
+
+    for (uint32_t i = 0; i < LAYOUT_SECTOR_SIZE / 4; i++) {
+        uint32_t c = first + i;
+        uint32_t v = 0;
+
+        if (c == 0) {
+            v = 0x0FFFFFF8;
+        } else if (c == 1) {
+            v = LAYOUT_EOC;
+        } else if (c < dirEnd) {
+            v = (c + 1 == dirEnd) ? LAYOUT_EOC : c + 1;
+        } else if (c < _nextCluster) {
+            while (cursor < _entries.size() &&
+                   (!_entries[cursor].cluster || c >= _entries[cursor].cluster + _entries[cursor].clusters)) {
+                cursor++;
+            }
+            if (cursor < _entries.size() && c >= _entries[cursor].cluster) {
+                const Entry &e = _entries[cursor];
+                v = (c + 1 == e.cluster + e.clusters) ? LAYOUT_EOC : c + 1;
+            }
+        } else {
+            break;
+        }
+        st32(s + i * 4, v);
+    }
+}
+
+bool FatLayout::writeDirectory()
+{
+    uint32_t lba = _dataStart;
+    uint32_t end = _dataStart + _dirClusters * _clusterSectors;
+    uint8_t* s = NULL;
+    uint32_t slot = LAYOUT_SECTOR_SIZE / 32;
+    uint16_t date = (uint16_t)(_timestamp >> 16), time = (uint16_t)_timestamp;
+    uint16_t lfn[LAYOUT_MAX_LFN];
+    uint8_t sfn[11];
+    uint8_t dirent[32];
+
+    for (size_t index = 0; index < _entries.size(); index++) {
+        const Entry &e = _entries[index];
+        if (!e.lfnCount) continue;
+
+        size_t units = utf8ToUtf16(e.name, lfn, LAYOUT_MAX_LFN);
+        makeShortName(e.name, (uint32_t)index, sfn);
+        uint8_t sum = shortNameSum(sfn);
+
+        // LFN entries go last-part first, followed by the short entry.
+        for (int ord = e.lfnCount; ord >= 0; ord--) {
+            memset(dirent, 0, sizeof dirent);
+            if (ord > 0) {
+                static const uint8_t offsets[LAYOUT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+                dirent[0] = (uint8_t)(ord | (ord == e.lfnCount ? 0x40 : 0));
+                dirent[11] = 0x0F;
+                dirent[13] = sum;
+                for (int k = 0; k < LAYOUT_LFN_CHARS; k++) {
+                    size_t u = (size_t)(ord - 1) * LAYOUT_LFN_CHARS + k;
+                    uint16_t ch = (u < units) ? lfn[u] : (u == units) ? 0x0000 : 0xFFFF;
+                    st16(dirent + offsets[k], ch);
+                }
+            } else {
+                memcpy(dirent, sfn, 11);
+                dirent[11] = 0x20;              // archive
+                st16(dirent + 14, time);
+                st16(dirent + 16, date);
+                st16(dirent + 18, date);
+                st16(dirent + 20, (uint16_t)(e.cluster >> 16));
+                st16(dirent + 22, time);
+                st16(dirent + 24, date);
+                st16(dirent + 26, (uint16_t)e.cluster);
+                st32(dirent + 28, (uint32_t)e.size);
+            }
+            if (slot == LAYOUT_SECTOR_SIZE / 32) {
+                s = nextSector(lba++);
+                if (!s) {
+                    return false;
+                }
+                slot = 0;
+            }
+            memcpy(s + slot++ * 32, dirent, 32);
+        }
+    }
+
+    // The rest of the directory is zero, which also ends the listing.
+    while (lba < end) {
+        if (!nextSector(lba++)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FatLayout::write(BlockDevice* device, uint8_t* work, size_t workSize)
+{
+    if (!device || !work || workSize < LAYOUT_SECTOR_SIZE || !_clusterSectors) {
+        return false;
+    }
+    _device = device;
+    _work = work;
+    _workSectors = (uint32_t)(workSize / LAYOUT_SECTOR_SIZE);
+    _workUsed = 0;
+
+    uint8_t* s = nextSector(0);
+    if (!s) {
+        return false;
+    }
+    uint8_t* pte = s + 446;
+    storeChs(pte + 1, _partStart);
+    pte[4] = 0x0C;                                  // FAT32 (LBA)
+    storeChs(pte + 5, _partStart + _partSectors - 1);
+    st32(pte + 8, _partStart);
+    st32(pte + 12, _partSectors);
+    st16(s + 510, 0xAA55);
+
+    for (uint32_t i = 0; i < _reservedSectors; i++) {
+        s = nextSector(_partStart + i);
+        if (!s) {
+            return false;
+        }
+        if (i == 0 || i == 6) {
+            buildBootSector(s);
+        } else if (i == 1 || i == 7) {
+            buildFsInfo(s);
+        }
+    }
+
+    uint32_t fatStart = _partStart + _reservedSectors;
+    for (uint32_t copy = 0; copy < 2; copy++) {
+        size_t cursor = 0;
+        for (uint32_t i = 0; i < _fatSectors; i++) {
+            s = nextSector(fatStart + copy * _fatSectors + i);
+            if (!s) {
+                return false;
+            }
+            fillFatSector(s, i, cursor);
+        }
+    }
+
+    if (!writeDirectory() || !flush()) {
+        return false;
+    }
+    return device->sync();
+}
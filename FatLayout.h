@@ -0,0 +1,89 @@
+#ifndef _FAT_LAYOUT_H_
+#define _FAT_LAYOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "BlockDevice.h"
+
+/*
+ * Builds a complete FAT32 volume for a flat catalog without going through
+ * FatFs: MBR, boot sector, FSInfo, both FATs and the root directory with
+ * long names. Every file gets one contiguous cluster run, the same shape
+ * f_expand() produces, so the result mounts and behaves like a card that
+ * was formatted and populated file by file.
+ *
+ * plan() decides the geometry and where each file goes. write() then
+ * streams the metadata to the device in ascending LBA order. The file
+ * data area is not touched.
+ */
+class FatLayout
+{
+public:
+    struct Entry {
+        std::string name;   // long name, UTF-8
+        uint64_t size;
+        uint32_t cluster;   // first cluster (0: empty or not listed)
+        uint32_t clusters;
+        uint32_t sector;    // LBA of the first data sector
+        uint8_t lfnCount;   // LFN directory entries ahead of the SFN one
+    };
+
+    FatLayout();
+
+    // name with what a long name cannot hold (\ / : * ? " < > | and control
+    // characters) turned into '_', and without the leading spaces and the
+    // trailing dots and spaces FatFs would strip.
+    static std::string longName(const std::string &name);
+    // Renames every non-empty name that matches an earlier one, ignoring
+    // case as FatFs compares them, to "name (2).ext", "name (3).ext"...
+    static void uniqueNames(std::vector<std::string> &names);
+
+    void clear();
+    // Files are listed and allocated in the order they are added. plan()
+    // makes the names valid and unique.
+    void add(const std::string &name, uint64_t size);
+    bool plan(uint32_t deviceSectors);
+    bool write(BlockDevice* device, uint8_t* work, size_t workSize);
+
+    size_t count() const { return _entries.size(); }
+    const Entry &entry(size_t index) const { return _entries[index]; }
+
+    uint32_t partitionStart() const { return _partStart; }
+    uint32_t sectorsPerCluster() const { return _clusterSectors; }
+    uint32_t dataStart() const { return _dataStart; }
+    uint32_t clusterCount() const { return _clusterCount; }
+    uint32_t freeClusters() const { return _clusterCount - (_nextCluster - 2); }
+
+private:
+    uint8_t* nextSector(uint32_t lba);
+    bool flush();
+    void buildBootSector(uint8_t* sector) const;
+    void buildFsInfo(uint8_t* sector) const;
+    void fillFatSector(uint8_t* sector, uint32_t index, size_t &cursor) const;
+    bool writeDirectory();
+
+    std::vector<Entry> _entries;
+    uint32_t _partStart;
+    uint32_t _partSectors;
+    uint32_t _reservedSectors;
+    uint32_t _fatSectors;
+    uint32_t _clusterSectors;
+    uint32_t _clusterCount;
+    uint32_t _dataStart;
+    uint32_t _dirClusters;
+    uint32_t _nextCluster;
+    uint32_t _timestamp;
+    uint32_t _serial;
+
+    // Write-out state: the work buffer collects consecutive sectors and goes
+    // out as one multi-block write whenever it fills or the LBA jumps.
+    BlockDevice* _device;
+    uint8_t* _work;
+    uint32_t _workSectors;
+    uint32_t _workUsed;
+    uint32_t _workLba;
+};
+
+#endif /* _FAT_LAYOUT_H_ */
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include "Arduino.h"
+#include "Hydrator.h"
+#include "Metrics.h"
+
+#define SECTOR_SIZE 512
+
+Hydrator::Hydrator()
+    : _source(nullptr), _store(nullptr), _lock(nullptr), _task(nullptr), _buffer(nullptr), _lastHostIo(0),
+      _recentCount(0), _cursor(0), _generation(0)
+{
+}
+
+Hydrator::~Hydrator()
+{
+    if (_task) {
+        vTaskDelete(_task);
+    }
+    free(_buffer);
+}
+
+bool Hydrator::begin(RemoteSource* source, RemoteStore* store, SemaphoreHandle_t lock)
+{
+    if (_task) {
+        return true;
+    }
+    _source = source;
+    _store = store;
+    _lock = lock;
+    size_t size = REMOTE_STORE_GRAIN * SECTOR_SIZE;
+    _buffer = (uint8_t*)(psramFound() ? ps_malloc(size) : malloc(size));
+    if (!_buffer) {
+        return false;
+    }
+    // Lowest priority above idle: everything else on the device comes first.
+    return xTaskCreate(task, "hydrate", HYDRATE_STACK, this, tskIDLE_PRIORITY + 1, &_task) == pdPASS;
+}
+
+// Ids of a replaced catalog name other files now.
+void Hydrator::follow()
+{
+    if (_generation != _store->generation()) {
+        _recentCount = 0;
+        _cursor = 0;
+        _generation = _store->generation();
+    }
+}
+
+void Hydrator::played(uint32_t id, uint32_t sector)
+{
+    if (!_task) {
+        return;
+    }
+    follow();
+    uint32_t i = 0;
+    while (i < _recentCount && _recent[i].id != id) {
+        i++;
+    }
+    if (i == _recentCount && _recentCount < HYDRATE_RECENT) {
+        _recentCount++;
+    }
+    for (i = i < HYDRATE_RECENT ? i : HYDRATE_RECENT - 1; i > 0; i--) {
+        _recent[i] = _recent[i - 1];
+    }
+    _recent[0].id = id;
+    _recent[0].sector = sector;
+}
+
+void Hydrator::task(void* arg)
+{
+    ((Hydrator*)arg)->run();
+}
+
+bool Hydrator::take(uint32_t id, uint32_t from, RemoteExtent &extent)
+{
+    if (id >= _store->files() || !_store->nextMissing(id, from, extent.sector, extent.count)) {
+        return false;
+    }
+    extent.id = id;
+    extent.buffer = _buffer;
+    return true;
+}
+
+// ClassCount: nothing to do for now.
+IoScheduler::Class Hydrator::plan(RemoteExtent &extent, bool quiet)
+{
+    follow();
+
+    for (uint32_t i = 0; i < _recentCount; i++) {
+        const Recent &r = _recent[i];
+        if (take(r.id, r.sector, extent) && extent.sector < r.sector + HYDRATE_PREFETCH_SECTORS) {
+            return IoScheduler::Prefetch;
+        }
+    }
+    if (!quiet) {
+        return IoScheduler::ClassCount;
+    }
+
+    for (uint32_t i = 0; i < _recentCount; i++) {
+        uint32_t id = _recent[i].id;
+        for (uint32_t ahead = 0; ahead <= HYDRATE_AHEAD; ahead++) {
+            if (take(id + ahead, 0, extent)) {
+                return IoScheduler::Hydrate;
+            }
+        }
+        if (id > 0 && take(id - 1, 0, extent)) {
+            return IoScheduler::Hydrate;
+        }
+    }
+
+    uint32_t files = _store->files();
+    for (uint32_t i = 0; i < files; i++) {
+        uint32_t id = (_cursor + i) % files;
+        if (take(id, 0, extent)) {
+            _cursor = id;
+            return IoScheduler::Hydrate;
+        }
+    }
+    return IoScheduler::ClassCount;
+}
+
+void Hydrator::run()
+{
+    for (;;) {
+        bool quiet = idle();
+        RemoteExtent extent;
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        IoScheduler::Class cls = plan(extent, quiet);
+        uint32_t generation = _generation;
+        xSemaphoreGive(_lock);
+        if (cls == IoScheduler::ClassCount) {
+            vTaskDelay(pdMS_TO_TICKS(quiet ? HYDRATE_SLEEP_MS : HYDRATE_IDLE_MS));
+            continue;
+        }
+
+        IoScheduler::Scope scope(ioScheduler, cls);
+        if (!_source->fetch(&extent, 1)) {
+            vTaskDelay(pdMS_TO_TICKS(HYDRATE_SLEEP_MS));
+            continue;
+        }
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        if (generation == _store->generation() && _store->fill(extent)) {
+            METRIC_COUNT(METRIC_HYDRATE_BYTES, extent.count * SECTOR_SIZE);
+        }
+        xSemaphoreGive(_lock);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef _HYDRATOR_H_
+#define _HYDRATOR_H_
+
+#include <stdint.h>
+#include "Arduino.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "RemoteSource.h"
+#include "RemoteStore.h"
+#include "IoScheduler.h"
+
+// The host has to leave the drive alone this long before hydration starts,
+// and it stops within one grain of the host coming back.
+#ifndef HYDRATE_IDLE_MS
+#define HYDRATE_IDLE_MS 1000
+#endif
+
+// Nap after finding nothing to do, or after a failed fetch.
+#ifndef HYDRATE_SLEEP_MS
+#define HYDRATE_SLEEP_MS 5000
+#endif
+
+// Sectors past where the host last read a file that are fetched ahead of
+// it while the host is still busy.
+#ifndef HYDRATE_PREFETCH_SECTORS
+#define HYDRATE_PREFETCH_SECTORS 2048
+#endif
+
+// Recently played files remembered, and how many tracks after each are
+// taken before the rest of the catalog.
+#define HYDRATE_RECENT 4
+#define HYDRATE_AHEAD 2
+
+#define HYDRATE_STACK 4096
+
+/*
+ * Background task that copies whole catalog files into their sectors on
+ * the card, one store grain per fetch, so the drive turns local over time.
+ *
+ * While the host reads, it only prefetches: the grains up to
+ * HYDRATE_PREFETCH_SECTORS past where the host last read the files it
+ * played, under the Prefetch class, so host I/O still goes first at every
+ * grain. Once the host is idle it hydrates under the Hydrate class: the
+ * rest of the files played last, then the tracks after them and the one
+ * before (listing order is name order, so usually the same album), then
+ * the rest of the catalog from where the last sweep stopped.
+ *
+ * The fetch runs without filesLock, so host reads do not wait on it;
+ * only picking the grain and writing it to the card hold the lock. A grain
+ * fetched for a catalog that was replaced meanwhile is dropped.
+ */
+class Hydrator
+{
+public:
+    Hydrator();
+    ~Hydrator();
+
+    bool begin(RemoteSource* source, RemoteStore* store, SemaphoreHandle_t lock);
+    // Any MSC command. Safe from any task.
+    void hostIo() { _lastHostIo = millis(); }
+    // The host read file id at sector. Called under the lock.
+    void played(uint32_t id, uint32_t sector);
+
+private:
+    Hydrator(Hydrator const&);
+    Hydrator& operator=(Hydrator const&);
+
+    static void task(void* arg);
+    void run();
+    bool idle() const { return millis() - _lastHostIo >= HYDRATE_IDLE_MS; }
+    void follow();
+    IoScheduler::Class plan(RemoteExtent &extent, bool quiet);
+    bool take(uint32_t id, uint32_t from, RemoteExtent &extent);
+
+    RemoteSource* _source;
+    RemoteStore* _store;
+    SemaphoreHandle_t _lock;
+    TaskHandle_t _task;
+    uint8_t* _buffer;
+    volatile unsigned long _lastHostIo;
+    struct Recent {
+        uint32_t id;
+        uint32_t sector;
+    };
+
+    Recent _recent[HYDRATE_RECENT];     // newest first
+    uint32_t _recentCount;
+    uint32_t _cursor;
+    uint32_t _generation;
+};
+
+#endif /* _HYDRATOR_H_ */
@@ -0,0 +1,205 @@
+#include <string.h>
+#include "Arduino.h"
+#include "IoScheduler.h"
+#include "Metrics.h"
+
+static const uint32_t s_deadlines[IoScheduler::ClassCount] = {
+    0,
+    IO_DEADLINE_HOST_WRITE_MS,
+    IO_DEADLINE_PREFETCH_MS,
+    IO_DEADLINE_FLUSH_MS,
+    UINT32_MAX,
+};
+
+IoScheduler ioScheduler;
+
+IoScheduler::Scope::Scope(IoScheduler &scheduler, Class cls)
+    : _scheduler(scheduler), _previous(scheduler.current())
+{
+    _scheduler.setClass(xTaskGetCurrentTaskHandle(), cls);
+}
+
+IoScheduler::Scope::~Scope()
+{
+    _scheduler.setClass(xTaskGetCurrentTaskHandle(), _previous);
+}
+
+IoScheduler::IoScheduler()
+    : _lock(nullptr)
+{
+    memset(_gates, 0, sizeof(_gates));
+    memset(_tasks, 0, sizeof(_tasks));
+}
+
+IoScheduler::~IoScheduler()
+{
+    for (uint32_t r = 0; r < ResourceCount; r++) {
+        for (uint32_t i = 0; i < IO_WAITERS; i++) {
+            if (_gates[r].waiters[i].wake) {
+                vSemaphoreDelete(_gates[r].waiters[i].wake);
+            }
+        }
+    }
+    if (_lock) {
+        vSemaphoreDelete(_lock);
+    }
+}
+
+bool IoScheduler::begin()
+{
+    if (_lock) {
+        return true;
+    }
+    for (uint32_t r = 0; r < ResourceCount; r++) {
+        for (uint32_t i = 0; i < IO_WAITERS; i++) {
+            _gates[r].waiters[i].wake = xSemaphoreCreateBinary();
+            if (!_gates[r].waiters[i].wake) {
+                return false;
+            }
+        }
+    }
+    _lock = xSemaphoreCreateMutex();
+    return _lock != nullptr;
+}
+
+IoScheduler::Class IoScheduler::classOf(TaskHandle_t task) const
+{
+    for (uint32_t i = 0; i < IO_TASKS; i++) {
+        if (_tasks[i].task == task) {
+            return (Class)_tasks[i].cls;
+        }
+    }
+    return HostRead;
+}
+
+IoScheduler::Class IoScheduler::current()
+{
+    if (!_lock) {
+        return HostRead;
+    }
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    Class cls = classOf(xTaskGetCurrentTaskHandle());
+    xSemaphoreGive(_lock);
+    return cls;
+}
+
+// HostRead is the default and takes no entry.
+void IoScheduler::setClass(TaskHandle_t task, Class cls)
+{
+    if (!_lock) {
+        return;
+    }
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    TaskClass* entry = nullptr;
+    for (uint32_t i = 0; i < IO_TASKS; i++) {
+        if (_tasks[i].task == task) {
+            entry = &_tasks[i];
+            break;
+        }
+        if (!entry && !_tasks[i].task) {
+            entry = &_tasks[i];
+        }
+    }
+    if (entry) {
+        entry->task = cls == HostRead ? nullptr : task;
+        entry->cls = cls;
+    }
+    xSemaphoreGive(_lock);
+}
+
+uint32_t IoScheduler::rank(const Waiter &waiter, uint32_t now)
+{
+    return now - waiter.since >= s_deadlines[waiter.cls] ? HostRead : waiter.cls;
+}
+
+void IoScheduler::acquire(Resource resource)
+{
+    if (!_lock) {
+        return;
+    }
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    Gate &gate = _gates[resource];
+    METRIC_START(wait);
+
+    for (;;) {
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        if (gate.holder == self) {
+            gate.depth++;
+            xSemaphoreGive(_lock);
+            return;
+        }
+        bool queued = false;
+        for (uint32_t i = 0; i < IO_WAITERS; i++) {
+            queued |= gate.waiters[i].used;
+        }
+        if (!gate.holder && !queued) {
+            gate.holder = self;
+            gate.depth = 1;
+            xSemaphoreGive(_lock);
+            return;
+        }
+
+        Waiter* waiter = nullptr;
+        for (uint32_t i = 0; i < IO_WAITERS && !waiter; i++) {
+            if (!gate.waiters[i].used) {
+                waiter = &gate.waiters[i];
+            }
+        }
+        if (!waiter) {
+            xSemaphoreGive(_lock);
+            vTaskDelay(1);      // more waiters than slots; try again
+            continue;
+        }
+        Class cls = classOf(self);
+        waiter->task = self;
+        waiter->since = millis();
+        waiter->cls = cls;
+        waiter->used = true;
+        waiter->granted = false;
+        xSemaphoreGive(_lock);
+
+        // release() made this task the holder before waking it.
+        xSemaphoreTake(waiter->wake, portMAX_DELAY);
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        waiter->used = false;
+        xSemaphoreGive(_lock);
+        if (cls == HostRead) {
+            METRIC_STOP(METRIC_HOST_IO_WAIT, wait);
+        }
+        return;
+    }
+}
+
+void IoScheduler::release(Resource resource)
+{
+    if (!_lock) {
+        return;
+    }
+    Gate &gate = _gates[resource];
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    if (--gate.depth) {
+        xSemaphoreGive(_lock);
+        return;
+    }
+
+    // Most urgent first, longest waiting among equals.
+    uint32_t now = millis();
+    Waiter* next = nullptr;
+    for (uint32_t i = 0; i < IO_WAITERS; i++) {
+        Waiter &w = gate.waiters[i];
+        if (!w.used || w.granted) {
+            continue;
+        }
+        if (!next || rank(w, now) < rank(*next, now)
+            || (rank(w, now) == rank(*next, now) && now - w.since > now - next->since)) {
+            next = &w;
+        }
+    }
+    gate.holder = next ? next->task : nullptr;
+    if (next) {
+        gate.depth = 1;
+        next->granted = true;
+        xSemaphoreGive(next->wake);
+    }
+    xSemaphoreGive(_lock);
+}
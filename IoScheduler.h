@@ -0,0 +1,134 @@
+#ifndef _IO_SCHEDULER_H_
+#define _IO_SCHEDULER_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+// How long a waiting class may be passed over before it goes to the
+// front of the queue. Host reads always are at the front; hydration
+// only runs when nothing else wants the resource.
+#ifndef IO_DEADLINE_HOST_WRITE_MS
+#define IO_DEADLINE_HOST_WRITE_MS 20
+#endif
+#ifndef IO_DEADLINE_PREFETCH_MS
+#define IO_DEADLINE_PREFETCH_MS 200
+#endif
+#ifndef IO_DEADLINE_FLUSH_MS
+#define IO_DEADLINE_FLUSH_MS 1000
+#endif
+
+// Tasks that can wait on one resource at a time, and tasks that can run
+// under a class other than HostRead.
+#define IO_WAITERS 6
+#define IO_TASKS 6
+
+/*
+ * Hands out the card bus and the network to whoever needs them most:
+ *
+ *     HostRead > HostWrite > Prefetch > Flush > Hydrate
+ *
+ * A task's class comes from the innermost Scope it runs in, HostRead if
+ * none, so the code doing the I/O does not need to know who asked. A Slot
+ * holds a resource for one unit of work: one fetch of a few extents, one
+ * grain or map write, one file the loop writes through FatFs. When it
+ * ends the resource goes straight to the most urgent waiter, so background
+ * work yields at every extent boundary and a host read waits for at most
+ * one such unit. A waiter that has waited out its class's deadline counts
+ * as a host read, so flushes are never starved for good.
+ *
+ * Slots nest within a task. Take filesLock before a slot, never while
+ * holding one.
+ */
+class IoScheduler
+{
+public:
+    enum Class {
+        HostRead,
+        HostWrite,
+        Prefetch,
+        Flush,
+        Hydrate,
+        ClassCount
+    };
+    enum Resource {
+        Bus,        // the card
+        Net,        // remote fetches
+        ResourceCount
+    };
+
+    class Scope
+    {
+    public:
+        Scope(IoScheduler &scheduler, Class cls);
+        ~Scope();
+
+    private:
+        Scope(Scope const&);
+        Scope& operator=(Scope const&);
+
+        IoScheduler &_scheduler;
+        Class _previous;
+    };
+
+    class Slot
+    {
+    public:
+        Slot(IoScheduler &scheduler, Resource resource) : _scheduler(scheduler), _resource(resource)
+        {
+            _scheduler.acquire(resource);
+        }
+        ~Slot() { _scheduler.release(_resource); }
+
+    private:
+        Slot(Slot const&);
+        Slot& operator=(Slot const&);
+
+        IoScheduler &_scheduler;
+        Resource _resource;
+    };
+
+    IoScheduler();
+    ~IoScheduler();
+
+    bool begin();
+    Class current();
+
+    void acquire(Resource resource);
+    void release(Resource resource);
+
+private:
+    IoScheduler(IoScheduler const&);
+    IoScheduler& operator=(IoScheduler const&);
+
+    struct Waiter {
+        TaskHandle_t task;
+        SemaphoreHandle_t wake;
+        uint32_t since;
+        uint8_t cls;
+        bool used;
+        bool granted;       // holds the resource, not woken yet
+    };
+    struct Gate {
+        TaskHandle_t holder;
+        uint32_t depth;
+        Waiter waiters[IO_WAITERS];
+    };
+    struct TaskClass {
+        TaskHandle_t task;
+        uint8_t cls;
+    };
+
+    void setClass(TaskHandle_t task, Class cls);
+    Class classOf(TaskHandle_t task) const;
+    static uint32_t rank(const Waiter &waiter, uint32_t now);
+
+    SemaphoreHandle_t _lock;
+    Gate _gates[ResourceCount];
+    TaskClass _tasks[IO_TASKS];
+};
+
+extern IoScheduler ioScheduler;
+
+#endif /* _IO_SCHEDULER_H_ */
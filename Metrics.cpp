@@ -0,0 +1,137 @@
+#include <atomic>
+#include "Metrics.h"
+
+namespace
+{
+
+struct Histogram {
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> sum_us;   // wraps after ~71 minutes of total latency
+    std::atomic<uint32_t> max_us;
+    std::atomic<uint32_t> buckets[METRICS_BUCKETS];
+};
+
+Histogram s_stages[METRIC_STAGE_MAX];
+std::atomic<uint32_t> s_counters[METRIC_COUNTER_MAX];
+
+const char* const s_stageNames[METRIC_STAGE_MAX] = {
+    "msc_read",
+    "msc_write",
+    "sd_command",
+    "sd_busy",
+    "net_rtt",
+    "cache_lookup",
+    "host_io_wait",
+};
+
+const char* const s_counterNames[METRIC_COUNTER_MAX] = {
+    "msc_read_bytes",
+    "msc_write_bytes",
+    "msc_errors",
+    "cache_hits",
+    "cache_misses",
+    "net_requests",
+    "net_timeouts",
+    "net_read_bytes",
+    "net_wire_bytes",
+    "net_reconnects",
+    "net_replays",
+    "remote_hits",
+    "remote_misses",
+    "store_hits",
+    "store_fills",
+    "hydrate_bytes",
+    "media_changes",
+};
+
+unsigned bucketOf(uint32_t us)
+{
+    unsigned bucket = us ? 32 - __builtin_clz(us) : 0;
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+// Upper bound of the bucket holding the given fraction of the samples.
+uint32_t percentile(const uint32_t* buckets, uint32_t count, uint32_t permille)
+{
+    uint32_t want = (uint32_t)(((uint64_t)count * permille + 999) / 1000);
+    uint32_t seen = 0;
+    for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= want) {
+            return i ? (1u << i) - 1 : 0;
+        }
+    }
+    return UINT32_MAX;
+}
+
+}
+
+void metrics_record(metric_stage_t stage, uint32_t us)
+{
+    Histogram &h = s_stages[stage];
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.sum_us.fetch_add(us, std::memory_order_relaxed);
+    h.buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t max = h.max_us.load(std::memory_order_relaxed);
+    while (us > max && !h.max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+void metrics_count(metric_counter_t counter, uint32_t n)
+{
+    s_counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+// Snapshots are taken field by field while other tasks keep recording, so
+// a line can be off by the few samples that landed during the dump.
+void metrics_dump()
+{
+    for (unsigned c = 0; c < METRIC_COUNTER_MAX; c++) {
+        Serial.printf("%-16s %u\n", s_counterNames[c], s_counters[c].load(std::memory_order_relaxed));
+    }
+
+    for (unsigned s = 0; s < METRIC_STAGE_MAX; s++) {
+        Histogram &h = s_stages[s];
+        uint32_t buckets[METRICS_BUCKETS];
+        uint32_t count = h.count.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+            buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+        }
+        if (!count) {
+            Serial.printf("%-16s n=0\n", s_stageNames[s]);
+            continue;
+        }
+
+        Serial.printf("%-16s n=%u mean=%uus p50<=%uus p99<=%uus max=%uus\n", s_stageNames[s], count,
+                      h.sum_us.load(std::memory_order_relaxed) / count,
+                      percentile(buckets, count, 500), percentile(buckets, count, 990),
+                      h.max_us.load(std::memory_order_relaxed));
+        for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+            if (!buckets[i]) {
+                continue;
+            }
+            if (i == METRICS_BUCKETS - 1) {
+                Serial.printf("   >=%8uus %u\n", 1u << (i - 1), buckets[i]);
+            } else {
+                Serial.printf("    <%8uus %u\n", 1u << i, buckets[i]);
+            }
+        }
+    }
+}
+
+void metrics_reset()
+{
+    for (unsigned c = 0; c < METRIC_COUNTER_MAX; c++) {
+        s_counters[c].store(0, std::memory_order_relaxed);
+    }
+    for (unsigned s = 0; s < METRIC_STAGE_MAX; s++) {
+        Histogram &h = s_stages[s];
+        h.count.store(0, std::memory_order_relaxed);
+        h.sum_us.store(0, std::memory_order_relaxed);
+        h.max_us.store(0, std::memory_order_relaxed);
+        for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+            h.buckets[i].store(0, std::memory_order_relaxed);
+        }
+    }
+}
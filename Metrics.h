@@ -0,0 +1,91 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include "Arduino.h"
+#include "esp_timer.h"
+
+/*
+ * Counters and latency histograms for the I/O path. Updates are relaxed
+ * atomic adds, so any task (USB, network, loop) can record without a lock
+ * and a record costs a few instructions. metrics_dump() prints everything
+ * on the serial port; the loop calls it for the "stats" command.
+ *
+ * Histograms have power-of-two buckets in microseconds: bucket 0 counts
+ * zero, bucket i counts [2^(i-1), 2^i) and the last bucket takes the rest.
+ */
+
+// Set to 0 to compile every METRIC_* use out.
+#ifndef METRICS_ENABLED
+#define METRICS_ENABLED 1
+#endif
+
+// Set to 1 to print every MSC transfer and remote read on the serial port.
+// Off by default: a printf per sector costs more than the transfer.
+#ifndef DEBUG_TRACE
+#define DEBUG_TRACE 0
+#endif
+
+#define METRICS_BUCKETS 24
+
+typedef enum {
+    METRIC_MSC_READ,        // onRead, whole callback
+    METRIC_MSC_WRITE,       // onWrite, whole callback
+    METRIC_SD_COMMAND,      // one read/write/trim on the card
+    METRIC_SD_BUSY,         // polling a busy SPI card
+    METRIC_NET_RTT,         // remote fetch, first request to last byte
+    METRIC_CACHE_LOOKUP,    // block cache probe
+    METRIC_HOST_IO_WAIT,    // host read queued behind other I/O
+    METRIC_STAGE_MAX
+} metric_stage_t;
+
+typedef enum {
+    METRIC_MSC_READ_BYTES,
+    METRIC_MSC_WRITE_BYTES,
+    METRIC_MSC_ERRORS,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_NET_REQUESTS,
+    METRIC_NET_TIMEOUTS,
+    METRIC_NET_READ_BYTES,
+    METRIC_NET_WIRE_BYTES,  // off the TCP sockets, before decompression
+    METRIC_NET_RECONNECTS,
+    METRIC_NET_REPLAYS,     // requests sent again: stripes of a failed socket, UDP NACKs
+    METRIC_REMOTE_HITS,
+    METRIC_REMOTE_MISSES,
+    METRIC_STORE_HITS,      // extents read from their place on the card
+    METRIC_STORE_FILLS,     // fetched extents written to their place
+    METRIC_HYDRATE_BYTES,   // written to the card by the background task
+    METRIC_MEDIA_CHANGES,
+    METRIC_COUNTER_MAX
+} metric_counter_t;
+
+static inline uint32_t metrics_now()
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void metrics_record(metric_stage_t stage, uint32_t us);
+void metrics_count(metric_counter_t counter, uint32_t n);
+void metrics_dump();
+void metrics_reset();
+
+#if METRICS_ENABLED
+#define METRIC_START(t)             uint32_t t = metrics_now()
+#define METRIC_STOP(stage, t)       metrics_record(stage, metrics_now() - (t))
+#define METRIC_RECORD(stage, us)    metrics_record(stage, us)
+#define METRIC_COUNT(counter, n)    metrics_count(counter, n)
+#else
+#define METRIC_START(t)             do {} while (0)
+#define METRIC_STOP(stage, t)       do {} while (0)
+#define METRIC_RECORD(stage, us)    do {} while (0)
+#define METRIC_COUNT(counter, n)    do {} while (0)
+#endif
+
+#if DEBUG_TRACE
+#define debugf(...)                 Serial.printf(__VA_ARGS__)
+#else
+#define debugf(...)                 do {} while (0)
+#endif
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include "Arduino.h"
+#include "RemoteCache.h"
+#include "Metrics.h"
+
+#define SECTOR_SIZE 512
+#define EXTENT_BYTES (REMOTE_EXTENT_SECTORS * SECTOR_SIZE)
+
+RemoteCache::RemoteCache()
+    : _source(nullptr), _data(nullptr), _slots(nullptr), _slotCount(0), _clock(0),
+      _lastReadCached(false)
+{
+}
+
+RemoteCache::~RemoteCache()
+{
+    free(_data);
+    free(_slots);
+}
+
+bool RemoteCache::begin(RemoteSource* source)
+{
+    _source = source;
+    if (_data) {
+        return true;
+    }
+
+    uint32_t count = REMOTE_CACHE_EXTENTS;
+    while (!_data && count >= 2) {
+        _data = (uint8_t*)(psramFound() ? ps_malloc(count * EXTENT_BYTES) : malloc(count * EXTENT_BYTES));
+        if (!_data) count /= 2;
+    }
+    _slots = (Slot*)calloc(count, sizeof(Slot));
+    if (!_data || !_slots) {
+        free(_data);
+        free(_slots);
+        _data = nullptr;
+        _slots = nullptr;
+        return false;
+    }
+    _slotCount = count;
+    Serial.printf("Remote cache: %u extents of %u sectors\n", (unsigned)count, REMOTE_EXTENT_SECTORS);
+    return true;
+}
+
+void RemoteCache::invalidate()
+{
+    for (uint32_t i = 0; i < _slotCount; i++) {
+        _slots[i].used = 0;
+    }
+    _clock = 0;
+}
+
+int RemoteCache::find(uint32_t id, uint32_t extent)
+{
+    for (uint32_t i = 0; i < _slotCount; i++) {
+        if (_slots[i].used && _slots[i].id == id && _slots[i].extent == extent) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int RemoteCache::victim()
+{
+    uint32_t best = 0;
+    for (uint32_t i = 1; i < _slotCount; i++) {
+        if (_slots[i].used < _slots[best].used) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Claims a slot for the missed extent and for each uncached extent after
+// it, then fetches them together. Stops at the first cached extent so a
+// hit is never fetched again, and at half the cache so read-ahead cannot
+// flush the working set.
+int RemoteCache::load(uint32_t id, uint32_t fileSectors, uint32_t extent)
+{
+    RemoteExtent request[1 + REMOTE_READAHEAD_EXTENTS];
+    int slots[1 + REMOTE_READAHEAD_EXTENTS];
+    uint32_t limit = _slotCount / 2 > 0 ? _slotCount / 2 : 1;
+    size_t n = 0;
+
+    while (n < 1 + REMOTE_READAHEAD_EXTENTS && n < limit) {
+        uint32_t first = (extent + n) * REMOTE_EXTENT_SECTORS;
+        if (first >= fileSectors || (n && find(id, extent + n) >= 0)) {
+            break;
+        }
+        int slot = victim();
+        _slots[slot].id = id;
+        _slots[slot].extent = extent + n;
+        _slots[slot].used = ++_clock;
+
+        RemoteExtent &r = request[n];
+        r.id = id;
+        r.sector = first;
+        r.count = fileSectors - first < REMOTE_EXTENT_SECTORS ? fileSectors - first : REMOTE_EXTENT_SECTORS;
+        r.buffer = _data + slot * EXTENT_BYTES;
+        if (r.count < REMOTE_EXTENT_SECTORS) {
+            memset(r.buffer + r.count * SECTOR_SIZE, 0, (REMOTE_EXTENT_SECTORS - r.count) * SECTOR_SIZE);
+        }
+        slots[n++] = slot;
+    }
+
+    if (!_source->fetch(request, n)) {
+        for (size_t i = 0; i < n; i++) {
+            _slots[slots[i]].used = 0;
+        }
+        return -1;
+    }
+    uint32_t sectors = 0;
+    for (size_t i = 0; i < n; i++) {
+        sectors += request[i].count;
+    }
+    METRIC_COUNT(METRIC_NET_READ_BYTES, sectors * SECTOR_SIZE);
+    return slots[0];
+}
+
+bool RemoteCache::read(uint32_t id, uint32_t fileSectors, uint32_t sector, uint32_t offset,
+                       uint8_t* buffer, uint32_t size)
+{
+    uint64_t pos = (uint64_t)sector * SECTOR_SIZE + offset;
+    bool cached = true;
+
+    while (size) {
+        uint32_t extent = (uint32_t)(pos / EXTENT_BYTES);
+        uint32_t within = (uint32_t)(pos % EXTENT_BYTES);
+        uint32_t chunk = EXTENT_BYTES - within < size ? EXTENT_BYTES - within : size;
+
+        if ((uint64_t)extent * REMOTE_EXTENT_SECTORS >= fileSectors) {
+            if (buffer) memset(buffer, 0, chunk);   // cluster slack after the file
+        } else {
+            int slot = _data ? find(id, extent) : -1;
+            METRIC_COUNT(slot < 0 ? METRIC_REMOTE_MISSES : METRIC_REMOTE_HITS, 1);
+            if (slot < 0) {
+                cached = false;
+                slot = _data && _source ? load(id, fileSectors, extent) : -1;
+                if (slot < 0) {
+                    _lastReadCached = false;
+                    return false;
+                }
+            }
+            _slots[slot].used = ++_clock;
+            if (buffer) memcpy(buffer, _data + slot * EXTENT_BYTES + within, chunk);
+        }
+
+        if (buffer) buffer += chunk;
+        pos += chunk;
+        size -= chunk;
+    }
+
+    _lastReadCached = cached;
+    return true;
+}
+
+bool RemoteCache::contains(uint32_t id, uint32_t fileSectors, uint32_t sector, uint32_t offset, uint32_t size)
+{
+    uint64_t pos = (uint64_t)sector * SECTOR_SIZE + offset;
+    uint64_t end = pos + size;
+
+    for (uint32_t extent = (uint32_t)(pos / EXTENT_BYTES); (uint64_t)extent * EXTENT_BYTES < end; extent++) {
+        if ((uint64_t)extent * REMOTE_EXTENT_SECTORS < fileSectors && (!_data || find(id, extent) < 0)) {
+            return false;
+        }
+    }
+    return true;
+}
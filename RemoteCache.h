@@ -0,0 +1,74 @@
+#ifndef _REMOTE_CACHE_H_
+#define _REMOTE_CACHE_H_
+
+#include <stdint.h>
+#include "RemoteSource.h"
+
+// Sectors per cached extent, aligned to the start of the file.
+#ifndef REMOTE_EXTENT_SECTORS
+#define REMOTE_EXTENT_SECTORS 64
+#endif
+
+// Extents kept in RAM (32 KiB each at the default size). Halved at begin()
+// until the buffer fits.
+#ifndef REMOTE_CACHE_EXTENTS
+#define REMOTE_CACHE_EXTENTS 16
+#endif
+
+// Extents after a missed one that are fetched along with it, as long as
+// they are in the same file and not cached yet.
+#ifndef REMOTE_READAHEAD_EXTENTS
+#define REMOTE_READAHEAD_EXTENTS 3
+#endif
+
+/*
+ * Sector cache for catalog files, keyed by file id and extent. A miss
+ * fetches the missing extent and its read-ahead in one request from the
+ * source, so one round trip brings in several host transfers' worth and
+ * the source can spread it over its connections.
+ *
+ * Not locked: the MSC callbacks and the catalog swap already serialize on
+ * filesLock, and ids only mean something under that lock.
+ */
+class RemoteCache
+{
+public:
+    RemoteCache();
+    ~RemoteCache();
+
+    bool begin(RemoteSource* source);
+    // Copies size bytes of file id, starting offset bytes into sector, to
+    // buffer. fileSectors bounds read-ahead; sectors past it read as zeros.
+    // A null buffer only brings the sectors in.
+    bool read(uint32_t id, uint32_t fileSectors, uint32_t sector, uint32_t offset,
+              uint8_t* buffer, uint32_t size);
+    // Whether read() would be served without a fetch.
+    bool contains(uint32_t id, uint32_t fileSectors, uint32_t sector, uint32_t offset, uint32_t size);
+    // Whether the last read() was served without a fetch.
+    bool lastReadCached() const { return _lastReadCached; }
+    // Forget everything; ids change meaning with every catalog.
+    void invalidate();
+
+private:
+    RemoteCache(RemoteCache const&);
+    RemoteCache& operator=(RemoteCache const&);
+
+    struct Slot {
+        uint32_t id;
+        uint32_t extent;
+        uint32_t used;      // LRU stamp, 0: empty
+    };
+
+    int find(uint32_t id, uint32_t extent);
+    int victim();
+    int load(uint32_t id, uint32_t fileSectors, uint32_t extent);
+
+    RemoteSource* _source;
+    uint8_t* _data;
+    Slot* _slots;
+    uint32_t _slotCount;
+    uint32_t _clock;
+    bool _lastReadCached;
+};
+
+#endif /* _REMOTE_CACHE_H_ */
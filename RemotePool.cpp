@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include "RemotePool.h"
+#include "Metrics.h"
+#include "IoScheduler.h"
+
+#define SECTOR_SIZE 512
+
+RemotePool::RemotePool()
+    : _host(nullptr), _port(0), _count(0), _lock(nullptr),
+      _backoff(REMOTE_BACKOFF_MIN_MS, REMOTE_BACKOFF_MAX_MS),
+      _stripes(nullptr), _stripeCount(0), _stripeCapacity(0), _left(0), _order(0)
+{
+    for (Connection &conn : _conns) {
+        conn.up = false;
+        conn.heard = 0;
+        beginReply(conn, -1);
+    }
+}
+
+RemotePool::~RemotePool()
+{
+    for (uint8_t i = 0; i < _count; i++) {
+        drop(_conns[i]);
+    }
+    free(_stripes);
+    if (_lock) {
+        vSemaphoreDelete(_lock);
+    }
+}
+
+void RemotePool::begin(const char* host, uint16_t port, uint8_t connections)
+{
+    if (!_lock) {
+        _lock = xSemaphoreCreateMutex();
+    }
+    _host = host;
+    _port = port;
+    _count = connections < REMOTE_CONNECTIONS ? connections : REMOTE_CONNECTIONS;
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    while (connected() < _count && reconnect()) {
+    }
+    xSemaphoreGive(_lock);
+}
+
+void RemotePool::maintain()
+{
+    if (!_lock || xSemaphoreTake(_lock, 0) != pdTRUE) {
+        return;
+    }
+    for (uint8_t i = 0; i < _count; i++) {
+        if (_conns[i].up && !_conns[i].client.connected()) {
+            drop(_conns[i]);
+        }
+    }
+    if (connected() < _count) {
+        reconnect();
+    }
+    xSemaphoreGive(_lock);
+}
+
+uint8_t RemotePool::connected()
+{
+    uint8_t up = 0;
+    for (uint8_t i = 0; i < _count; i++) {
+        up += _conns[i].up;
+    }
+    return up;
+}
+
+// Opens the first closed socket if the backoff allows it.
+bool RemotePool::reconnect()
+{
+    if (!_backoff.due()) {
+        return false;
+    }
+    for (uint8_t i = 0; i < _count; i++) {
+        Connection &conn = _conns[i];
+        if (conn.up) {
+            continue;
+        }
+        if (!conn.client.connect(_host, _port, REMOTE_CONNECT_TIMEOUT_MS)) {
+            _backoff.failed();
+            debugf("Remote connection %u failed, next try in %u ms\n", i, _backoff.wait());
+            return false;
+        }
+        conn.client.setNoDelay(true);
+        conn.up = true;
+        beginReply(conn, -1);
+        _backoff.succeeded();
+        METRIC_COUNT(METRIC_NET_RECONNECTS, 1);
+        return true;
+    }
+    return false;
+}
+
+void RemotePool::drop(Connection &conn)
+{
+    if (conn.up) {
+        conn.client.stop();
+    }
+    conn.up = false;
+    beginReply(conn, -1);
+}
+
+// Points the socket at the stripe it answers next and resets the reply
+// framing: without compression a reply is just the stripe's bytes.
+void RemotePool::beginReply(Connection &conn, int32_t stripe)
+{
+    conn.next = stripe;
+    conn.headerGot = REMOTE_COMPRESSION ? 0 : sizeof(conn.header);
+    conn.packed = false;
+    conn.payload = stripe >= 0 ? _stripes[stripe].bytes : 0;
+}
+
+// Length word in front of a compressed-mode reply: bit 31 set for an LZ
+// block, which must be smaller than the stripe, or clear for raw bytes,
+// which must fill it exactly.
+bool RemotePool::parseHeader(Connection &conn, Stripe &stripe)
+{
+    uint32_t word = conn.header[0] | conn.header[1] << 8 | conn.header[2] << 16 | (uint32_t)conn.header[3] << 24;
+    conn.packed = word >> 31;
+    conn.payload = word & 0x7fffffff;
+    if (conn.packed) {
+        lz_decode_init(&conn.lz, stripe.dest, stripe.bytes);
+        return conn.payload && conn.payload < stripe.bytes;
+    }
+    return conn.payload == stripe.bytes;
+}
+
+// The socket's stream is out of step with its requests: close it and put
+// everything it still owed back in the queue.
+void RemotePool::fail(uint8_t conn)
+{
+    drop(_conns[conn]);
+    for (uint32_t s = 0; s < _stripeCount; s++) {
+        Stripe &stripe = _stripes[s];
+        if (stripe.conn == conn && !stripe.done) {
+            stripe.conn = Unsent;
+            METRIC_COUNT(METRIC_NET_REPLAYS, 1);
+        }
+    }
+}
+
+bool RemotePool::cutStripes(const RemoteExtent* extents, size_t count)
+{
+    uint32_t needed = 0;
+    for (size_t e = 0; e < count; e++) {
+        needed += (extents[e].count + REMOTE_STRIPE_SECTORS - 1) / REMOTE_STRIPE_SECTORS;
+    }
+    if (needed > _stripeCapacity) {
+        Stripe* grown = (Stripe*)realloc(_stripes, needed * sizeof(Stripe));
+        if (!grown) {
+            return false;
+        }
+        _stripes = grown;
+        _stripeCapacity = needed;
+    }
+
+    _stripeCount = 0;
+    for (size_t e = 0; e < count; e++) {
+        const RemoteExtent &extent = extents[e];
+        for (uint32_t done = 0; done < extent.count; done += REMOTE_STRIPE_SECTORS) {
+            uint32_t sectors = extent.count - done;
+            Stripe &stripe = _stripes[_stripeCount++];
+            stripe.id = extent.id;
+            stripe.sector = extent.sector + done;
+            stripe.dest = extent.buffer + done * SECTOR_SIZE;
+            stripe.bytes = (sectors < REMOTE_STRIPE_SECTORS ? sectors : REMOTE_STRIPE_SECTORS) * SECTOR_SIZE;
+            stripe.conn = Unsent;
+            stripe.done = false;
+        }
+    }
+    _left = _stripeCount;
+    return true;
+}
+
+void RemotePool::nextStripe(uint8_t conn)
+{
+    int32_t next = -1;
+    for (uint32_t s = 0; s < _stripeCount; s++) {
+        const Stripe &stripe = _stripes[s];
+        if (stripe.conn == conn && !stripe.done && (next < 0 || stripe.order < _stripes[next].order)) {
+            next = s;
+        }
+    }
+    beginReply(_conns[conn], next);
+}
+
+// Deals the unsent stripes round robin over the sockets that are up.
+// Returns false when some are left and no socket is.
+bool RemotePool::send()
+{
+    uint8_t up[REMOTE_CONNECTIONS];
+    uint8_t upCount = 0;
+    uint32_t turn = 0;
+
+    for (uint32_t s = 0; s < _stripeCount; s++) {
+        Stripe &stripe = _stripes[s];
+        if (stripe.done || stripe.conn != Unsent) {
+            continue;
+        }
+        for (;;) {
+            if (!upCount) {
+                for (uint8_t i = 0; i < _count; i++) {
+                    if (_conns[i].up) up[upCount++] = i;
+                }
+                if (!upCount) {
+                    return false;
+                }
+            }
+            uint8_t c = up[turn++ % upCount];
+            Connection &conn = _conns[c];
+            if (!conn.up) {
+                upCount = 0;
+                continue;
+            }
+            if (conn.client.printf(REMOTE_COMPRESSION ? "getz %u %u %u\n" : "get %u %u %u\n",
+                                   stripe.id, stripe.sector, stripe.bytes / SECTOR_SIZE) <= 0) {
+                fail(c);
+                upCount = 0;
+                continue;
+            }
+            stripe.conn = c;
+            stripe.order = _order++;
+            if (conn.next < 0) {
+                beginReply(conn, s);
+                conn.heard = millis();
+            }
+            METRIC_COUNT(METRIC_NET_REQUESTS, 1);
+            break;
+        }
+    }
+    return true;
+}
+
+// Reads whatever any socket has into the stripe it is answering. Returns
+// true once every stripe is in, false when a socket failed (its stripes
+// are unsent again) or the deadline passed.
+bool RemotePool::receive(unsigned long deadline)
+{
+    while (_left) {
+        bool progress = false;
+        bool owed = false;
+        for (uint8_t i = 0; i < _count; i++) {
+            Connection &conn = _conns[i];
+            if (!conn.up || conn.next < 0) {
+                continue;
+            }
+            owed = true;
+            int available = conn.client.available();
+            if (available <= 0) {
+                if (!conn.client.connected() || millis() - conn.heard > REMOTE_IDLE_MS) {
+                    fail(i);
+                    return false;
+                }
+                continue;
+            }
+
+            Stripe &stripe = _stripes[conn.next];
+            int n;
+            if (conn.headerGot < sizeof(conn.header)) {
+                uint32_t want = sizeof(conn.header) - conn.headerGot;
+                n = conn.client.read(conn.header + conn.headerGot, (uint32_t)available < want ? available : want);
+                if (n <= 0) {
+                    continue;
+                }
+                conn.headerGot += n;
+                if (conn.headerGot == sizeof(conn.header) && !parseHeader(conn, stripe)) {
+                    fail(i);
+                    return false;
+                }
+            } else {
+                uint32_t want = (uint32_t)available < conn.payload ? available : conn.payload;
+                if (conn.packed) {
+                    // Through a small bounce buffer; the decoder's history
+                    // is the stripe itself.
+                    uint8_t chunk[REMOTE_LZ_CHUNK];
+                    n = conn.client.read(chunk, want < sizeof(chunk) ? want : sizeof(chunk));
+                    if (n > 0 && lz_decode(&conn.lz, chunk, n)) {
+                        fail(i);
+                        return false;
+                    }
+                } else {
+                    n = conn.client.read(stripe.dest + stripe.bytes - conn.payload, want);
+                }
+                if (n <= 0) {
+                    continue;
+                }
+                conn.payload -= n;
+            }
+            progress = true;
+            conn.heard = millis();
+            METRIC_COUNT(METRIC_NET_WIRE_BYTES, n);
+            if (conn.headerGot == sizeof(conn.header) && !conn.payload) {
+                if (conn.packed && !lz_decode_done(&conn.lz)) {
+                    fail(i);
+                    return false;
+                }
+                stripe.done = true;
+                _left--;
+                nextStripe(i);
+            }
+        }
+
+        if (!owed) {
+            return false;   // stripes left unsent by a failed send
+        }
+        if (!progress) {
+            if ((long)(millis() - deadline) >= 0) {
+                return false;
+            }
+            delay(1);
+        }
+    }
+    return true;
+}
+
+bool RemotePool::fetch(const RemoteExtent* extents, size_t count)
+{
+    if (!_lock) {
+        return false;
+    }
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Net);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+
+    METRIC_START(rtt);
+    unsigned long deadline = millis() + REMOTE_DEADLINE_MS;
+    bool ok = cutStripes(extents, count);
+    while (ok && _left) {
+        if (send()) {
+            if (receive(deadline)) {
+                break;
+            }
+        } else if (!reconnect()) {
+            uint32_t wait = _backoff.wait();
+            delay(wait ? (wait < 10 ? wait : 10) : 1);
+        }
+        ok = (long)(millis() - deadline) < 0;
+    }
+
+    if (ok) {
+        METRIC_STOP(METRIC_NET_RTT, rtt);
+    } else {
+        // Sockets still owing replies would hand them to the next fetch.
+        METRIC_COUNT(METRIC_NET_TIMEOUTS, 1);
+        for (uint8_t i = 0; i < _count; i++) {
+            if (_conns[i].next >= 0) {
+                drop(_conns[i]);
+            }
+        }
+    }
+    _stripeCount = 0;
+
+    xSemaphoreGive(_lock);
+    return ok;
+}
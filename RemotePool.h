@@ -0,0 +1,137 @@
+#ifndef _REMOTE_POOL_H_
+#define _REMOTE_POOL_H_
+
+#include <stdint.h>
+#include <WiFi.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "Backoff.h"
+#include "RemoteSource.h"
+#include "lz_stream.h"
+
+// Sockets kept open to the server. lwIP gives each its own receive window,
+// so K sockets keep K windows of data in flight.
+#ifndef REMOTE_CONNECTIONS
+#define REMOTE_CONNECTIONS 4
+#endif
+
+// Sectors per request line; an extent is cut into stripes of this size.
+#ifndef REMOTE_STRIPE_SECTORS
+#define REMOTE_STRIPE_SECTORS 16
+#endif
+
+// A socket owing a reply that delivers nothing for this long is taken
+// for dead and its requests go elsewhere.
+#ifndef REMOTE_IDLE_MS
+#define REMOTE_IDLE_MS 300
+#endif
+
+// Longest a fetch waits, reconnects included. The MSC read fails after
+// this instead of stalling the host.
+#ifndef REMOTE_DEADLINE_MS
+#define REMOTE_DEADLINE_MS 2000
+#endif
+
+// Set to 1 to ask for compressed replies ("getz"). The server still sends
+// a stripe raw when packing it would not pay off.
+#ifndef REMOTE_COMPRESSION
+#define REMOTE_COMPRESSION 0
+#endif
+
+// Stack bounce buffer for compressed replies.
+#define REMOTE_LZ_CHUNK 256
+
+#define REMOTE_CONNECT_TIMEOUT_MS 200
+#define REMOTE_BACKOFF_MIN_MS 5
+#define REMOTE_BACKOFF_MAX_MS 2000
+
+/*
+ * Data connections to the catalog server. A fetch cuts its extents into
+ * stripes, deals them round robin over the connected sockets and sends
+ * every request line before reading anything, so all sockets stream at
+ * once. Replies on one socket come back in request order; each is read
+ * straight into its place in the caller's buffers as bytes arrive on any
+ * socket.
+ *
+ *     get <id> <sector> <count>\n  ->  count * 512 bytes, zero padded
+ *                                      past the end of the file
+ *     getz <id> <sector> <count>\n ->  a little endian length word, then
+ *                                      that many bytes: an LZ block
+ *                                      (lz_stream.h) when bit 31 is set,
+ *                                      the raw sectors otherwise
+ *
+ * Compressed replies are decoded as they arrive, straight into the
+ * caller's buffer.
+ *
+ * A socket that closes or goes idle mid-reply is dropped, since its
+ * stream is no longer in step with its requests. Its unfinished stripes
+ * are sent again, whole, on the sockets still up, or on new ones once
+ * the backoff allows a reconnect; a fetch only fails at its deadline.
+ * Between fetches maintain() reopens dropped sockets. The catalog listing
+ * keeps its own connection.
+ */
+class RemotePool : public RemoteSource
+{
+public:
+    RemotePool();
+    ~RemotePool();
+
+    void begin(const char* host, uint16_t port, uint8_t connections = REMOTE_CONNECTIONS);
+    // Reopens one dropped socket when the backoff allows. Called from the
+    // loop; skips its turn while a fetch runs, the fetch reconnects itself.
+    void maintain();
+    uint8_t connected();
+
+    bool fetch(const RemoteExtent* extents, size_t count) override;
+
+private:
+    RemotePool(RemotePool const&);
+    RemotePool& operator=(RemotePool const&);
+
+    enum { Unsent = 0xff };
+
+    struct Stripe {
+        uint32_t id;
+        uint32_t sector;
+        uint8_t* dest;
+        uint32_t bytes;
+        uint32_t order;     // send order; a socket answers lowest first
+        uint8_t conn;       // Unsent until a request is out
+        bool done;
+    };
+    struct Connection {
+        WiFiClient client;
+        bool up;
+        int32_t next;       // stripe being read, -1: none owed
+        uint8_t header[4];  // length word of a getz reply
+        uint8_t headerGot;
+        bool packed;
+        uint32_t payload;   // reply bytes still to come after the header
+        lz_decoder_t lz;
+        unsigned long heard;
+    };
+
+    bool reconnect();
+    bool cutStripes(const RemoteExtent* extents, size_t count);
+    bool send();
+    void nextStripe(uint8_t conn);
+    void beginReply(Connection &conn, int32_t stripe);
+    bool parseHeader(Connection &conn, Stripe &stripe);
+    bool receive(unsigned long deadline);
+    void fail(uint8_t conn);
+    void drop(Connection &conn);
+
+    const char* _host;
+    uint16_t _port;
+    uint8_t _count;
+    SemaphoreHandle_t _lock;
+    Backoff _backoff;
+    Connection _conns[REMOTE_CONNECTIONS];
+    Stripe* _stripes;
+    uint32_t _stripeCount;
+    uint32_t _stripeCapacity;
+    uint32_t _left;
+    uint32_t _order;
+};
+
+#endif /* _REMOTE_POOL_H_ */
@@ -0,0 +1,30 @@
+#ifndef _REMOTE_SOURCE_H_
+#define _REMOTE_SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A run of sectors of one catalog file and where its data goes.
+struct RemoteExtent {
+    uint32_t id;        // FileInfo::id
+    uint32_t sector;    // first sector, counted from the start of the file
+    uint32_t count;
+    uint8_t* buffer;    // count * 512 bytes
+};
+
+/*
+ * Where the sectors of catalog files come from. RemoteCache fills itself
+ * through this interface and does not care how the bytes travel.
+ *
+ * fetch() fills every extent or fails as a whole; on failure the buffers
+ * hold undefined data. Sectors past the end of a file read as zeros.
+ */
+class RemoteSource
+{
+public:
+    virtual ~RemoteSource() {}
+
+    virtual bool fetch(const RemoteExtent* extents, size_t count) = 0;
+};
+
+#endif /* _REMOTE_SOURCE_H_ */
@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "Arduino.h"
+#include "RemoteStore.h"
+#include "Metrics.h"
+#include "IoScheduler.h"
+
+#define SECTOR_SIZE 512
+#define MAP_MAGIC 0x50414d52    // "RMAP"
+
+RemoteStore::RemoteStore()
+    : _upstream(nullptr), _device(nullptr), _image(nullptr), _imageSize(0), _mapSector(0),
+      _old(nullptr), _oldSize(0), _dirtyFirst(0), _dirtyLast(0), _generation(0), _dirty(false), _lastFetchLocal(false)
+{
+}
+
+RemoteStore::~RemoteStore()
+{
+    free(_image);
+    free(_old);
+}
+
+void RemoteStore::begin(RemoteSource* upstream, BlockDevice* device)
+{
+    _upstream = upstream;
+    _device = device;
+}
+
+uint32_t RemoteStore::fileWords(uint32_t sectors)
+{
+    uint32_t grains = (sectors + REMOTE_STORE_GRAIN - 1) / REMOTE_STORE_GRAIN;
+    return (grains + 31) / 32;
+}
+
+uint32_t RemoteStore::mapBytes(const std::vector<File> &files)
+{
+    uint32_t bytes = sizeof(Header) + files.size() * sizeof(Entry);
+    for (const File &file : files) {
+        bytes += fileWords(file.sectors) * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+void RemoteStore::load(uint8_t* image, size_t size)
+{
+    free(_old);
+    _old = nullptr;
+    _oldSize = 0;
+    if (size < sizeof(Header) || ((const Header*)image)->magic != MAP_MAGIC) {
+        free(image);
+        return;
+    }
+    _old = image;
+    _oldSize = size;
+}
+
+void RemoteStore::detach()
+{
+    flush();
+    if (_image) {
+        free(_old);
+        _old = _image;
+        _oldSize = _imageSize;
+        _image = nullptr;
+        _imageSize = 0;
+    }
+    _mapSector = 0;
+    _dirty = false;
+    _generation++;
+}
+
+bool RemoteStore::attach(const std::vector<File> &files, uint32_t mapSector)
+{
+    detach();
+
+    // The old map, sorted by key, if it is one and is whole.
+    const Header* oldHeader = (const Header*)_old;
+    const Entry* oldEntries = nullptr;
+    const uint32_t* oldBits = nullptr;
+    std::vector<const Entry*> byKey;
+    if (_old && oldHeader->grain == REMOTE_STORE_GRAIN
+        && sizeof(Header) + (uint64_t)oldHeader->files * sizeof(Entry) + (uint64_t)oldHeader->words * 4 <= _oldSize) {
+        oldEntries = (const Entry*)(_old + sizeof(Header));
+        oldBits = (const uint32_t*)(oldEntries + oldHeader->files);
+        for (uint32_t i = 0; i < oldHeader->files; i++) {
+            byKey.push_back(&oldEntries[i]);
+        }
+        std::sort(byKey.begin(), byKey.end(), [](const Entry* a, const Entry* b) { return a->key < b->key; });
+    }
+
+    uint32_t size = (mapBytes(files) + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    _image = mapSector ? (uint8_t*)(psramFound() ? ps_malloc(size) : malloc(size)) : nullptr;
+    if (!_image) {
+        free(_old);
+        _old = nullptr;
+        return false;
+    }
+    memset(_image, 0, size);
+
+    Header* header = (Header*)_image;
+    Entry* entries = (Entry*)(_image + sizeof(Header));
+    uint32_t* bits = (uint32_t*)(entries + files.size());
+    uint32_t word = 0;
+    uint32_t kept = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        Entry &e = entries[i];
+        uint32_t words = fileWords(files[i].sectors);
+        e.key = files[i].key;
+        e.sector = files[i].sector;
+        e.sectors = files[i].sectors;
+        e.word = word;
+
+        auto it = std::lower_bound(byKey.begin(), byKey.end(), e.key,
+                                   [](const Entry* a, uint32_t key) { return a->key < key; });
+        for (; e.sector && it != byKey.end() && (*it)->key == e.key; ++it) {
+            const Entry* o = *it;
+            if (o->sector == e.sector && o->sectors == e.sectors && o->word + words <= oldHeader->words) {
+                memcpy(bits + word, oldBits + o->word, words * sizeof(uint32_t));
+                kept++;
+                break;
+            }
+        }
+        word += words;
+    }
+    header->magic = MAP_MAGIC;
+    header->files = files.size();
+    header->words = word;
+    header->grain = REMOTE_STORE_GRAIN;
+
+    free(_old);
+    _old = nullptr;
+    _oldSize = 0;
+    _imageSize = size;
+    _mapSector = mapSector;
+    _generation++;
+    touch(_image, size);
+    Serial.printf("Remote store: %u files, %u kept from the last map\n", (unsigned)files.size(), (unsigned)kept);
+    return flush();
+}
+
+const RemoteStore::Entry* RemoteStore::entry(uint32_t id) const
+{
+    if (!_image || id >= ((const Header*)_image)->files) {
+        return nullptr;
+    }
+    const Entry* e = (const Entry*)(_image + sizeof(Header)) + id;
+    return e->sector ? e : nullptr;
+}
+
+uint32_t* RemoteStore::bits() const
+{
+    return (uint32_t*)(_image + sizeof(Header) + ((const Header*)_image)->files * sizeof(Entry));
+}
+
+uint32_t RemoteStore::files() const
+{
+    return _image ? ((const Header*)_image)->files : 0;
+}
+
+bool RemoteStore::valid(uint32_t id, uint32_t sector, uint32_t count) const
+{
+    const Entry* e = entry(id);
+    if (!e || !count || sector >= e->sectors || count > e->sectors - sector) {
+        return false;
+    }
+    const uint32_t* map = bits();
+    for (uint32_t g = sector / REMOTE_STORE_GRAIN; g <= (sector + count - 1) / REMOTE_STORE_GRAIN; g++) {
+        if (!(map[e->word + g / 32] & 1u << (g % 32))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Setting only covers grains the range fills up to the end of the file;
+// clearing covers every grain it touches.
+bool RemoteStore::mark(uint32_t id, uint32_t sector, uint32_t count, bool set)
+{
+    const Entry* e = entry(id);
+    if (!e || !count || sector >= e->sectors) {
+        return false;
+    }
+    uint32_t end = count > e->sectors - sector ? e->sectors : sector + count;
+    uint32_t first = set ? (sector + REMOTE_STORE_GRAIN - 1) / REMOTE_STORE_GRAIN : sector / REMOTE_STORE_GRAIN;
+    uint32_t last = set && end < e->sectors ? end / REMOTE_STORE_GRAIN : (end + REMOTE_STORE_GRAIN - 1) / REMOTE_STORE_GRAIN;
+    uint32_t* map = bits();
+    bool changed = false;
+
+    for (uint32_t g = first; g < last; g++) {
+        uint32_t* w = &map[e->word + g / 32];
+        uint32_t v = set ? *w | 1u << (g % 32) : *w & ~(1u << (g % 32));
+        if (v != *w) {
+            *w = v;
+            touch(w, sizeof(*w));
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool RemoteStore::nextMissing(uint32_t id, uint32_t from, uint32_t &sector, uint32_t &count) const
+{
+    const Entry* e = entry(id);
+    if (!e) {
+        return false;
+    }
+    const uint32_t* map = bits() + e->word;
+    uint32_t grains = (e->sectors + REMOTE_STORE_GRAIN - 1) / REMOTE_STORE_GRAIN;
+    uint32_t first = from / REMOTE_STORE_GRAIN;
+    for (uint32_t w = first / 32; w < fileWords(e->sectors); w++) {
+        // Grains before first count as present.
+        uint32_t present = map[w] | (w == first / 32 ? (1u << (first % 32)) - 1 : 0);
+        if (present == 0xffffffff) {
+            continue;
+        }
+        uint32_t g = w * 32 + __builtin_ctz(~present);
+        if (g >= grains) {
+            return false;
+        }
+        sector = g * REMOTE_STORE_GRAIN;
+        count = e->sectors - sector < REMOTE_STORE_GRAIN ? e->sectors - sector : REMOTE_STORE_GRAIN;
+        return true;
+    }
+    return false;
+}
+
+void RemoteStore::touch(const void* at, size_t size)
+{
+    uint32_t first = ((const uint8_t*)at - _image) / SECTOR_SIZE;
+    uint32_t last = ((const uint8_t*)at - _image + size - 1) / SECTOR_SIZE;
+    if (!_dirty || first < _dirtyFirst) _dirtyFirst = first;
+    if (!_dirty || last > _dirtyLast) _dirtyLast = last;
+    _dirty = true;
+}
+
+void RemoteStore::forget(uint32_t id, uint32_t sector, uint32_t count)
+{
+    if (mark(id, sector, count, false)) {
+        flush();
+    }
+}
+
+bool RemoteStore::flush()
+{
+    if (!_image || !_dirty) {
+        return true;
+    }
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(_device);
+    if (!_device->writeSectors(_image + _dirtyFirst * SECTOR_SIZE, _mapSector + _dirtyFirst,
+                               _dirtyLast - _dirtyFirst + 1)) {
+        return false;
+    }
+    _dirty = false;
+    return true;
+}
+
+bool RemoteStore::fetch(const RemoteExtent* extents, size_t count)
+{
+    _missing.clear();
+    {
+        IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+        BlockDeviceSession session(_image ? _device : nullptr);
+        for (size_t i = 0; i < count; i++) {
+            const RemoteExtent &x = extents[i];
+            if (valid(x.id, x.sector, x.count)
+                && _device->readSectors(x.buffer, entry(x.id)->sector + x.sector, x.count)) {
+                METRIC_COUNT(METRIC_STORE_HITS, 1);
+                continue;
+            }
+            _missing.push_back(x);
+        }
+    }
+    _lastFetchLocal = _missing.empty();
+    if (_missing.empty()) {
+        return true;
+    }
+    if (!_upstream->fetch(_missing.data(), _missing.size())) {
+        return false;
+    }
+
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(_image ? _device : nullptr);
+    for (const RemoteExtent &x : _missing) {
+        fill(x);
+    }
+    return true;
+}
+
+bool RemoteStore::fill(const RemoteExtent &extent)
+{
+    const Entry* e = entry(extent.id);
+    if (!e || extent.sector >= e->sectors || extent.count > e->sectors - extent.sector) {
+        return false;
+    }
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(_device);
+    if (!_device->writeSectors(extent.buffer, e->sector + extent.sector, extent.count)) {
+        return false;
+    }
+    mark(extent.id, extent.sector, extent.count, true);
+    METRIC_COUNT(METRIC_STORE_FILLS, 1);
+    return true;
+}
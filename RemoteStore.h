@@ -0,0 +1,132 @@
+#ifndef _REMOTE_STORE_H_
+#define _REMOTE_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "BlockDevice.h"
+#include "RemoteSource.h"
+#include "RemoteCache.h"
+
+// Sectors per valid bit. One RemoteCache extent, so a miss in RAM costs
+// one bit test.
+#ifndef REMOTE_STORE_GRAIN
+#define REMOTE_STORE_GRAIN REMOTE_EXTENT_SECTORS
+#endif
+
+// How often the loop writes out changed valid bits. A reset forgets the
+// fills of at most this long; their data is fetched again.
+#ifndef REMOTE_STORE_FLUSH_MS
+#define REMOTE_STORE_FLUSH_MS 5000
+#endif
+
+/*
+ * Keeps fetched file data on the card, in the sectors the layout already
+ * reserved for each catalog file, so a sector crosses the network once
+ * and comes from the card from then on, across resets and resyncs.
+ *
+ * Sits between RemoteCache and the network source: extents whose sectors
+ * are all valid are read from the card, the rest are fetched and written
+ * through before their bits are set.
+ *
+ * The valid bits live in a map file the layout allocates next to the
+ * catalog:
+ *
+ *     header      magic, file count, bitmap words, grain
+ *     entries     per file id: content key, first LBA, sectors, first word
+ *     bitmap      one bit per grain, files back to back
+ *
+ * The key hashes the name, size and version the server lists, so new
+ * content on the server gets a new key. A file keeps its bits over a
+ * resync only if its key, first LBA and size are all unchanged. flush()
+ * writes the changed map sectors. Data always reaches the card before
+ * the bit that covers it, so a reset loses at most bits, not data.
+ *
+ * Not locked: used under filesLock like RemoteCache.
+ */
+class RemoteStore : public RemoteSource
+{
+public:
+    struct File {
+        uint32_t key;
+        uint32_t sector;    // LBA of the first data sector, 0: not allocated
+        uint32_t sectors;
+    };
+
+    RemoteStore();
+    ~RemoteStore();
+
+    void begin(RemoteSource* upstream, BlockDevice* device);
+    // Takes the map a previous catalog left on the card, to carry its bits
+    // over in attach(), and frees it when done. Call before the new layout
+    // overwrites the file.
+    void load(uint8_t* image, size_t size);
+    // Map file size for a catalog.
+    static uint32_t mapBytes(const std::vector<File> &files);
+    // Serves files, indexed by id, with the map at mapSector. mapSector 0
+    // or an allocation failure leaves the store passing fetches through.
+    bool attach(const std::vector<File> &files, uint32_t mapSector);
+    // Passes everything through until the next attach(), for while the
+    // card is being laid out again.
+    void detach();
+    // The host is about to write sectors of file id on the card. Their
+    // bits are cleared on the card before it does.
+    void forget(uint32_t id, uint32_t sector, uint32_t count);
+    // Writes the map sectors changed since the last flush.
+    bool flush();
+
+    // Catalog files served, 0 while detached.
+    uint32_t files() const;
+    // Changes with every attach() and detach(); ids from before a change
+    // mean nothing after it.
+    uint32_t generation() const { return _generation; }
+    // First grain of file id at or after sector from that is not on the
+    // card yet, cut at the end of the file. False when there is none.
+    bool nextMissing(uint32_t id, uint32_t from, uint32_t &sector, uint32_t &count) const;
+    // Writes an extent fetched elsewhere to its place and marks it valid.
+    bool fill(const RemoteExtent &extent);
+
+    bool fetch(const RemoteExtent* extents, size_t count) override;
+    // Whether the last fetch() was served from the card alone.
+    bool lastFetchLocal() const { return _lastFetchLocal; }
+
+private:
+    RemoteStore(RemoteStore const&);
+    RemoteStore& operator=(RemoteStore const&);
+
+    struct Header {
+        uint32_t magic;
+        uint32_t files;
+        uint32_t words;
+        uint32_t grain;
+    };
+    struct Entry {
+        uint32_t key;
+        uint32_t sector;
+        uint32_t sectors;
+        uint32_t word;
+    };
+
+    static uint32_t fileWords(uint32_t sectors);
+    const Entry* entry(uint32_t id) const;
+    uint32_t* bits() const;
+    bool valid(uint32_t id, uint32_t sector, uint32_t count) const;
+    bool mark(uint32_t id, uint32_t sector, uint32_t count, bool set);
+    void touch(const void* at, size_t size);
+
+    RemoteSource* _upstream;
+    BlockDevice* _device;
+    uint8_t* _image;
+    uint32_t _imageSize;
+    uint32_t _mapSector;
+    uint8_t* _old;
+    uint32_t _oldSize;
+    uint32_t _dirtyFirst;
+    uint32_t _dirtyLast;
+    uint32_t _generation;
+    bool _dirty;
+    bool _lastFetchLocal;
+    std::vector<RemoteExtent> _missing;
+};
+
+#endif /* _REMOTE_STORE_H_ */
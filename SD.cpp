@@ -12,48 +12,118 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include "sd_diskio.h"
 #include "SD.h"
 
-SDFS::SDFS() {}
+SDFS::SDFS()
+    : _device(nullptr)
+{
+}
 
 bool SDFS::begin(uint8_t ssPin, SPIClass &spi, uint32_t frequency)
 {
-    spi.begin();
+    if (_device) {
+        return true;
+    }
 
-    int res = sdcard_init(ssPin, &spi, frequency);
-    if (res & STA_NOINIT) {
+    if (!_spi.begin(ssPin, spi, frequency)) {
         return false;
     }
 
+    _device = &_spi;
+    _cache.attach(_device);
     return true;
 }
 
+#ifdef SOC_SDMMC_HOST_SUPPORTED
+bool SDFS::beginSDMMC(bool mode1bit, int frequency)
+{
+    if (_device) {
+        return true;
+    }
+
+    if (!_sdmmc.begin(mode1bit, frequency)) {
+        return false;
+    }
+
+    _device = &_sdmmc;
+    _cache.attach(_device);
+    return true;
+}
+#endif
+
 void SDFS::end()
 {
-    sdcard_uninit();
+    _cache.detach();
+    if (_device == &_spi && !_spi.end()) {
+        log_e("SD card reported a failed write at unmount");
+    }
+#ifdef SOC_SDMMC_HOST_SUPPORTED
+    if (_device == &_sdmmc) {
+        _sdmmc.end();
+    }
+#endif
+    _device = nullptr;
+}
+
+BlockDevice* SDFS::device()
+{
+    return _cache.port(BlockCache::Local);
+}
+
+BlockDevice* SDFS::hostDevice()
+{
+    return _cache.port(BlockCache::Host);
+}
+
+BlockDevice* SDFS::storeDevice()
+{
+    return _cache.port(BlockCache::Store);
 }
 
 sdcard_type_t SDFS::type()
 {
-    return sdcard_type();
+    if (!_device) {
+        return CARD_NONE;
+    }
+    return _device->type();
 }
 
 uint64_t SDFS::size()
 {
-    size_t sectors = sdcard_num_sectors();
-    size_t sectorSize = sdcard_sector_size();
-    return (uint64_t)sectors * sectorSize;
+    if (!_device) {
+        return 0;
+    }
+    return (uint64_t)_device->sectorCount() * _device->sectorSize();
 }
 
 bool SDFS::read(uint8_t* buffer, uint32_t sector)
 {
-    return sd_read(buffer, sector);
+    BlockDevice* dev = device();
+    return dev && dev->read(buffer, sector);
+}
+
+bool SDFS::write(const uint8_t* buffer, uint32_t sector)
+{
+    BlockDevice* dev = device();
+    return dev && dev->write(buffer, sector);
+}
+
+bool SDFS::readSectors(uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    BlockDevice* dev = device();
+    return dev && dev->readSectors(buffer, sector, count);
+}
+
+bool SDFS::writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    BlockDevice* dev = device();
+    return dev && dev->writeSectors(buffer, sector, count);
 }
 
-bool SDFS::write(uint8_t* buffer, uint32_t sector)
+bool SDFS::sync()
 {
-    return sd_write(buffer, sector);
+    BlockDevice* dev = device();
+    return dev && dev->sync();
 }
 
 
@@ -16,17 +16,43 @@
 
 #include "SPI.h"
 #include "sd_defines.h"
+#include "BlockDevice.h"
+#include "BlockCache.h"
+#include "SPIBlockDevice.h"
+#include "SDMMCBlockDevice.h"
 
 class SDFS
 {
 public:
     SDFS();
     bool begin(uint8_t ssPin=SS, SPIClass &spi=SPI, uint32_t frequency=4000000);
+#ifdef SOC_SDMMC_HOST_SUPPORTED
+    bool beginSDMMC(bool mode1bit=false, int frequency=SDMMC_FREQ_DEFAULT);
+    SDMMCBlockDevice &sdmmc() { return _sdmmc; }
+#endif
     void end();
+    // FatFs and the firmware go through device(), the USB host through
+    // hostDevice(), the remote file store through storeDevice(); all
+    // share cache().
+    BlockDevice* device();
+    BlockDevice* hostDevice();
+    BlockDevice* storeDevice();
+    BlockCache &cache() { return _cache; }
     sdcard_type_t type();
     uint64_t size();
     bool read(uint8_t* buffer, uint32_t sector);
-    bool write(uint8_t* buffer, uint32_t sector);
+    bool write(const uint8_t* buffer, uint32_t sector);
+    bool readSectors(uint8_t* buffer, uint32_t sector, uint32_t count);
+    bool writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count);
+    bool sync();
+
+private:
+    BlockDevice* _device;
+    BlockCache _cache;
+    SPIBlockDevice _spi;
+#ifdef SOC_SDMMC_HOST_SUPPORTED
+    SDMMCBlockDevice _sdmmc;
+#endif
 };
 
 extern SDFS SD;
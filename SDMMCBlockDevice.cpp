@@ -0,0 +1,187 @@
+#include "Arduino.h"
+#include "SDMMCBlockDevice.h"
+
+#ifdef SOC_SDMMC_HOST_SUPPORTED
+
+#include "driver/sdmmc_host.h"
+#include "sdmmc_cmd.h"
+#include "esp_idf_version.h"
+
+SDMMCBlockDevice::SDMMCBlockDevice()
+    : _card(nullptr)
+{
+#ifdef SOC_SDMMC_USE_GPIO_MATRIX
+    _pin_clk = -1;
+    _pin_cmd = -1;
+    _pin_d0 = -1;
+    _pin_d1 = -1;
+    _pin_d2 = -1;
+    _pin_d3 = -1;
+#endif
+}
+
+#ifdef SOC_SDMMC_USE_GPIO_MATRIX
+bool SDMMCBlockDevice::setPins(int clk, int cmd, int d0, int d1, int d2, int d3)
+{
+    if (_card != nullptr) {
+        log_e("SDMMC pins must be set before begin()");
+        return false;
+    }
+
+    _pin_clk = clk;
+    _pin_cmd = cmd;
+    _pin_d0 = d0;
+    _pin_d1 = d1;
+    _pin_d2 = d2;
+    _pin_d3 = d3;
+    return true;
+}
+#endif
+
+bool SDMMCBlockDevice::begin(bool mode1bit, int frequency)
+{
+    if (_card != nullptr) {
+        return true;
+    }
+
+    sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+    host.flags = mode1bit ? SDMMC_HOST_FLAG_1BIT : SDMMC_HOST_FLAG_4BIT;
+    host.max_freq_khz = frequency;
+
+    sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+    slot_config.width = mode1bit ? 1 : 4;
+    slot_config.flags = SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+#ifdef SOC_SDMMC_USE_GPIO_MATRIX
+    if (_pin_clk < 0 || _pin_cmd < 0 || _pin_d0 < 0
+            || (!mode1bit && (_pin_d1 < 0 || _pin_d2 < 0 || _pin_d3 < 0))) {
+        log_e("SDMMC pins are not set");
+        return false;
+    }
+    slot_config.clk = (gpio_num_t)_pin_clk;
+    slot_config.cmd = (gpio_num_t)_pin_cmd;
+    slot_config.d0 = (gpio_num_t)_pin_d0;
+    slot_config.d1 = (gpio_num_t)_pin_d1;
+    slot_config.d2 = (gpio_num_t)_pin_d2;
+    slot_config.d3 = (gpio_num_t)_pin_d3;
+#endif
+
+    esp_err_t err = host.init();
+    if (err != ESP_OK) {
+        log_e("SDMMC host init failed: 0x%x", err);
+        return false;
+    }
+
+    err = sdmmc_host_init_slot(host.slot, &slot_config);
+    if (err != ESP_OK) {
+        log_e("SDMMC slot init failed: 0x%x", err);
+        host.deinit();
+        return false;
+    }
+
+    _card = (sdmmc_card_t*)malloc(sizeof(sdmmc_card_t));
+    if (!_card) {
+        host.deinit();
+        return false;
+    }
+
+    err = sdmmc_card_init(&host, _card);
+    if (err != ESP_OK) {
+        log_e("SDMMC card init failed: 0x%x", err);
+        free(_card);
+        _card = nullptr;
+        host.deinit();
+        return false;
+    }
+
+    return true;
+}
+
+void SDMMCBlockDevice::end()
+{
+    if (_card == nullptr) {
+        return;
+    }
+
+    sdmmc_host_deinit();
+    free(_card);
+    _card = nullptr;
+}
+
+bool SDMMCBlockDevice::read(uint8_t* buffer, uint32_t sector)
+{
+    return readSectors(buffer, sector, 1);
+}
+
+bool SDMMCBlockDevice::write(const uint8_t* buffer, uint32_t sector)
+{
+    return writeSectors(buffer, sector, 1);
+}
+
+bool SDMMCBlockDevice::readSectors(uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    if (_card == nullptr) {
+        return false;
+    }
+
+    return sdmmc_read_sectors(_card, buffer, sector, count) == ESP_OK;
+}
+
+bool SDMMCBlockDevice::writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    if (_card == nullptr) {
+        return false;
+    }
+
+    return sdmmc_write_sectors(_card, buffer, sector, count) == ESP_OK;
+}
+
+bool SDMMCBlockDevice::sync()
+{
+    // sdmmc_write_sectors() does not return before the card leaves the
+    // programming state, so there is nothing left to flush here.
+    return _card != nullptr;
+}
+
+bool SDMMCBlockDevice::trim(uint32_t start, uint32_t end)
+{
+    if (_card == nullptr || start > end) {
+        return false;
+    }
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    return sdmmc_erase_sectors(_card, start, end - start + 1, SDMMC_ERASE_ARG) == ESP_OK;
+#else
+    return true;
+#endif
+}
+
+sdcard_type_t SDMMCBlockDevice::type()
+{
+    if (_card == nullptr) {
+        return CARD_NONE;
+    }
+    if (_card->is_mmc) {
+        return CARD_MMC;
+    }
+    return (_card->ocr & SD_OCR_SDHC_CAP) ? CARD_SDHC : CARD_SD;
+}
+
+uint32_t SDMMCBlockDevice::sectorCount()
+{
+    if (_card == nullptr) {
+        return 0;
+    }
+
+    return _card->csd.capacity;
+}
+
+uint32_t SDMMCBlockDevice::sectorSize()
+{
+    if (_card == nullptr) {
+        return 512;
+    }
+
+    return _card->csd.sector_size;
+}
+
+#endif /* SOC_SDMMC_HOST_SUPPORTED */
@@ -0,0 +1,44 @@
+#ifndef _SDMMC_BLOCK_DEVICE_H_
+#define _SDMMC_BLOCK_DEVICE_H_
+
+#include "soc/soc_caps.h"
+#ifdef SOC_SDMMC_HOST_SUPPORTED
+
+#include "driver/sdmmc_types.h"
+#include "BlockDevice.h"
+
+class SDMMCBlockDevice : public BlockDevice
+{
+public:
+    SDMMCBlockDevice();
+#ifdef SOC_SDMMC_USE_GPIO_MATRIX
+    bool setPins(int clk, int cmd, int d0, int d1 = -1, int d2 = -1, int d3 = -1);
+#endif
+    bool begin(bool mode1bit = false, int frequency = SDMMC_FREQ_DEFAULT);
+    void end();
+
+    bool read(uint8_t* buffer, uint32_t sector) override;
+    bool write(const uint8_t* buffer, uint32_t sector) override;
+    bool readSectors(uint8_t* buffer, uint32_t sector, uint32_t count) override;
+    bool writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count) override;
+    bool sync() override;
+    bool trim(uint32_t start, uint32_t end) override;
+
+    sdcard_type_t type() override;
+    uint32_t sectorCount() override;
+    uint32_t sectorSize() override;
+
+private:
+    sdmmc_card_t* _card;
+#ifdef SOC_SDMMC_USE_GPIO_MATRIX
+    int8_t _pin_clk;
+    int8_t _pin_cmd;
+    int8_t _pin_d0;
+    int8_t _pin_d1;
+    int8_t _pin_d2;
+    int8_t _pin_d3;
+#endif
+};
+
+#endif /* SOC_SDMMC_HOST_SUPPORTED */
+#endif /* _SDMMC_BLOCK_DEVICE_H_ */
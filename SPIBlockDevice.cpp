@@ -0,0 +1,76 @@
+#include "sd_diskio.h"
+#include "SPIBlockDevice.h"
+
+SPIBlockDevice::SPIBlockDevice() {}
+
+bool SPIBlockDevice::begin(uint8_t ssPin, SPIClass &spi, uint32_t frequency)
+{
+    spi.begin();
+
+    int res = sdcard_init(ssPin, &spi, frequency);
+    if (res & STA_NOINIT) {
+        return false;
+    }
+
+    return true;
+}
+
+bool SPIBlockDevice::end()
+{
+    return sdcard_uninit() == 0;
+}
+
+bool SPIBlockDevice::read(uint8_t* buffer, uint32_t sector)
+{
+    return sd_read(buffer, sector);
+}
+
+bool SPIBlockDevice::write(const uint8_t* buffer, uint32_t sector)
+{
+    return sd_write(buffer, sector);
+}
+
+bool SPIBlockDevice::readSectors(uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    return sd_read_sectors(buffer, sector, count);
+}
+
+bool SPIBlockDevice::writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    return sd_write_sectors(buffer, sector, count);
+}
+
+bool SPIBlockDevice::sync()
+{
+    return sd_sync();
+}
+
+bool SPIBlockDevice::trim(uint32_t start, uint32_t end)
+{
+    return sd_trim(start, end);
+}
+
+sdcard_type_t SPIBlockDevice::type()
+{
+    return sdcard_type();
+}
+
+uint32_t SPIBlockDevice::sectorCount()
+{
+    return sdcard_num_sectors();
+}
+
+uint32_t SPIBlockDevice::sectorSize()
+{
+    return sdcard_sector_size();
+}
+
+bool SPIBlockDevice::beginSession()
+{
+    return sd_session_begin();
+}
+
+void SPIBlockDevice::endSession()
+{
+    sd_session_end();
+}
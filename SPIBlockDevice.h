@@ -0,0 +1,29 @@
+#ifndef _SPI_BLOCK_DEVICE_H_
+#define _SPI_BLOCK_DEVICE_H_
+
+#include "SPI.h"
+#include "BlockDevice.h"
+
+class SPIBlockDevice : public BlockDevice
+{
+public:
+    SPIBlockDevice();
+    bool begin(uint8_t ssPin, SPIClass &spi, uint32_t frequency);
+    bool end();
+
+    bool read(uint8_t* buffer, uint32_t sector) override;
+    bool write(const uint8_t* buffer, uint32_t sector) override;
+    bool readSectors(uint8_t* buffer, uint32_t sector, uint32_t count) override;
+    bool writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count) override;
+    bool sync() override;
+    bool trim(uint32_t start, uint32_t end) override;
+
+    sdcard_type_t type() override;
+    uint32_t sectorCount() override;
+    uint32_t sectorSize() override;
+
+    bool beginSession() override;
+    void endSession() override;
+};
+
+#endif /* _SPI_BLOCK_DEVICE_H_ */
@@ -0,0 +1,142 @@
+#include <atomic>
+#include "Arduino.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "Tracer.h"
+
+namespace
+{
+
+trace_record_t* s_ring = nullptr;
+uint32_t s_size = 0;
+std::atomic<uint32_t> s_head(0);    // next slot the producer fills
+std::atomic<uint32_t> s_tail(0);    // next slot the consumer reads
+std::atomic<uint32_t> s_dropped(0);
+std::atomic<bool> s_active(false);
+uint32_t s_epoch = 0;
+
+void fillHeader(trace_header_t &header, uint32_t records, uint32_t dropped)
+{
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.records = records;
+    header.dropped = dropped;
+}
+
+// Hands the records captured so far to out in at most two contiguous
+// pieces, then releases them to the producer.
+template<typename Sink>
+uint32_t drain(Sink out)
+{
+    uint32_t tail = s_tail.load(std::memory_order_relaxed);
+    uint32_t head = s_head.load(std::memory_order_acquire);
+    uint32_t count = head - tail;
+
+    trace_header_t header;
+    fillHeader(header, count, s_dropped.exchange(0, std::memory_order_relaxed));
+    if (!out((const uint8_t*)&header, sizeof(header))) {
+        return 0;
+    }
+
+    uint32_t first = tail % s_size;
+    uint32_t run = count < s_size - first ? count : s_size - first;
+    bool ok = out((const uint8_t*)(s_ring + first), run * sizeof(trace_record_t));
+    if (ok && run < count) {
+        ok = out((const uint8_t*)s_ring, (count - run) * sizeof(trace_record_t));
+    }
+
+    s_tail.store(head, std::memory_order_release);
+    return ok ? count : 0;
+}
+
+}
+
+bool trace_start(uint32_t records)
+{
+    // The USB task may be inside trace_record() even after a stop, so a
+    // ring once handed out is never freed or resized.
+    if (s_ring && records && records != s_size) {
+        Serial.printf("Trace ring already allocated, keeping %u records\n", (unsigned)s_size);
+    }
+    if (!s_ring) {
+        s_size = records ? records : TRACE_RECORDS;
+        size_t bytes = s_size * sizeof(trace_record_t);
+        s_ring = (trace_record_t*)(psramFound() ? ps_malloc(bytes) : malloc(bytes));
+        if (!s_ring) {
+            s_size = 0;
+            return false;
+        }
+    }
+    s_tail.store(s_head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    s_dropped.store(0, std::memory_order_relaxed);
+    s_epoch = (uint32_t)esp_timer_get_time();
+    s_active.store(true, std::memory_order_release);
+    return true;
+}
+
+void trace_stop()
+{
+    s_active.store(false, std::memory_order_release);
+}
+
+bool trace_active()
+{
+    return s_active.load(std::memory_order_relaxed);
+}
+
+void trace_record(uint8_t op, uint32_t lba, uint32_t offset, uint32_t size, uint8_t source,
+                  uint32_t startUs, uint32_t latencyUs)
+{
+    if (!s_active.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    uint32_t head = s_head.load(std::memory_order_relaxed);
+    if (head - s_tail.load(std::memory_order_acquire) >= s_size) {
+        s_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    trace_record_t &r = s_ring[head % s_size];
+    r.time_us = startUs - s_epoch;
+    r.lba = lba;
+    r.size = size;
+    r.latency_us = latencyUs;
+    r.offset = (uint16_t)offset;
+    r.op = op;
+    r.source = source;
+    s_head.store(head + 1, std::memory_order_release);
+}
+
+// Raw binary on the console; the header's magic lets the host tool find
+// the frame between log lines.
+void trace_dump_serial()
+{
+    if (!s_ring) {
+        return;
+    }
+    drain([](const uint8_t* data, size_t len) {
+        return Serial.write(data, len) == len;
+    });
+}
+
+bool trace_save(const char* path)
+{
+    FIL file;
+
+    if (!s_ring || f_open(&file, path, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+        return false;
+    }
+    bool ok = true;
+    uint32_t records = drain([&file, &ok](const uint8_t* data, size_t len) {
+        UINT written;
+        ok = f_write(&file, data, len, &written) == FR_OK && written == len;
+        return ok;
+    });
+    ok = f_close(&file) == FR_OK && ok;
+    if (ok) {
+        Serial.printf("Saved %u trace records to %s\n", records, path);
+    }
+    return ok;
+}
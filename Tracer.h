@@ -0,0 +1,33 @@
+#ifndef _TRACER_H_
+#define _TRACER_H_
+
+#include <stdint.h>
+#include "trace_format.h"
+
+// Ring size used when "trace start" does not give one (20 bytes each).
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 2048
+#endif
+
+/*
+ * Binary recorder for MSC transfers in trace_format.h records. The USB
+ * task is the only producer and the loop the only consumer, so the ring
+ * needs no lock. When the ring is full new records are dropped and
+ * counted rather than blocking a transfer; the count travels in the next
+ * dump header.
+ *
+ * The ring is allocated on the first trace_start() (PSRAM when present)
+ * and kept for good, so it is never freed under the USB task. A later
+ * start with another record count keeps the first size.
+ */
+bool trace_start(uint32_t records);
+void trace_stop();
+bool trace_active();
+void trace_record(uint8_t op, uint32_t lba, uint32_t offset, uint32_t size, uint8_t source,
+                  uint32_t startUs, uint32_t latencyUs);
+
+// Both drain the ring: a header, then every record captured so far.
+void trace_dump_serial();
+bool trace_save(const char* path);
+
+#endif /* _TRACER_H_ */
@@ -0,0 +1,96 @@
+#include "esp_system.h"
+#include "UdpSource.h"
+#include "Metrics.h"
+#include "IoScheduler.h"
+
+// Chunks per fetch the stack array below can describe.
+#define MAX_EXTENTS 8
+
+UdpSource::UdpSource()
+    : _host(nullptr), _port(0), _lock(nullptr), _xid(0)
+{
+}
+
+UdpSource::~UdpSource()
+{
+    _udp.stop();
+    if (_lock) {
+        vSemaphoreDelete(_lock);
+    }
+}
+
+bool UdpSource::begin(const char* host, uint16_t port)
+{
+    if (!_lock) {
+        _lock = xSemaphoreCreateMutex();
+    }
+    _host = host;
+    _port = port;
+    // A random start keeps replies to requests from before a reboot out.
+    _xid = esp_random();
+    return _lock && _udp.begin(0);
+}
+
+int UdpSource::send(void* ctx, const void* data, uint32_t len)
+{
+    UdpSource* self = (UdpSource*)ctx;
+    return self->_udp.beginPacket(self->_host, self->_port)
+        && self->_udp.write((const uint8_t*)data, len) == len
+        && self->_udp.endPacket();
+}
+
+int UdpSource::recv(void* ctx, void* data, uint32_t len, uint32_t waitMs)
+{
+    UdpSource* self = (UdpSource*)ctx;
+    unsigned long start = millis();
+
+    for (;;) {
+        int size = self->_udp.parsePacket();
+        if (size > 0) {
+            // An oversized datagram is cut short, and the length check in
+            // udp_fetch() throws it away.
+            self->_udp.read((uint8_t*)data, len);
+            return size;
+        }
+        if (millis() - start >= waitMs) {
+            return 0;
+        }
+        delay(1);
+    }
+}
+
+uint32_t UdpSource::now(void* ctx)
+{
+    return millis();
+}
+
+bool UdpSource::fetch(const RemoteExtent* extents, size_t count)
+{
+    if (!_lock || count > MAX_EXTENTS) {
+        return false;
+    }
+    udp_extent_t list[MAX_EXTENTS];
+    for (size_t i = 0; i < count; i++) {
+        list[i].id = extents[i].id;
+        list[i].sector = extents[i].sector;
+        list[i].count = extents[i].count;
+        list[i].buffer = extents[i].buffer;
+    }
+    const udp_link_t link = { send, recv, now, this };
+    udp_stats_t stats = {};
+
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Net);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    METRIC_START(rtt);
+    bool ok = udp_fetch(&link, &_xid, list, count, UDP_DEADLINE_MS, &stats) == 0;
+    if (ok) {
+        METRIC_STOP(METRIC_NET_RTT, rtt);
+    } else {
+        METRIC_COUNT(METRIC_NET_TIMEOUTS, 1);
+    }
+    xSemaphoreGive(_lock);
+
+    METRIC_COUNT(METRIC_NET_REQUESTS, stats.requests);
+    METRIC_COUNT(METRIC_NET_REPLAYS, stats.nacks);
+    return ok;
+}
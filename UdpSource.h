@@ -0,0 +1,47 @@
+#ifndef _UDP_SOURCE_H_
+#define _UDP_SOURCE_H_
+
+#include <stdint.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "RemoteSource.h"
+#include "udp_fetch.h"
+
+// Longest a fetch waits for its sectors, retransmits included.
+#ifndef UDP_DEADLINE_MS
+#define UDP_DEADLINE_MS 2000
+#endif
+
+/*
+ * RemoteSource over the datagram protocol in udp_fetch.h. There is no
+ * connection to lose: a dropped packet costs one NACK round, and a Wi-Fi
+ * outage only shows up as a fetch that runs into its deadline.
+ */
+class UdpSource : public RemoteSource
+{
+public:
+    UdpSource();
+    ~UdpSource();
+
+    bool begin(const char* host, uint16_t port);
+
+    bool fetch(const RemoteExtent* extents, size_t count) override;
+
+private:
+    UdpSource(UdpSource const&);
+    UdpSource& operator=(UdpSource const&);
+
+    static int send(void* ctx, const void* data, uint32_t len);
+    static int recv(void* ctx, void* data, uint32_t len, uint32_t waitMs);
+    static uint32_t now(void* ctx);
+
+    const char* _host;
+    uint16_t _port;
+    SemaphoreHandle_t _lock;
+    WiFiUDP _udp;
+    uint32_t _xid;
+};
+
+#endif /* _UDP_SOURCE_H_ */
@@ -6,7 +6,7 @@
 
 #include "diskio.h"
 #include "ffconf.h"
-#include "sd_diskio.h"
+#include "SD.h"
 
 #if 0
 #define IO_TRACE
@@ -17,7 +17,7 @@ DSTATUS disk_initialize(BYTE drive) {
     printf("disk_initialize\n");
 #endif
 
-    return 0;
+    return SD.device() ? 0 : STA_NOINIT;
 }
 
 DSTATUS disk_status(BYTE drive) {
@@ -25,7 +25,7 @@ DSTATUS disk_status(BYTE drive) {
     printf("disk_status\n");
 #endif
 
-    return 0;
+    return SD.device() ? 0 : STA_NOINIT;
 }
 
 DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
@@ -33,23 +33,38 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
     printf("disk_read(%d, %d): \n", (int)sector, count);
 #endif
 
-    return (DRESULT)!sd_read(buff, sector);
+    BlockDevice* device = SD.device();
+    if (!device) {
+        return RES_NOTRDY;
+    }
+
+    return (DRESULT)!device->readSectors(buff, sector, count);
 }
 
-DRESULT disk_write(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
 #ifdef IO_TRACE
     printf("disk_write(%d, %d): \n", (int)sector, count);
 #endif
 
-    return (DRESULT)!sd_write(buff, sector);
+    BlockDevice* device = SD.device();
+    if (!device) {
+        return RES_NOTRDY;
+    }
+
+    return (DRESULT)!device->writeSectors(buff, sector, count);
 }
 
 DRESULT disk_ioctl(BYTE drive, BYTE command, void *buffer) {
     DRESULT rv = RES_ERROR;
+    BlockDevice* device = SD.device();
+
+    if (!device) {
+        return RES_NOTRDY;
+    }
 
     switch (command) {
         case (CTRL_SYNC):
-            rv = RES_OK;
+            rv = device->sync() ? RES_OK : RES_ERROR;
             break;
 
         case (GET_BLOCK_SIZE): {
@@ -60,7 +75,7 @@ DRESULT disk_ioctl(BYTE drive, BYTE command, void *buffer) {
             break;
 
         case (GET_SECTOR_COUNT): {
-                DWORD nrSectors = sdcard_num_sectors();
+                DWORD nrSectors = device->sectorCount();
                 DWORD *pW = (DWORD *) buffer;
                 *pW = nrSectors;
 
@@ -68,6 +83,12 @@ DRESULT disk_ioctl(BYTE drive, BYTE command, void *buffer) {
             }
             break;
 
+        case (CTRL_TRIM): {
+                LBA_t *range = (LBA_t *) buffer;
+                rv = device->trim(range[0], range[1]) ? RES_OK : RES_ERROR;
+            }
+            break;
+
         default:
             printf("disk_ioctl: unsupported command! (%d)\n", command);
             rv = RES_PARERR;
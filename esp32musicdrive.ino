@@ -1,18 +1,81 @@
 #include "USB.h"
 #include "USBMSC.h"
 #include <sstream>
+#include <algorithm>
 #include <WiFi.h>
 #include <WiFiMulti.h>
 #include <SPI.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "SD.h"
 #include "ff.h"
+#include "FatLayout.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "RemotePool.h"
+#include "RemoteCache.h"
+#include "RemoteStore.h"
+#include "Hydrator.h"
+#include "IoScheduler.h"
+#include "UdpSource.h"
 
 #define HWSerial Serial
 
+// Set to 1 on boards that wire the card to the SDMMC peripheral (4-bit bus).
+#define USE_SDMMC 0
+#define SDMMC_CLK 36
+#define SDMMC_CMD 35
+#define SDMMC_D0 37
+#define SDMMC_D1 38
+#define SDMMC_D2 33
+#define SDMMC_D3 34
+
+// Set to 1 to reformat the card as a single FAT32 partition on boot.
+#define FORMAT_ON_BOOT 0
+// f_mkfs writes the FATs and the root cluster in chunks of this size, so a
+// bigger buffer turns the zero fill into long multi-block writes.
+#define FORMAT_WORK_SIZE (64 * 1024)
+// Set to 1 to write a prebuilt layout over the whole card for every catalog,
+// erasing whatever else is on it, instead of creating the catalog files one
+// by one through FatFs on the existing volume.
+#define QUICK_FORMAT 0
+// Where "trace save" puts the MSC trace; a QUICK_FORMAT catalog build
+// removes it.
+#define TRACE_FILE "mscTrace.bin"
+// Which sectors of the catalog files hold their data already (RemoteStore).
+#define REMOTE_MAP_FILE "remote.map"
+// How long the media stays away after the firmware changed metadata under
+// the host. Longer than the TEST UNIT READY polling of common hosts, so the
+// host sees the media go and come back and rereads the FAT.
+#define MEDIA_CHANGE_PULSE_MS 3000
+// Catalog server: the listing and the file data come from here.
+#define SERVER_HOST "192.168.69.3"
+#define SERVER_PORT 12345
+// Set to 0 to leave catalog files on the server until the host reads them,
+// instead of copying them to the card while the host is idle.
+#define HYDRATE_IN_BACKGROUND 1
+// Set to 0 to fetch remote sectors inside the MSC read callback, holding up
+// the USB task, instead of reporting the read not ready until they arrive.
+#define MSC_ASYNC_READ 1
+// Set to 1 to fetch file data over UDP (udp_fetch.h, same port) instead of
+// the TCP connection pool. The listing stays on TCP.
+#define REMOTE_UDP 0
+
 USBMSC MSC;
 
 WiFiMulti WiFiMulti;
 WiFiClient client;
+// File data connections, the copy they leave on the card, and the extents
+// kept in RAM.
+#if REMOTE_UDP
+UdpSource remoteSource;
+#else
+RemotePool remoteSource;
+#endif
+RemoteStore remoteStore;
+RemoteCache remoteCache;
+Hydrator hydrator;
+Backoff listBackoff(REMOTE_BACKOFF_MIN_MS, REMOTE_BACKOFF_MAX_MS);
 
 enum RequestType {
     List,
@@ -23,92 +86,564 @@ struct FileInfo {
     uint32_t id;
     std::string name;
     uint64_t size;
-    uint32_t sector;
+    uint32_t version;   // as listed by the server, 0 when it lists none
+    uint32_t sector;    // LBA of the first data sector
+    uint32_t sectors;   // data sectors backing size (0: not allocated)
+    DWORD linkMap[4];   // cluster link map in FatFs' cltbl format, one fragment
 };
 
+// The catalog the MSC callbacks serve from. A new list is built on the side
+// and swapped in under filesLock, so reads never see a half-built catalog.
 std::vector<FileInfo> files;
-bool verbose = false;
+SemaphoreHandle_t filesLock;
+// Whether the host sees the media, whether the loop took it away for a job
+// on the volume (holdMedia()) or for a media change pulse
+// (signalMediaChange()), and since when it is away. Only the loop task
+// changes them; mscWrite() reads mediaOnline under the host session.
+bool mediaOnline = false;
+bool mediaHeld = false;
+bool mediaPulse = false;
+unsigned long mediaOfflineSince = 0;
+// The remote read the fetch task works on. TinyUSB calls a read callback
+// that returned 0 again with the same command, so the callback queues the
+// fetch, returns 0 and serves the sectors from remoteCache once they are in.
+// Guarded by filesLock.
+struct PendingRead {
+    enum State {
+        Idle,
+        Queued,
+        Failed
+    };
+    State state;
+    uint32_t id;
+    uint32_t sectors;   // of the file
+    uint32_t sector;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t generation;    // remoteStore's, when queued
+};
+PendingRead pendingRead;
+SemaphoreHandle_t readRequested;
+SemaphoreHandle_t readDone;
 FATFS Fatfs;
 MKFS_PARM opt = { FM_FAT32 };
-BYTE _buff[512];
 uint8_t _tempBuff[512];
 String pendingRequest = "list /";
 int pendingRequestType = RequestType::List;
 
 
-static int32_t onWrite(uint32_t lba, uint32_t offset, uint8_t* buff, uint32_t buffSize) {
-    if (verbose) HWSerial.printf("MSC WRITE: lba: %u, offset: %u, bufsize: %u\n", lba, offset, buffSize);
-    bool res = true;
+// Every catalog file is one contiguous chain (FatLayout, or f_expand() with
+// opt 1), so its link map is written down from the first cluster alone.
+static void setLinkMap(FileInfo &file, DWORD cluster) {
+    DWORD clusterBytes = (DWORD)Fatfs.csize * FF_MAX_SS;
+    file.linkMap[0] = 4;
+    file.linkMap[1] = (DWORD)((file.size + clusterBytes - 1) / clusterBytes);
+    file.linkMap[2] = cluster;
+    file.linkMap[3] = 0;
+}
+
+// File offset to LBA through the link map, same lookup as FatFs clmt_clust().
+static uint32_t linkMapSector(const FileInfo &file, uint64_t offset) {
+    DWORD cluster = (DWORD)(offset / FF_MAX_SS / Fatfs.csize);
+    const DWORD* tbl = file.linkMap + 1;
+
+    for (;;) {
+        DWORD count = *tbl++;
+        if (count == 0) return 0;
+        if (cluster < count) break;
+        cluster -= count;
+        tbl++;
+    }
+
+    return Fatfs.database + (*tbl + cluster - 2) * Fatfs.csize + (DWORD)(offset / FF_MAX_SS) % Fatfs.csize;
+}
+
+// files is kept sorted by sector, so an LBA resolves with one binary search.
+// Callers hold filesLock for as long as they use the result.
+static FileInfo* findFile(uint32_t lba) {
+    auto it = std::upper_bound(files.begin(), files.end(), lba,
+                               [](uint32_t l, const FileInfo &f) { return l < f.sector; });
+    if (it == files.begin()) return nullptr;
+    --it;
+    if (lba - it->sector < it->sectors) return &*it;
+    return nullptr;
+}
+
+// Names the content of a file for RemoteStore: FNV-1a over name, size and
+// version, so a file the server changed does not inherit the old sectors.
+static uint32_t fileKey(const FileInfo &file) {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void* data, size_t len) {
+        for (size_t i = 0; i < len; i++) hash = (hash ^ ((const uint8_t*)data)[i]) * 16777619u;
+    };
+    mix(file.name.data(), file.name.size());
+    mix(&file.size, sizeof(file.size));
+    mix(&file.version, sizeof(file.version));
+    return hash;
+}
+
+// The store's view of a catalog, indexed by id like the listing.
+static std::vector<RemoteStore::File> storeFiles(const std::vector<FileInfo> &catalog) {
+    std::vector<RemoteStore::File> out(catalog.size());
+    for (const FileInfo &file : catalog) {
+        RemoteStore::File &f = out[file.id];
+        f.key = fileKey(file);
+        f.sector = file.sector;
+        f.sectors = (file.size + FF_MAX_SS - 1) / FF_MAX_SS;
+    }
+    return out;
+}
+
+// Work buffer comes from PSRAM when the board has it, otherwise from the heap,
+// halving the request until it fits; callers need at least one sector.
+static uint8_t* allocWork(size_t &size) {
+    void* work = NULL;
+
+    size = FORMAT_WORK_SIZE;
+    while (!work && size >= FF_MAX_SS) {
+        work = psramFound() ? ps_malloc(size) : malloc(size);
+        if (!work) size /= 2;
+    }
+    return (uint8_t*)work;
+}
+
+static FRESULT formatCard() {
+    size_t size;
+    uint8_t* work = allocWork(size);
+    if (!work) return FR_NOT_ENOUGH_CORE;
+
+    Serial.printf("Creating fat file system (%u byte work buffer)\n", (unsigned)size);
+    unsigned long start = millis();
+    FRESULT res;
+    {
+        IoScheduler::Scope scope(ioScheduler, IoScheduler::Flush);
+        IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+        BlockDeviceSession session(SD.device());
+        res = f_mkfs("", &opt, work, size);
+    }
+    free(work);
+    if (res != FR_OK) {
+        Serial.printf("Error making fat file system: %d\n", res);
+        return res;
+    }
+    Serial.printf("Created fat file system in %lu ms\n", millis() - start);
+    return FR_OK;
+}
+
+// The host may have rewritten the FAT or directories since FatFs last
+// looked. Remounting drops FatFs's own sector windows; the sectors come
+// back from the shared cache, not the card.
+static FRESULT refreshVolume() {
+    uint32_t first, last;
+    FRESULT res = FR_OK;
+
+    if (SD.cache().takeDirty(BlockCache::Host, first, last) || !Fatfs.fs_type) {
+        f_mount(NULL, "", 0);
+        res = f_mount(&Fatfs, "", 1);
+    }
+    if (res == FR_OK) SD.cache().setMetadataLimit(Fatfs.database);
+    return res;
+}
+
+static void setMediaOnline(bool online) {
+    MSC.mediaPresent(online);
+    if (mediaOnline && !online) mediaOfflineSince = millis();
+    mediaOnline = online;
+    mediaHeld = false;
+    mediaPulse = false;
+}
+
+// Takes the media from the host while the loop changes the volume through
+// FatFs, so the host neither writes under it nor reads a half-made FAT.
+// mscWrite() refuses writes until the media is back.
+static void holdMedia() {
+    if (!mediaOnline) return;
+    setMediaOnline(false);
+    mediaHeld = true;
+}
+
+// Tells the host the card changed under it. The USB stack answers TEST
+// UNIT READY itself, from the media present flag, and a failed READ or
+// WRITE reports its own sense, so the only change the host reliably
+// notices is the media going away for a few polls. A hold turns into the
+// pulse, counted from when the hold began; media that is offline for
+// another reason is a change once it comes back.
+static void signalMediaChange() {
+    uint32_t first, last;
+    if (!SD.cache().takeDirty(BlockCache::Local, first, last)) return;
+    Serial.printf("Metadata changed in sectors %u-%u\n", first, last);
+    METRIC_COUNT(METRIC_MEDIA_CHANGES, 1);
+    if (mediaOnline) {
+        setMediaOnline(false);
+    } else if (!mediaHeld) {
+        return;
+    }
+    mediaHeld = false;
+    mediaPulse = true;
+}
+
+// Starts a FatFs job on the volume. Once the media is held no host write
+// reaches the FAT or directories until the job is done, so the remount here,
+// after any write still in flight, leaves FatFs's window and its slots
+// valid for the whole job.
+static FRESULT holdVolume() {
+    holdMedia();
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(SD.device());
+    return refreshVolume();
+}
+
+// What the catalog files are called on the card: valid long names, unique
+// ignoring case, and never the store map's.
+static std::vector<std::string> fatNames(const std::vector<FileInfo> &catalog) {
+    std::vector<std::string> names(1, REMOTE_MAP_FILE);
+    for (const FileInfo &file : catalog) {
+        names.push_back(getFatFileName(file.name));
+    }
+    FatLayout::uniqueNames(names);
+    names.erase(names.begin());
+    return names;
+}
+
+// Writes the whole catalog volume in one ordered pass: no directory scans,
+// no FAT searches, and the card ends up in the same shape createFiles()
+// leaves it in. The whole volume changes, so the media is offline meanwhile.
+// The store map goes last, so the catalog files keep their places while
+// the map grows.
+static bool writeLayout(std::vector<FileInfo> &catalog, uint32_t &mapSector) {
+    FatLayout layout;
+    std::vector<std::string> names = fatNames(catalog);
+    mapSector = 0;
+    for (size_t i = 0; i < catalog.size(); i++) {
+        catalog[i].sector = 0;
+        catalog[i].sectors = 0;
+        layout.add(names[i], catalog[i].size);
+    }
+    layout.add(REMOTE_MAP_FILE, RemoteStore::mapBytes(storeFiles(catalog)));
+    if (!layout.plan(SD.device()->sectorCount())) {
+        Serial.printf("Catalog does not fit on the card\n");
+        return false;
+    }
+
+    size_t size;
+    uint8_t* work = allocWork(size);
+    if (!work) return false;
+
+    unsigned long start = millis();
+    holdMedia();
+    f_mount(NULL, "", 0);   // drop the cached view of the old volume
+    bool ok;
+    {
+        IoScheduler::Scope scope(ioScheduler, IoScheduler::Flush);
+        IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+        BlockDeviceSession session(SD.device());
+        ok = layout.write(SD.device(), work, size);
+    }
+    free(work);
+    FRESULT res = refreshVolume();
+    if (!ok || res != FR_OK) {
+        Serial.printf("Error writing layout: %d %d\n", ok, res);
+        mediaHeld = false;  // stays offline until a layout makes it
+        return false;
+    }
+    Serial.printf("Wrote layout for %u files in %lu ms\n", (unsigned)catalog.size(), millis() - start);
+
+    for (size_t i = 0; i < catalog.size(); i++) {
+        const FatLayout::Entry &entry = layout.entry(i);
+        FileInfo &file = catalog[i];
+        if (!entry.cluster) continue;
+        setLinkMap(file, entry.cluster);
+        file.sector = entry.sector;
+        file.sectors = (file.size + FF_MAX_SS - 1) / FF_MAX_SS;
+    }
+    mapSector = layout.entry(catalog.size()).sector;
+    return true;
+}
+
+// Goes through FatFs on the existing volume, with the media held from the
+// host until the new catalog is swapped in.
+static void createFiles(std::vector<FileInfo> &catalog, uint32_t &mapSector) {
+    IoScheduler::Scope scope(ioScheduler, IoScheduler::Flush);
+    mapSector = 0;
+    FRESULT res = holdVolume();
+    if (res != FR_OK) {
+        Serial.printf("Error mounting volume: %d\n", res);
+        return;
+    }
+
+    // The free count is known without a FAT scan (FSInfo or the hints). Files
+    // being replaced free their clusters first, so a shortfall is only a warning.
+    DWORD freeClusters;
+    FATFS* fs;
+    if (f_getfree("", &freeClusters, &fs) == FR_OK) {
+        uint64_t clusterBytes = (uint64_t)fs->csize * FF_MAX_SS;
+        uint64_t needed = 0;
+        for (const FileInfo &file : catalog) {
+            needed += (file.size + clusterBytes - 1) / clusterBytes;
+        }
+        if (needed > freeClusters) {
+            Serial.printf("Catalog needs %llu clusters, %lu free\n", needed, (unsigned long)freeClusters);
+        }
+    }
 
+    std::vector<std::string> names = fatNames(catalog);
+    for (size_t i = 0; i < catalog.size(); i++) {
+        FileInfo &file = catalog[i];
+        IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+        BlockDeviceSession session(SD.device());
+        FIL f_out;
+        Serial.printf("Creating file: %s\n", names[i].c_str());
+        res = f_open(&f_out, names[i].c_str(), FA_CREATE_ALWAYS | FA_WRITE);
+        if (res != FR_OK) {
+            Serial.printf("Error creating file: %d\n", res);
+            continue;
+        }
+        Serial.printf("Created file: %d\n", res);
+
+        file.sector = 0;
+        file.sectors = 0;
+        res = f_expand(&f_out, static_cast<uint32_t>(file.size), 1);
+        Serial.printf("Expanded file res: %d\n", res);
+
+        if (res == FR_OK && f_out.obj.sclust) {
+            setLinkMap(file, f_out.obj.sclust);
+            file.sector = linkMapSector(file, 0);
+            file.sectors = (file.size + FF_MAX_SS - 1) / FF_MAX_SS;
+        }
+
+        f_close(&f_out);
+    }
+
+    FileInfo map;
+    FIL f_map;
+    map.size = RemoteStore::mapBytes(storeFiles(catalog));
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(SD.device());
+    if (f_open(&f_map, REMOTE_MAP_FILE, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) return;
+    if (f_expand(&f_map, static_cast<uint32_t>(map.size), 1) == FR_OK && f_map.obj.sclust) {
+        setLinkMap(map, f_map.obj.sclust);
+        mapSector = linkMapSector(map, 0);
+    }
+    f_close(&f_map);
+}
+
+// The valid bits the last catalog left on the card, for RemoteStore to
+// carry over into the next one.
+static void loadStoreMap() {
+    FIL f;
+    IoScheduler::Scope scope(ioScheduler, IoScheduler::Flush);
+    if (refreshVolume() != FR_OK) return;
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(SD.device());
+    if (f_open(&f, REMOTE_MAP_FILE, FA_READ) != FR_OK) return;
+    UINT size = f_size(&f), got = 0;
+    uint8_t* image = (uint8_t*)(psramFound() ? ps_malloc(size) : malloc(size));
+    if (image && f_read(&f, image, size, &got) == FR_OK && got == size) {
+        remoteStore.load(image, size);
+    } else {
+        free(image);
+    }
+    f_close(&f);
+}
+
+static int32_t mscWrite(uint32_t lba, uint32_t offset, uint8_t* buff, uint32_t buffSize) {
+    debugf("MSC WRITE: lba: %u, offset: %u, bufsize: %u\n", lba, offset, buffSize);
+    bool res = true;
+    IoScheduler::Scope scope(ioScheduler, IoScheduler::HostWrite);
+
+    // The host is changing the FAT behind FatFs; a remount must not trust
+    // the free count saved from before.
+    if (Fatfs.fs_type && lba < Fatfs.database) ff_hint_clear(Fatfs.pdrv);
+
+    // Sectors the store filled stop counting as fetched once the host
+    // writes over them.
+    xSemaphoreTake(filesLock, portMAX_DELAY);
+    for (uint32_t s = lba, end = lba + (buffSize + 511) / 512; s < end; s++) {
+        FileInfo* remote = findFile(s);
+        if (!remote) continue;
+        uint32_t last = remote->sector + remote->sectors < end ? remote->sector + remote->sectors : end;
+        remoteStore.forget(remote->id, s - remote->sector, last - s);
+        s = last - 1;
+    }
+    xSemaphoreGive(filesLock);
+
+    BlockDevice* host = SD.hostDevice();
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(host);
+    // Media the loop took away (holdMedia(), a pulse) takes no writes. The
+    // loop clears mediaOnline before its own session, so a write has either
+    // finished by then or sees it.
+    if (!mediaOnline) return -1;
     if (buffSize < 512) {
         uint8_t* newBuff = (uint8_t*)malloc(sizeof(uint8_t) * 512);
-        res = SD.read(newBuff, lba);
-        if (!res) return 0;
+        res = host->read(newBuff, lba);
+        if (!res) return -1;
         memcpy(newBuff + offset, buff, buffSize);
-        res = SD.write(newBuff, lba);
+        res = host->write(newBuff, lba);
         free(newBuff);
-        if (!res) return 0;
+        if (!res) return -1;
     } else {
-        res = SD.write(buff, lba);
-        if (!res) return 0;
+        res = host->writeSectors(buff, lba, buffSize / 512);
+        if (!res) return -1;
     }
+    // Single-block writes leave their status check for later; the host
+    // must not be told a failed write went through.
+    if (!host->sync()) return -1;
 
     return buffSize;
 }
 
-static int32_t onRead(uint32_t lba, uint32_t offset, void* buff, uint32_t buffSize) {
-    if (verbose) HWSerial.printf("MSC READ: lba: %u, offset: %u, bufsize: %u\n", lba, offset, buffSize);
-    bool res = true;
+#if MSC_ASYNC_READ
+static void fetchTask(void* arg) {
+    for (;;) {
+        xSemaphoreTake(readRequested, portMAX_DELAY);
+        xSemaphoreTake(filesLock, portMAX_DELAY);
+        PendingRead &r = pendingRead;
+        if (r.state == PendingRead::Queued) {
+            // A catalog swapped in meanwhile gave the id to another file.
+            bool ok = r.generation == remoteStore.generation()
+                && remoteCache.read(r.id, r.sectors, r.sector, r.offset, nullptr, r.size);
+            r.state = ok ? PendingRead::Idle : PendingRead::Failed;
+        }
+        xSemaphoreGive(filesLock);
+        xSemaphoreGive(readDone);
+    }
+}
 
-    for (FileInfo  file : files) {
-        if (lba >= file.sector && lba <= ceil(file.size / 512.)) {
-            Serial.printf("Reading file: %s Sector: %d\n", file.name.c_str(), lba - file.sector);
-            if (buffSize == 512) {
-                Serial.printf("get %d %d\n", file.id, lba - file.sector);
-                client.printf("get %d %d\n", 0, 0);
-                int maxloops = 0;
-
-                while (client.available() < 512 && maxloops < 1000) {
-                    maxloops++;
-                    delay(1);
-                }
-                Serial.println("Available");
-
-                if (client.available() == 512) {
-                    Serial.printf("Reading response: %d %d\n", client.available(), ESP.getFreeHeap());
-                    BYTE _tmp[512];
-                    client.readBytes(_tmp, 512);
-                    Serial.println("readbytes");
-//                    for (int i = 0; i < 512; i++) {
-//                        ((uint8_t*)buff)[i] = _tempBuff[i];
-//                    }
-//                    Serial.println("memcpy");
-                }
+// Called under filesLock, which it gives back. Returns 0 until the fetch
+// task has the range in remoteCache, -1 if it could not get it.
+static int32_t deferRead(const FileInfo &remote, uint32_t sector, uint32_t offset, uint32_t size) {
+    PendingRead &r = pendingRead;
+    bool same = r.id == remote.id && r.sector == sector && r.offset == offset && r.size == size
+        && r.generation == remoteStore.generation();
+
+    if (r.state == PendingRead::Failed && same) {
+        r.state = PendingRead::Idle;
+        xSemaphoreGive(filesLock);
+        return -1;
+    }
+    if (r.state != PendingRead::Queued) {
+        r.state = PendingRead::Queued;
+        r.id = remote.id;
+        r.sectors = remote.sectors;
+        r.sector = sector;
+        r.offset = offset;
+        r.size = size;
+        r.generation = remoteStore.generation();
+        xSemaphoreGive(readRequested);
+    }
+    xSemaphoreGive(filesLock);
 
-                Serial.printf("Left bytes: %d\n", client.available());
-            } else {
-                Serial.println("SMALL BUFFSIZE READ");
-            }
-            return buffSize;
+    // TinyUSB retries right away; a tick here lets lower priority tasks,
+    // the fetch among them, run in between.
+    xSemaphoreTake(readDone, 1);
+    return 0;
+}
+#endif
+
+static int32_t mscRead(uint32_t lba, uint32_t offset, void* buff, uint32_t buffSize, uint8_t &source) {
+    debugf("MSC READ: lba: %u, offset: %u, bufsize: %u\n", lba, offset, buffSize);
+    bool res = true;
+
+#if MSC_ASYNC_READ
+    // The lock can be held for a whole catalog rebuild; try again later.
+    if (xSemaphoreTake(filesLock, 0) != pdTRUE) {
+        xSemaphoreTake(readDone, 1);
+        return 0;
+    }
+#else
+    xSemaphoreTake(filesLock, portMAX_DELAY);
+#endif
+    FileInfo* remote = findFile(lba);
+    if (remote) {
+        uint32_t sector = lba - remote->sector;
+        debugf("Reading file: %s Sector: %d\n", remote->name.c_str(), sector);
+        hydrator.played(remote->id, sector);
+#if MSC_ASYNC_READ
+        if (!remoteCache.contains(remote->id, remote->sectors, sector, offset, buffSize)) {
+            return deferRead(*remote, sector, offset, buffSize);
         }
+#endif
+        res = remoteCache.read(remote->id, remote->sectors, sector, offset, (uint8_t*)buff, buffSize);
+        xSemaphoreGive(filesLock);
+        if (!res) return -1;
+        source = remoteCache.lastReadCached() ? TRACE_SRC_REMOTE_CACHE : TRACE_SRC_REMOTE;
+        return buffSize;
     }
+    xSemaphoreGive(filesLock);
 
+    BlockDevice* host = SD.hostDevice();
+    IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+    BlockDeviceSession session(host);
     if (buffSize < 512) {
         uint8_t* newBuff = (uint8_t*)malloc(sizeof(uint8_t) * 512);
-        res = SD.read(newBuff, lba);
-        if (!res) return 0;
+        res = host->read(newBuff, lba);
+        if (!res) return -1;
         memcpy(buff, newBuff + offset, buffSize);
         free(newBuff);
     } else {
-        res = SD.read((uint8_t*)buff, lba);
-        if (!res) return 0;
+        res = host->readSectors((uint8_t*)buff, lba, buffSize / 512);
+        if (!res) return -1;
     }
 
+    source = SD.cache().lastReadCached(BlockCache::Host) ? TRACE_SRC_CACHE : TRACE_SRC_LOCAL;
     return buffSize;
 }
 
+// Latency, byte counts and a trace record for every MSC transfer, whichever
+// way it returns.
+static void finishTransfer(uint8_t op, uint32_t lba, uint32_t offset, uint32_t size, int32_t res,
+                           uint8_t source, uint32_t start) {
+    uint32_t latency = metrics_now() - start;
+    bool read = op == TRACE_OP_READ;
+
+    METRIC_RECORD(read ? METRIC_MSC_READ : METRIC_MSC_WRITE, latency);
+    if (res > 0) {
+        METRIC_COUNT(read ? METRIC_MSC_READ_BYTES : METRIC_MSC_WRITE_BYTES, res);
+    } else {
+        METRIC_COUNT(METRIC_MSC_ERRORS, 1);
+        source = TRACE_SRC_ERROR;
+    }
+    trace_record(op, lba, offset, size, source, start, latency);
+}
+
+static int32_t onWrite(uint32_t lba, uint32_t offset, uint8_t* buff, uint32_t buffSize) {
+    uint32_t start = metrics_now();
+    hydrator.hostIo();
+    int32_t res = mscWrite(lba, offset, buff, buffSize);
+    finishTransfer(TRACE_OP_WRITE, lba, offset, buffSize, res, TRACE_SRC_LOCAL, start);
+    return res;
+}
+
+// A deferred read is one transfer from the first call to the one that
+// returns the data.
+static bool readDeferred = false;
+static uint32_t readDeferredSince;
+
+static int32_t onRead(uint32_t lba, uint32_t offset, void* buff, uint32_t buffSize) {
+    uint32_t start = metrics_now();
+    uint8_t source = TRACE_SRC_LOCAL;
+    hydrator.hostIo();
+    int32_t res = mscRead(lba, offset, buff, buffSize, source);
+    if (res == 0) {
+        if (!readDeferred) readDeferredSince = start;
+        readDeferred = true;
+        return 0;
+    }
+    if (readDeferred) {
+        start = readDeferredSince;
+        if (source == TRACE_SRC_REMOTE_CACHE) source = TRACE_SRC_REMOTE;
+        readDeferred = false;
+    }
+    finishTransfer(TRACE_OP_READ, lba, offset, buffSize, res, source, start);
+    return res;
+}
+
 static bool onStartStop(uint8_t power_condition, bool start, bool load_eject) {
     HWSerial.printf("MSC START/STOP: power: %u, start: %u, eject: %u\n", power_condition, start, load_eject);
+    if (!start) {
+        return SD.hostDevice()->sync();
+    }
     return true;
 }
 
@@ -139,15 +674,28 @@ void setup() {
     HWSerial.begin(115200);
     HWSerial.setDebugOutput(true);
 
+#if USE_SDMMC && defined(SOC_SDMMC_HOST_SUPPORTED)
+#ifdef SOC_SDMMC_USE_GPIO_MATRIX
+    SD.sdmmc().setPins(SDMMC_CLK, SDMMC_CMD, SDMMC_D0, SDMMC_D1, SDMMC_D2, SDMMC_D3);
+#endif
+    SD.beginSDMMC();
+#else
     SD.begin();
-
+#endif
+    filesLock = xSemaphoreCreateMutex();
+    ioScheduler.begin();
+#if MSC_ASYNC_READ
+    readRequested = xSemaphoreCreateBinary();
+    readDone = xSemaphoreCreateBinary();
+    // Below the USB task, above hydration.
+    xTaskCreate(fetchTask, "mscfetch", 6144, nullptr, tskIDLE_PRIORITY + 2, nullptr);
+#endif
+
+#if FORMAT_ON_BOOT
+    formatCard();
+#endif
     f_mount(&Fatfs, "", 0);
-
-//    Serial.println("Creating fat file system");
-//    if (f_mkfs("", &opt, _buff, sizeof _buff) != FR_OK)
-//        Serial.printf("Error making fat file system\n");
-//
-//    Serial.println("Created fat file system");
+    loadStoreMap();
 
     USB.onEvent(usbEventCallback);
     MSC.vendorID("ESP32");//max 8 chars
@@ -156,7 +704,7 @@ void setup() {
     MSC.onStartStop(onStartStop);
     MSC.onRead(onRead);
     MSC.onWrite(onWrite);
-    MSC.mediaPresent(false);
+    setMediaOnline(false);
     MSC.begin(SD.size() / 512, FF_MAX_SS);
     USB.begin();
 
@@ -166,22 +714,78 @@ void setup() {
         Serial.print(".");
         delay(500);
     }
+
+    remoteSource.begin(SERVER_HOST, SERVER_PORT);
+    remoteStore.begin(&remoteSource, SD.storeDevice());
+    if (!remoteCache.begin(&remoteStore)) Serial.println("Cannot allocate remote cache");
+#if HYDRATE_IN_BACKGROUND
+    if (!hydrator.begin(&remoteSource, &remoteStore, filesLock)) Serial.println("Cannot start hydration");
+#endif
+}
+
+// "stats" prints the metrics, "stats reset" clears them.
+// "trace start [records]" / "trace stop" control the MSC tracer (records only
+// sizes the ring on the first start); "trace dump" writes the captured
+// records to the console in binary (host/trace_tool extract), "trace save"
+// to TRACE_FILE on the card.
+static void pollSerial() {
+    if (!Serial.available()) return;
+    String line = Serial.readStringUntil('\n');
+    line.trim();
+    if (line == "stats") metrics_dump();
+    else if (line == "stats reset") metrics_reset();
+    else if (line.startsWith("trace start")) {
+        if (!trace_start(line.substring(11).toInt())) Serial.println("Cannot allocate trace buffer");
+    } else if (line == "trace stop") trace_stop();
+    else if (line == "trace dump") trace_dump_serial();
+    else if (line == "trace save") {
+        IoScheduler::Scope scope(ioScheduler, IoScheduler::Flush);
+        bool saved = holdVolume() == FR_OK;
+        if (saved) {
+            IoScheduler::Slot slot(ioScheduler, IoScheduler::Bus);
+            BlockDeviceSession session(SD.device());
+            saved = trace_save(TRACE_FILE);
+        }
+        if (!saved) Serial.println("Cannot save trace");
+        xSemaphoreTake(filesLock, portMAX_DELAY);
+        signalMediaChange();
+        xSemaphoreGive(filesLock);
+        if (mediaHeld) setMediaOnline(true);
+    }
 }
 
 unsigned long resend = 0;
+unsigned long storeFlushed = 0;
 
 void loop() {
+    pollSerial();
+    if (mediaPulse && millis() - mediaOfflineSince >= MEDIA_CHANGE_PULSE_MS) setMediaOnline(true);
+#if !REMOTE_UDP
+    remoteSource.maintain();
+#endif
+    if (millis() - storeFlushed >= REMOTE_STORE_FLUSH_MS) {
+        storeFlushed = millis();
+        IoScheduler::Scope scope(ioScheduler, IoScheduler::Flush);
+        xSemaphoreTake(filesLock, portMAX_DELAY);
+        remoteStore.flush();
+        xSemaphoreGive(filesLock);
+    }
 
-    if (!client.connected() && !client.connect("192.168.69.3", 12345)) {
-        Serial.println("Connection failed.");
-        Serial.println("Waiting 5 seconds before retrying...");
-        delay(5000);
-        return;
+    // Reconnecting never blocks the loop for longer than one connect
+    // attempt; the backoff spaces the attempts out while the server is down.
+    if (!client.connected()) {
+        if (!listBackoff.due()) return;
+        if (!client.connect(SERVER_HOST, SERVER_PORT, REMOTE_CONNECT_TIMEOUT_MS)) {
+            listBackoff.failed();
+            Serial.printf("Connection failed, retrying in %u ms\n", listBackoff.wait());
+            return;
+        }
+        listBackoff.succeeded();
     }
 
     //    if (millis() - resend > 500000) pendingRequest = "list /";
 
-    if (pendingRequest != "") {
+    if (pendingRequest != "" && listBackoff.due()) {
         resend = millis();
         client.println(pendingRequest);
         int maxloops = 0;
@@ -194,8 +798,7 @@ void loop() {
         if (client.available() > 0) {
             if (pendingRequestType == RequestType::List) {
                 String line;
-                MSC.mediaPresent(false);
-                files.clear();
+                std::vector<FileInfo> catalog;
                 int id = 0;
                 while (client.available() > 0) {
                     line = client.readStringUntil('\n');
@@ -203,34 +806,46 @@ void loop() {
                     int splitIndex = line.indexOf('\0');
                     info.id = id++;
                     info.name = line.substring(0, splitIndex).c_str();
-                    info.size = strtoull(line.substring(splitIndex + 1, line.length()).c_str(), NULL, 10);
+                    String fields = line.substring(splitIndex + 1, line.length());
+                    char* end;
+                    info.size = strtoull(fields.c_str(), &end, 10);
+                    info.version = strtoul(end, NULL, 10);
                     Serial.printf("Name: %s Size: %llu\n", info.name.c_str(), info.size);
-                    files.emplace_back(info);
+                    catalog.emplace_back(info);
                     if (line.indexOf("\r") != -1) break;
                 }
 
-                for (FileInfo &file : files) {
-                    FIL f_out;
-                    Serial.printf("Creating file: %s\n", getFatFileName(file.name).c_str());
-                    FRESULT res = f_open(&f_out, getFatFileName(file.name).c_str(), FA_CREATE_ALWAYS | FA_WRITE);
-                    if (res != FR_OK) {
-                        Serial.printf("Error creating file: %d\n", res);
-                        continue;
-                    }
-                    Serial.printf("Created file: %d\n", res);
-
-                    UINT bw;
-                    res = f_expand(&f_out, static_cast<uint32_t>(file.size), 1);
-                    Serial.printf("Expanded file res: %d\n", res);
-
-                    f_write(&f_out, "\0", 1, &bw);
+                // The old catalog's sectors are about to move; reads go
+                // straight to the network until the new map is attached.
+                xSemaphoreTake(filesLock, portMAX_DELAY);
+                remoteStore.detach();
+                xSemaphoreGive(filesLock);
+
+                uint32_t mapSector;
+#if QUICK_FORMAT
+                // A layout that did not make it to the card leaves the
+                // media offline and the old catalog in place; the listing
+                // is asked for again later.
+                if (!writeLayout(catalog, mapSector)) {
+                    listBackoff.failed();
+                    Serial.printf("Catalog build failed, retrying in %u ms\n", listBackoff.wait());
+                    return;
+                }
+#else
+                createFiles(catalog, mapSector);
+#endif
 
-                    file.sector = f_out.sect;
+                std::sort(catalog.begin(), catalog.end(),
+                          [](const FileInfo &a, const FileInfo &b) { return a.sector < b.sector; });
 
-                    f_close(&f_out);
-                }
+                xSemaphoreTake(filesLock, portMAX_DELAY);
+                files.swap(catalog);
+                remoteCache.invalidate();
+                remoteStore.attach(storeFiles(files), mapSector);
+                signalMediaChange();
+                xSemaphoreGive(filesLock);
 
-                MSC.mediaPresent(true);
+                if (!mediaPulse) setMediaOnline(true);
             }
             pendingRequest = "";
 
@@ -264,5 +879,5 @@ std::string getFatFileName(std::string fileName) {
 
     name = name.substr(0, (name.size() > (255 - ext.size()) ? (255 - ext.size()) : name.size()));
 
-    return name + ext;
+    return FatLayout::longName(name + ext);
 }
@@ -22,6 +22,7 @@
 #include <string.h>
 #include "ff.h"			/* Declarations of FatFs API */
 #include "diskio.h"		/* Declarations of device I/O functions */
+#include "ff_fatscan.h"	/* FAT32 entry scanning kernels */
 
 
 /*  --------------------------------------------------------------------------
@@ -277,6 +278,16 @@
 #endif
 
 
+/* Window cache */
+#define WC_SLOTS	(FF_WIN_FAT_SLOTS + FF_WIN_DIR_SLOTS)
+#if WC_SLOTS && FF_FS_TINY
+#error Window cache cannot be used in tiny buffer configuration
+#endif
+#if WC_SLOTS > 255
+#error Wrong setting of FF_WIN_FAT_SLOTS or FF_WIN_DIR_SLOTS
+#endif
+
+
 /* File lock controls */
 #if FF_FS_LOCK != 0
 #if FF_FS_READONLY
@@ -1021,25 +1032,137 @@ static void clear_lock (	/* Clear lock entries of the volume */
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
+/* With the window cache, the sector leaving fs->win[] is stashed into a
+/  slot of its pool and a sector found in a slot is copied back into fs->win[],
+/  so a sector lives either in the window or in one slot, never in both.
+/  Pointers into fs->win[] held by callers keep their meaning. */
+
+#if !FF_FS_READONLY
+static FRESULT write_sector (	/* Returns FR_OK or FR_DISK_ERR */
+    FATFS* fs,			/* Filesystem object */
+    BYTE* buf,			/* Sector data */
+    LBA_t sect			/* Sector to write */
+)
+{
+    if (disk_write(fs->pdrv, buf, sect, 1) != RES_OK) return FR_DISK_ERR;
+    if (sect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
+        if (fs->n_fats == 2) disk_write(fs->pdrv, buf, sect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
+    }
+    return FR_OK;
+}
+#endif
+
+
+#if WC_SLOTS
+static void wc_discard (
+    FATFS* fs,			/* Filesystem object */
+    LBA_t sect,			/* First sector overwritten without going through the window */
+    UINT n				/* Number of sectors */
+)
+{
+    UINT i;
+
+
+    for (i = 0; i < WC_SLOTS; i++) {
+        if (fs->wc_used[i] && fs->wc_sect[i] - sect < n) {
+            fs->wc_used[i] = 0; fs->wc_dirty[i] = 0;
+        }
+    }
+}
+
+
+static void wc_reset (
+    FATFS* fs			/* Filesystem object */
+)
+{
+    memset(fs->wc_used, 0, sizeof fs->wc_used);
+    memset(fs->wc_dirty, 0, sizeof fs->wc_dirty);
+    fs->wc_tick = 0;
+}
+
+
+static FRESULT wc_stash (	/* Returns FR_OK or FR_DISK_ERR */
+    FATFS* fs			/* Filesystem object */
+)
+{
+    UINT i, v, lo, hi;
+
+
+    if (fs->winsect == (LBA_t)0 - 1) return FR_OK;	/* Nothing in the window */
+    if (fs->winsect - fs->fatbase < fs->fsize) {	/* FAT pool or directory pool */
+        lo = 0; hi = FF_WIN_FAT_SLOTS;
+    } else {
+        lo = FF_WIN_FAT_SLOTS; hi = WC_SLOTS;
+    }
+    if (lo == hi) {				/* Empty pool: behave as the single window */
+#if !FF_FS_READONLY
+        if (fs->wflag) {
+            if (write_sector(fs, fs->win, fs->winsect) != FR_OK) return FR_DISK_ERR;
+            fs->wflag = 0;
+        }
+#endif
+        return FR_OK;
+    }
+    for (v = i = lo; i < hi; i++) {	/* Pick an empty or the least recently used slot */
+        if (!fs->wc_used[i]) { v = i; break; }
+        if (fs->wc_used[i] < fs->wc_used[v]) v = i;
+    }
+#if !FF_FS_READONLY
+    if (fs->wc_used[v] && fs->wc_dirty[v]) {	/* Write back the evicted sector */
+        if (write_sector(fs, fs->wc_buf[v], fs->wc_sect[v]) != FR_OK) return FR_DISK_ERR;
+    }
+#endif
+    memcpy(fs->wc_buf[v], fs->win, SS(fs));
+    fs->wc_sect[v] = fs->winsect;
+    fs->wc_dirty[v] = fs->wflag;
+    fs->wc_used[v] = ++fs->wc_tick;
+    fs->wflag = 0;
+    return FR_OK;
+}
+#endif	/* WC_SLOTS */
+
+
 #if !FF_FS_READONLY
 static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
     FATFS* fs			/* Filesystem object */
 )
 {
+#if WC_SLOTS
+    BYTE ord[WC_SLOTS + 1];
+    LBA_t sect;
+    UINT i, j, n = 0;
+
+
+    for (i = 0; i <= WC_SLOTS; i++) {	/* Collect dirty slots (and the window as WC_SLOTS) sorted by LBA */
+        if (i < WC_SLOTS ? !(fs->wc_used[i] && fs->wc_dirty[i]) : !fs->wflag) continue;
+        sect = (i < WC_SLOTS) ? fs->wc_sect[i] : fs->winsect;
+        for (j = n; j > 0 && (ord[j - 1] < WC_SLOTS ? fs->wc_sect[ord[j - 1]] : fs->winsect) > sect; j--) ord[j] = ord[j - 1];
+        ord[j] = (BYTE)i; n++;
+    }
+    for (j = 0; j < n; j++) {
+        i = ord[j];
+        if (i < WC_SLOTS) {
+            if (write_sector(fs, fs->wc_buf[i], fs->wc_sect[i]) != FR_OK) return FR_DISK_ERR;
+            fs->wc_dirty[i] = 0;
+        } else {
+            if (write_sector(fs, fs->win, fs->winsect) != FR_OK) return FR_DISK_ERR;
+            fs->wflag = 0;
+        }
+    }
+    return FR_OK;
+#else
     FRESULT res = FR_OK;
 
 
     if (fs->wflag) {	/* Is the disk access window dirty? */
-        if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) == RES_OK) {	/* Write it back into the volume */
+        if (write_sector(fs, fs->win, fs->winsect) == FR_OK) {	/* Write it back into the volume */
             fs->wflag = 0;	/* Clear window dirty flag */
-            if (fs->winsect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
-                if (fs->n_fats == 2) disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
-            }
         } else {
             res = FR_DISK_ERR;
         }
     }
     return res;
+#endif
 }
 #endif
 
@@ -1050,10 +1173,25 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 )
 {
     FRESULT res = FR_OK;
+#if WC_SLOTS
+    UINT i;
+#endif
 
 
     if (sect != fs->winsect) {	/* Window offset changed? */
-#if !FF_FS_READONLY
+#if WC_SLOTS
+        res = wc_stash(fs);			/* Move the window into the cache */
+        if (res == FR_OK) {
+            for (i = 0; i < WC_SLOTS && !(fs->wc_used[i] && fs->wc_sect[i] == sect); i++) ;
+            if (i < WC_SLOTS) {		/* Cache hit: take the sector out of its slot */
+                memcpy(fs->win, fs->wc_buf[i], SS(fs));
+                fs->wflag = fs->wc_dirty[i];
+                fs->wc_used[i] = 0; fs->wc_dirty[i] = 0;
+                fs->winsect = sect;
+                return FR_OK;
+            }
+        }
+#elif !FF_FS_READONLY
         res = sync_window(fs);		/* Flush the window */
 #endif
         if (res == FR_OK) {			/* Fill sector window with new data */
@@ -1070,6 +1208,39 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 
+#if !FF_FS_READONLY && FF_FS_HINT
+/*-----------------------------------------------------------------------*/
+/* Keep allocation hints of the volume across remounts                   */
+/*-----------------------------------------------------------------------*/
+
+static void hint_key (
+    FATFS* fs,		/* Filesystem object */
+    DWORD* key		/* Returns the key identifying this volume layout */
+)
+{
+    key[0] = fs->vsn;
+    key[1] = fs->n_fatent;
+    key[2] = (DWORD)fs->volbase;
+}
+
+
+static void save_hint (
+    FATFS* fs		/* Filesystem object */
+)
+{
+    DWORD key[3];
+
+
+    if (fs->free_clst <= fs->n_fatent - 2) {	/* Only a valid free cluster count is worth keeping */
+        hint_key(fs, key);
+        ff_hint_save(fs->pdrv, key, fs->free_clst, fs->last_clst);
+    }
+}
+
+#endif
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Synchronize filesystem and data on the storage                        */
@@ -1086,16 +1257,22 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
     if (res == FR_OK) {
         if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {	/* FAT32: Update FSInfo sector if needed */
             /* Create FSInfo structure */
-            memset(fs->win, 0, sizeof fs->win);
+            memset(fs->win, 0, SS(fs));
             st_word(fs->win + BS_55AA, 0xAA55);					/* Boot signature */
             st_dword(fs->win + FSI_LeadSig, 0x41615252);		/* Leading signature */
             st_dword(fs->win + FSI_StrucSig, 0x61417272);		/* Structure signature */
             st_dword(fs->win + FSI_Free_Count, fs->free_clst);	/* Number of free clusters */
             st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
             fs->winsect = fs->volbase + 1;						/* Write it into the FSInfo sector (Next to VBR) */
+#if WC_SLOTS
+            wc_discard(fs, fs->winsect, 1);
+#endif
             disk_write(fs->pdrv, fs->win, fs->winsect, 1);
             fs->fsi_flag = 0;
         }
+#if FF_FS_HINT
+        save_hint(fs);
+#endif
         /* Make sure that no pending write process in the lower layer */
         if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
     }
@@ -1200,6 +1377,51 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 
 
 
+#if FF_USE_FASTSEEK
+/*-----------------------------------------------------------------------*/
+/* FAT access - Follow the contiguous part of a chain                    */
+/*-----------------------------------------------------------------------*/
+/* Counts the clusters from clst on that link to their next neighbour and
+/  returns the first link that does not, which is the top of the next
+/  fragment or the end of the chain. FAT32 checks a window per call. */
+
+static DWORD get_fat_run (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Link breaking contiguity */
+    FFOBJID* obj,	/* Corresponding object */
+    DWORD clst,		/* Top of the contiguous part */
+    DWORD* ncl		/* Number of clusters to be added to */
+)
+{
+    FATFS *fs = obj->fs;
+    DWORD pcl;
+    UINT i, n, k;
+
+
+    if (fs->fs_type == FS_FAT32) {
+        for (;;) {
+            if (clst < 2 || clst >= fs->n_fatent) return 1;
+            if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) return 0xFFFFFFFF;
+            i = clst % (SS(fs) / 4);
+            n = SS(fs) / 4 - i;
+            if (n > fs->n_fatent - clst) n = fs->n_fatent - clst;	/* Do not run past the last cluster */
+            k = ff_fat32_chain_run(fs->win + i * 4, n, clst + 1);
+            *ncl += k; clst += k;
+            if (k < n) break;
+        }
+        (*ncl)++;
+        return ld_dword(fs->win + (i + k) * 4) & 0x0FFFFFFF;
+    }
+
+    do {
+        pcl = clst; (*ncl)++;
+        clst = get_fat(obj, clst);
+    } while (clst == pcl + 1);
+    return clst;
+}
+
+#endif	/* FF_USE_FASTSEEK */
+
+
+
 
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
@@ -1637,7 +1859,10 @@ static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
     if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
     sect = clst2sect(fs, clst);		/* Top of the cluster */
     fs->winsect = sect;				/* Set window to top of the cluster */
-    memset(fs->win, 0, sizeof fs->win);	/* Clear window buffer */
+#if WC_SLOTS
+    wc_discard(fs, sect, fs->csize);	/* Drop stale copies of the cluster */
+#endif
+    memset(fs->win, 0, SS(fs));	/* Clear window buffer */
 #if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
     /* Allocate a temporary buffer */
     for (szb = ((DWORD)fs->csize * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : fs->csize * SS(fs), ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
@@ -3263,6 +3488,9 @@ static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS,
 
 
     fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
+#if WC_SLOTS
+    wc_reset(fs);
+#endif
     if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
     sign = ld_word(fs->win + BS_55AA);
 #if FF_FS_EXFAT
@@ -3530,6 +3758,9 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
         /* Get FSInfo if available */
         fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
         fs->fsi_flag = 0x80;
+#if FF_FS_HINT
+        fs->vsn = ld_dword(fs->win + (fmt == FS_FAT32 ? BS_VolID32 : BS_VolID));	/* Keep VSN while the VBR is in the window */
+#endif
 #if (FF_FS_NOFSINFO & 3) != 3
         if (fmt == FS_FAT32				/* Allow to update FSInfo only if BPB_FSInfo32 == 1 */
                 && ld_word(fs->win + BPB_FSInfo32) == 1
@@ -3549,6 +3780,22 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
             }
         }
 #endif	/* (FF_FS_NOFSINFO & 3) != 3 */
+#if FF_FS_HINT
+        {   /* Fill in what FSInfo could not tell from the saved hints */
+            DWORD key[3], hfree, hlast;
+
+            hint_key(fs, key);
+            if (ff_hint_load(fs->pdrv, key, &hfree, &hlast)) {
+                if (fs->free_clst > fs->n_fatent - 2 && hfree <= fs->n_fatent - 2) {
+                    fs->free_clst = hfree;
+                    if (fs->fsi_flag == 0) fs->fsi_flag = 1;	/* Repair FSInfo at next sync */
+                }
+                if (fs->last_clst - 2 >= fs->n_fatent - 2 && hlast - 2 < fs->n_fatent - 2) {
+                    fs->last_clst = hlast;
+                }
+            }
+        }
+#endif
 #endif	/* !FF_FS_READONLY */
     }
 
@@ -4032,6 +4279,9 @@ FRESULT f_write (
                     cc = fs->csize - csect;
                 }
                 if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+#if WC_SLOTS
+                wc_discard(fs, sect, cc);		/* Drop cached copies of a reused directory cluster */
+#endif
 #if FF_FS_MINIMIZE <= 2
 #if FF_FS_TINY
                 if (fs->winsect - sect < cc) {	/* Refill sector cache if it gets invalidated by the direct write */
@@ -4393,7 +4643,7 @@ FRESULT f_lseek (
     LBA_t nsect;
     FSIZE_t ifptr;
 #if FF_USE_FASTSEEK
-    DWORD cl, pcl, ncl, tcl, tlen, ulen;
+    DWORD cl, ncl, tcl, tlen, ulen;
     DWORD *tbl;
     LBA_t dsc;
 #endif
@@ -4417,12 +4667,9 @@ FRESULT f_lseek (
                 do {
                     /* Get a fragment */
                     tcl = cl; ncl = 0; ulen += 2;	/* Top, length and used items */
-                    do {
-                        pcl = cl; ncl++;
-                        cl = get_fat(&fp->obj, cl);
-                        if (cl <= 1) ABORT(fs, FR_INT_ERR);
-                        if (cl == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
-                    } while (cl == pcl + 1);
+                    cl = get_fat_run(&fp->obj, cl, &ncl);
+                    if (cl <= 1) ABORT(fs, FR_INT_ERR);
+                    if (cl == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
                     if (ulen <= tlen) {		/* Store the length and top of the fragment */
                         *tbl++ = ncl; *tbl++ = tcl;
                     }
@@ -4775,7 +5022,7 @@ FRESULT f_getfree (
     FATFS *fs;
     DWORD nfree, clst, stat;
     LBA_t sect;
-    UINT i;
+    UINT i, n;
     FFOBJID obj;
 
 
@@ -4836,19 +5083,24 @@ FRESULT f_getfree (
                         }
                         if (fs->fs_type == FS_FAT16) {
                             if (ld_word(fs->win + i) == 0) nfree++;
-                            i += 2;
-                        } else {
-                            if ((ld_dword(fs->win + i) & 0x0FFFFFFF) == 0) nfree++;
-                            i += 4;
+                            i += 2; clst--;
+                        } else {	/* FAT32: The whole sector at a time */
+                            n = SS(fs) / 4;
+                            if (n > clst) n = clst;
+                            nfree += ff_fat32_count_free(fs->win, n);
+                            i += n * 4; clst -= n;
                         }
                         i %= SS(fs);
-                    } while (--clst);
+                    } while (clst);
                 }
             }
             if (res == FR_OK) {		/* Update parameters if succeeded */
                 *nclst = nfree;			/* Return the free clusters */
                 fs->free_clst = nfree;	/* Now free_clst is valid */
                 fs->fsi_flag |= 1;		/* FAT32: FSInfo is to be updated */
+#if FF_FS_HINT
+                save_hint(fs);			/* A remount need not scan again */
+#endif
             }
         }
     }
@@ -5514,6 +5766,51 @@ FRESULT f_setlabel (
 
 
 #if FF_USE_EXPAND && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT32: Find a contiguous block of free clusters                       */
+/*-----------------------------------------------------------------------*/
+/* Same search as the generic loop in f_expand(), but it skips used and
+/  free entries a window at a time. A block never spans the wrap-around. */
+
+static FRESULT find_contiguous32 (	/* FR_OK:Found, FR_DENIED:No block, FR_DISK_ERR:Disk error */
+    FATFS* fs,		/* Filesystem object */
+    DWORD stcl,		/* Cluster to start the search at */
+    DWORD tcl,		/* Number of clusters required */
+    DWORD* scl		/* Returns the top cluster of the block */
+)
+{
+    DWORD clst = stcl, ncl = 0, left = fs->n_fatent - 2;
+    const BYTE* p;
+    UINT n, k;
+
+
+    while (left) {
+        if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) return FR_DISK_ERR;
+        p = fs->win + clst % (SS(fs) / 4) * 4;
+        n = SS(fs) / 4 - clst % (SS(fs) / 4);		/* Entries left in this window */
+        if (n > fs->n_fatent - clst) n = fs->n_fatent - clst;
+        if (n > left) n = left;
+        clst += n; left -= n;
+        while (n) {
+            if (ncl == 0) {		/* Skip to the top of a free block */
+                k = ff_fat32_first_free(p, n);
+                p += k * 4; n -= k;
+                if (n == 0) break;
+                *scl = clst - n;
+            }
+            k = ff_fat32_free_run(p, n);	/* Extend the free block */
+            ncl += k; p += k * 4; n -= k;
+            if (ncl >= tcl) return FR_OK;
+            if (n) ncl = 0;		/* Stopped at a cluster in use */
+        }
+        if (clst >= fs->n_fatent) {	/* Wrap around */
+            clst = 2; ncl = 0;
+        }
+    }
+    return FR_DENIED;
+}
+
+
 /*-----------------------------------------------------------------------*/
 /* Allocate a Contiguous Blocks to the File                              */
 /*-----------------------------------------------------------------------*/
@@ -5528,7 +5825,6 @@ FRESULT f_expand (
     FATFS *fs;
     DWORD n, clst, stcl, scl, ncl, tcl, lclst;
 
-    printf("filesize: %lu\n", fsz);
     res = validate(&fp->obj, &fs);		/* Check validity of the file object */
     if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
     if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
@@ -5557,25 +5853,29 @@ FRESULT f_expand (
 #endif
     {
         scl = clst = stcl; ncl = 0;
-        for (;;) {	/* Find a contiguous cluster block */
-            n = get_fat(&fp->obj, clst);
-            if (++clst >= fs->n_fatent) clst = 2;
-            if (n == 1) {
-                res = FR_INT_ERR;
-                break;
-            }
-            if (n == 0xFFFFFFFF) {
-                res = FR_DISK_ERR;
-                break;
-            }
-            if (n == 0) {	/* Is it a free cluster? */
-                if (++ncl == tcl) break;	/* Break if a contiguous cluster block is found */
-            } else {
-                scl = clst; ncl = 0;		/* Not a free cluster */
-            }
-            if (clst == stcl) {
-                res = FR_DENIED;    /* No contiguous cluster? */
-                break;
+        if (fs->fs_type == FS_FAT32) {
+            res = find_contiguous32(fs, stcl, tcl, &scl);
+        } else {
+            for (;;) {	/* Find a contiguous cluster block */
+                n = get_fat(&fp->obj, clst);
+                if (++clst >= fs->n_fatent) clst = 2;
+                if (n == 1) {
+                    res = FR_INT_ERR;
+                    break;
+                }
+                if (n == 0xFFFFFFFF) {
+                    res = FR_DISK_ERR;
+                    break;
+                }
+                if (n == 0) {	/* Is it a free cluster? */
+                    if (++ncl == tcl) break;	/* Break if a contiguous cluster block is found */
+                } else {
+                    scl = clst; ncl = 0;		/* Not a free cluster */
+                }
+                if (clst == stcl) {
+                    res = FR_DENIED;    /* No contiguous cluster? */
+                    break;
+                }
             }
         }
         if (res == FR_OK) {	/* A contiguous free area is found */
@@ -153,6 +153,9 @@ typedef struct {
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+#if FF_FS_HINT
+	DWORD	vsn;			/* Volume serial number (key of the allocation hints) */
+#endif
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -173,6 +176,13 @@ typedef struct {
 #endif
 	LBA_t	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[FF_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
+#if FF_WIN_FAT_SLOTS + FF_WIN_DIR_SLOTS
+	DWORD	wc_tick;		/* Window cache access counter */
+	DWORD	wc_used[FF_WIN_FAT_SLOTS + FF_WIN_DIR_SLOTS];	/* Last access of each slot (0:empty) */
+	LBA_t	wc_sect[FF_WIN_FAT_SLOTS + FF_WIN_DIR_SLOTS];	/* Sector held by each slot */
+	BYTE	wc_dirty[FF_WIN_FAT_SLOTS + FF_WIN_DIR_SLOTS];	/* Dirty flag of each slot */
+	BYTE	wc_buf[FF_WIN_FAT_SLOTS + FF_WIN_DIR_SLOTS][FF_MAX_SS];	/* Sectors behind the window (FAT pool first) */
+#endif
 } FATFS;
 
 
@@ -367,6 +377,13 @@ void* ff_memalloc (UINT msize);			/* Allocate memory block */
 void ff_memfree (void* mblock);			/* Free memory block */
 #endif
 
+/* Allocation hint functions */
+#if !FF_FS_READONLY && FF_FS_HINT
+int ff_hint_load (BYTE pdrv, const DWORD key[3], DWORD* free_clst, DWORD* last_clst);	/* Get saved hints of a volume */
+void ff_hint_save (BYTE pdrv, const DWORD key[3], DWORD free_clst, DWORD last_clst);	/* Save hints of a volume */
+void ff_hint_clear (BYTE pdrv);			/* Forget hints of a drive */
+#endif
+
 /* Sync functions */
 #if FF_FS_REENTRANT
 int ff_cre_syncobj (BYTE vol, FF_SYNC_t* sobj);	/* Create a sync object */
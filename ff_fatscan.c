@@ -0,0 +1,279 @@
+/*-----------------------------------------------------------------------*/
+/* FAT32 entry scanning kernels                                          */
+/*-----------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <string.h>
+#include "ff_fatscan.h"
+
+#if FF_FATSCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#define FAT32_MASK	0x0FFFFFFF
+
+
+static DWORD ld_entry (const BYTE* p)
+{
+    return ((DWORD)p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16 | (DWORD)p[3] << 24) & FAT32_MASK;
+}
+
+
+static UINT ctz32 (DWORD v)		/* v must not be 0 */
+{
+#if defined(__GNUC__)
+    return (UINT)__builtin_ctz(v);
+#else
+    UINT i = 0;
+
+    while (!(v & 1)) { v >>= 1; i++; }
+    return i;
+#endif
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Scalar reference: one entry per iteration, the way get_fat() reads    */
+/*-----------------------------------------------------------------------*/
+
+UINT ff_fat32_count_free_scalar (const BYTE* p, UINT n)
+{
+    UINT i, c = 0;
+
+    for (i = 0; i < n; i++) {
+        if (ld_entry(p + i * 4) == 0) c++;
+    }
+    return c;
+}
+
+
+UINT ff_fat32_first_free_scalar (const BYTE* p, UINT n)
+{
+    UINT i;
+
+    for (i = 0; i < n && ld_entry(p + i * 4) != 0; i++) ;
+    return i;
+}
+
+
+UINT ff_fat32_free_run_scalar (const BYTE* p, UINT n)
+{
+    UINT i;
+
+    for (i = 0; i < n && ld_entry(p + i * 4) == 0; i++) ;
+    return i;
+}
+
+
+UINT ff_fat32_chain_run_scalar (const BYTE* p, UINT n, DWORD next)
+{
+    UINT i;
+
+    for (i = 0; i < n && ld_entry(p + i * 4) == ((next + i) & FAT32_MASK); i++) ;
+    return i;
+}
+
+
+
+#if FF_FATSCAN_WORD
+/*-----------------------------------------------------------------------*/
+/* Word kernels: two entries per 64-bit word                             */
+/*-----------------------------------------------------------------------*/
+/* After masking, each 32-bit lane is at most 0x0FFFFFFF, so adding
+/  0x7FFFFFFF cannot carry into the next lane and sets the lane's top bit
+/  exactly when the lane is non-zero. The window (and every FAT entry in
+/  it) is 32-bit aligned, so the loads need no byte assembly; a misaligned
+/  pointer takes the scalar path. */
+
+#define W_MASK	0x0FFFFFFF0FFFFFFFULL
+#define W_ADD	0x7FFFFFFF7FFFFFFFULL
+#define W_HIGH	0x8000000080000000ULL
+
+static uint64_t ld_word2 (const BYTE* p)	/* p is 32-bit aligned */
+{
+    DWORD lo, hi;
+
+#if defined(__GNUC__)
+    p = (const BYTE*)__builtin_assume_aligned(p, 4);
+#endif
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    return (uint64_t)lo | (uint64_t)hi << 32;
+}
+
+static uint64_t used_bits (uint64_t w)	/* Top bit of each non-zero lane */
+{
+    return ((w & W_MASK) + W_ADD) & W_HIGH;
+}
+
+
+UINT ff_fat32_count_free_word (const BYTE* p, UINT n)
+{
+    UINT i, c = 0;
+    uint64_t z;
+
+    if ((uintptr_t)p & 3) return ff_fat32_count_free_scalar(p, n);
+    for (i = 0; i + 2 <= n; i += 2) {
+        z = ~used_bits(ld_word2(p + i * 4)) & W_HIGH;
+        c += (UINT)(z >> 31 & 1) + (UINT)(z >> 63);
+    }
+    return c + ff_fat32_count_free_scalar(p + i * 4, n - i);
+}
+
+
+UINT ff_fat32_first_free_word (const BYTE* p, UINT n)
+{
+    UINT i;
+    uint64_t z;
+
+    if ((uintptr_t)p & 3) return ff_fat32_first_free_scalar(p, n);
+    for (i = 0; i + 2 <= n; i += 2) {
+        z = ~used_bits(ld_word2(p + i * 4)) & W_HIGH;
+        if (z) return i + ((z & 0x80000000) ? 0 : 1);
+    }
+    return i + ff_fat32_first_free_scalar(p + i * 4, n - i);
+}
+
+
+UINT ff_fat32_free_run_word (const BYTE* p, UINT n)
+{
+    UINT i;
+    uint64_t u;
+
+    if ((uintptr_t)p & 3) return ff_fat32_free_run_scalar(p, n);
+    for (i = 0; i + 2 <= n; i += 2) {
+        u = used_bits(ld_word2(p + i * 4));
+        if (u) return i + ((u & 0x80000000) ? 0 : 1);
+    }
+    return i + ff_fat32_free_run_scalar(p + i * 4, n - i);
+}
+
+
+UINT ff_fat32_chain_run_word (const BYTE* p, UINT n, DWORD next)
+{
+    UINT i;
+    uint64_t w, e;
+
+    if ((uintptr_t)p & 3) return ff_fat32_chain_run_scalar(p, n, next);
+    for (i = 0; i + 2 <= n; i += 2) {
+        e = (uint64_t)((next + i) & FAT32_MASK) | (uint64_t)((next + i + 1) & FAT32_MASK) << 32;
+        w = ld_word2(p + i * 4) & W_MASK;
+        if (w != e) return i + (((DWORD)w == (DWORD)e) ? 1 : 0);
+    }
+    return i + ff_fat32_chain_run_scalar(p + i * 4, n - i, next + i);
+}
+
+#endif	/* FF_FATSCAN_WORD */
+
+
+
+#if FF_FATSCAN_SSE2
+/*-----------------------------------------------------------------------*/
+/* SSE2 kernels: four entries per 128-bit vector                         */
+/*-----------------------------------------------------------------------*/
+
+static int eq_mask (const BYTE* p, __m128i want)	/* b0..b3: entry equals want lane */
+{
+    __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi32(FAT32_MASK));
+
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, want)));
+}
+
+
+UINT ff_fat32_count_free_sse2 (const BYTE* p, UINT n)
+{
+    const __m128i mask = _mm_set1_epi32(FAT32_MASK);
+    __m128i acc = _mm_setzero_si128();
+    UINT i, c;
+    DWORD lane[4];
+
+    for (i = 0; i + 4 <= n; i += 4) {	/* Each matching lane is -1; subtracting counts it */
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i * 4)), mask);
+        acc = _mm_sub_epi32(acc, _mm_cmpeq_epi32(v, _mm_setzero_si128()));
+    }
+    _mm_storeu_si128((__m128i*)lane, acc);
+    c = lane[0] + lane[1] + lane[2] + lane[3];
+    return c + ff_fat32_count_free_scalar(p + i * 4, n - i);
+}
+
+
+UINT ff_fat32_first_free_sse2 (const BYTE* p, UINT n)
+{
+    UINT i;
+    int m;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        m = eq_mask(p + i * 4, _mm_setzero_si128());
+        if (m) return i + ctz32((DWORD)m);
+    }
+    return i + ff_fat32_first_free_scalar(p + i * 4, n - i);
+}
+
+
+UINT ff_fat32_free_run_sse2 (const BYTE* p, UINT n)
+{
+    UINT i;
+    int m;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        m = eq_mask(p + i * 4, _mm_setzero_si128());
+        if (m != 0xF) return i + ctz32((DWORD)~m);
+    }
+    return i + ff_fat32_free_run_scalar(p + i * 4, n - i);
+}
+
+
+UINT ff_fat32_chain_run_sse2 (const BYTE* p, UINT n, DWORD next)
+{
+    UINT i;
+    int m;
+
+    if (next + n > FAT32_MASK) return ff_fat32_chain_run_scalar(p, n, next);	/* Expected links would wrap */
+    __m128i want = _mm_setr_epi32((int)next, (int)(next + 1), (int)(next + 2), (int)(next + 3));
+    for (i = 0; i + 4 <= n; i += 4) {
+        m = eq_mask(p + i * 4, want);
+        if (m != 0xF) return i + ctz32((DWORD)~m);
+        want = _mm_add_epi32(want, _mm_set1_epi32(4));
+    }
+    return i + ff_fat32_chain_run_scalar(p + i * 4, n - i, next + i);
+}
+
+#endif	/* FF_FATSCAN_SSE2 */
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Dispatch to the widest kernels available                              */
+/*-----------------------------------------------------------------------*/
+
+#if FF_FATSCAN_SSE2
+#define FATSCAN(name)	name##_sse2
+#elif FF_FATSCAN_WORD
+#define FATSCAN(name)	name##_word
+#else
+#define FATSCAN(name)	name##_scalar
+#endif
+
+UINT ff_fat32_count_free (const BYTE* p, UINT n)
+{
+    return FATSCAN(ff_fat32_count_free)(p, n);
+}
+
+
+UINT ff_fat32_first_free (const BYTE* p, UINT n)
+{
+    return FATSCAN(ff_fat32_first_free)(p, n);
+}
+
+
+UINT ff_fat32_free_run (const BYTE* p, UINT n)
+{
+    return FATSCAN(ff_fat32_free_run)(p, n);
+}
+
+
+UINT ff_fat32_chain_run (const BYTE* p, UINT n, DWORD next)
+{
+    return FATSCAN(ff_fat32_chain_run)(p, n, next);
+}
@@ -0,0 +1,64 @@
+/*-----------------------------------------------------------------------*/
+/* FAT32 entry scanning kernels                                          */
+/*-----------------------------------------------------------------------*/
+/* Each kernel looks at n consecutive FAT32 entries (typically the rest of
+/  a FAT sector held in the window) and answers one question about them
+/  in a single call. The upper 4 bits of every entry are reserved and
+/  ignored, like get_fat() does.
+/
+/  ff_fat32_*() pick the widest implementation the target has: SSE2 on
+/  x86 hosts, 64-bit word tests on other little-endian targets (ESP32)
+/  and the byte-wise scalar code elsewhere. The variants are exported
+/  separately for the host microbenchmark. */
+
+#ifndef FF_FATSCAN_DEFINED
+#define FF_FATSCAN_DEFINED
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__SSE2__)
+#define FF_FATSCAN_SSE2	1
+#endif
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FF_FATSCAN_WORD	1
+#endif
+
+/* Number of free (zero) entries */
+UINT ff_fat32_count_free (const BYTE* p, UINT n);
+/* Index of the first free entry (n if none) */
+UINT ff_fat32_first_free (const BYTE* p, UINT n);
+/* Number of free entries from the top (length of the leading free run) */
+UINT ff_fat32_free_run (const BYTE* p, UINT n);
+/* Number of entries from the top that link to the next cluster, where the
+/  first entry is expected to hold next, the second next + 1 and so on.
+/  The entry at the returned index is the first non-contiguous link. */
+UINT ff_fat32_chain_run (const BYTE* p, UINT n, DWORD next);
+
+UINT ff_fat32_count_free_scalar (const BYTE* p, UINT n);
+UINT ff_fat32_first_free_scalar (const BYTE* p, UINT n);
+UINT ff_fat32_free_run_scalar (const BYTE* p, UINT n);
+UINT ff_fat32_chain_run_scalar (const BYTE* p, UINT n, DWORD next);
+
+#if FF_FATSCAN_WORD
+UINT ff_fat32_count_free_word (const BYTE* p, UINT n);
+UINT ff_fat32_first_free_word (const BYTE* p, UINT n);
+UINT ff_fat32_free_run_word (const BYTE* p, UINT n);
+UINT ff_fat32_chain_run_word (const BYTE* p, UINT n, DWORD next);
+#endif
+
+#if FF_FATSCAN_SSE2
+UINT ff_fat32_count_free_sse2 (const BYTE* p, UINT n);
+UINT ff_fat32_first_free_sse2 (const BYTE* p, UINT n);
+UINT ff_fat32_free_run_sse2 (const BYTE* p, UINT n);
+UINT ff_fat32_chain_run_sse2 (const BYTE* p, UINT n, DWORD next);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FF_FATSCAN_DEFINED */
@@ -15,7 +15,7 @@
 /  and optional writing functions as well. */
 
 
-#define FF_FS_MINIMIZE	3
+#define FF_FS_MINIMIZE	0
 /* This option defines minimization level to remove some basic API functions.
 /
 /   0: Basic functions are fully enabled.
@@ -34,7 +34,7 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
@@ -113,7 +113,7 @@
 */
 
 
-#define FF_USE_LFN		1
+#define FF_USE_LFN		3
 #define FF_MAX_LFN		255
 /* The FF_USE_LFN switches the support for LFN (long file name).
 /
@@ -133,7 +133,7 @@
 /  ff_memfree() exemplified in ffsystem.c, need to be added to the project. */
 
 
-#define FF_LFN_UNICODE	0
+#define FF_LFN_UNICODE	2
 /* This option switches the character encoding on the API when LFN is enabled.
 /
 /   0: ANSI/OEM in current CP (TCHAR = char)
@@ -213,7 +213,7 @@
 /  f_fdisk function. 0x100000000 max. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -224,13 +224,29 @@
 / System Configurations
 /---------------------------------------------------------------------------*/
 
-#define FF_FS_TINY		1
+#define FF_FS_TINY		0
 /* This option switches tiny buffer configuration. (0:Normal or 1:Tiny)
 /  At the tiny configuration, size of file object (FIL) is shrinked FF_MAX_SS bytes.
 /  Instead of private sector buffer eliminated from the file object, common sector
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
+#ifndef FF_WIN_FAT_SLOTS
+#define FF_WIN_FAT_SLOTS	2
+#endif
+#ifndef FF_WIN_DIR_SLOTS
+#define FF_WIN_DIR_SLOTS	2
+#endif
+/* These options set the number of sectors kept behind the disk access window
+/  (fs->win[]) in the filesystem object. Sectors of the 1st FAT are kept in the
+/  FAT pool and any other sector (VBR, FSInfo, directories) in the directory
+/  pool, so FAT lookups do not evict the directory being scanned. Each slot
+/  costs FF_MAX_SS bytes per volume. Dirty slots are written back in ascending
+/  LBA order when the window is synced. 0/0 gives the single window of the
+/  original FatFs. The cache requires FF_FS_TINY == 0. Both can be set from
+/  the compiler command line; make -C host bench compares 0/0, 2/2 and 4/4. */
+
+
 #define FF_FS_EXFAT		0
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
@@ -263,6 +279,17 @@
 */
 
 
+#define FF_FS_HINT		1
+/* The option FF_FS_HINT switches keeping the free cluster count and the last
+/  allocated cluster of each volume in a table that outlives f_mount() calls.
+/  When FSInfo is missing, invalid or not trusted (FF_FS_NOFSINFO), a remount
+/  takes the values from the table instead of forcing a full FAT scan.
+/  ff_hint_load(), ff_hint_save() and ff_hint_clear() need to be added to the
+/  project (see ffsystem.c). ff_hint_clear() must be called when the volume is
+/  modified behind FatFs. This option has no effect in read-only configuration.
+*/
+
+
 #define FF_FS_LOCK		0
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
@@ -275,10 +302,16 @@
 /      lock control is independent of re-entrancy. */
 
 
-/* #include <somertos.h>	// O/S definitions */
-#define FF_FS_REENTRANT	0
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#define FF_SYNC_t		SemaphoreHandle_t
+#else
+#include <pthread.h>
+#define FF_SYNC_t		pthread_mutex_t*
+#endif
+#define FF_FS_REENTRANT	1
 #define FF_FS_TIMEOUT	1000
-#define FF_SYNC_t		HANDLE
 /* The option FF_FS_REENTRANT switches the re-entrancy (thread safe) of the FatFs
 /  module itself. Note that regardless of this option, file access to different
 /  volume is always re-entrant and volume control functions, f_mount(), f_mkfs()
@@ -291,7 +324,8 @@
 /      function, must be added to the project. Samples are available in
 /      option/syscall.c.
 /
-/  The FF_FS_TIMEOUT defines timeout period in unit of time tick.
+/  The FF_FS_TIMEOUT defines timeout period in unit of time tick. (ffsystem.c
+/  here takes it in milliseconds on both FreeRTOS and the pthread host build.)
 /  The FF_SYNC_t defines O/S dependent sync object type. e.g. HANDLE, ID, OS_EVENT*,
 /  SemaphoreHandle_t and etc. A header file for O/S definitions needs to be
 /  included somewhere in the scope of ff.h. */
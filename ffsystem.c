@@ -38,6 +38,15 @@ void ff_memfree (
 
 #if FF_FS_REENTRANT	/* Mutal exclusion */
 
+/* FreeRTOS mutexes on the device, POSIX mutexes in the host build
+/  (host/). FF_FS_TIMEOUT is in milliseconds for both. */
+
+#if !defined(ESP_PLATFORM)
+#include <stdlib.h>
+#include <time.h>
+#endif
+
+
 /*------------------------------------------------------------------------*/
 /* Create a Synchronization Object                                        */
 /*------------------------------------------------------------------------*/
@@ -46,35 +55,23 @@ void ff_memfree (
 /  When a 0 is returned, the f_mount() function fails with FR_INT_ERR.
 */
 
-//const osMutexDef_t Mutex[FF_VOLUMES];	/* Table of CMSIS-RTOS mutex */
-
-
 int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object */
 	BYTE vol,			/* Corresponding volume (logical drive number) */
 	FF_SYNC_t* sobj		/* Pointer to return the created sync object */
 )
 {
-	/* Win32 */
-	*sobj = CreateMutex(NULL, FALSE, NULL);
-	return (int)(*sobj != INVALID_HANDLE_VALUE);
-
-	/* uITRON */
-//	T_CSEM csem = {TA_TPRI,1,1};
-//	*sobj = acre_sem(&csem);
-//	return (int)(*sobj > 0);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	*sobj = OSMutexCreate(0, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	*sobj = xSemaphoreCreateMutex();
-//	return (int)(*sobj != NULL);
-
-	/* CMSIS-RTOS */
-//	*sobj = osMutexCreate(&Mutex[vol]);
-//	return (int)(*sobj != NULL);
+	(void)vol;
+#if defined(ESP_PLATFORM)
+	*sobj = xSemaphoreCreateMutex();
+	return (int)(*sobj != NULL);
+#else
+	*sobj = (pthread_mutex_t*)malloc(sizeof (pthread_mutex_t));
+	if (*sobj && pthread_mutex_init(*sobj, NULL) != 0) {
+		free(*sobj);
+		*sobj = NULL;
+	}
+	return (int)(*sobj != NULL);
+#endif
 }
 
 
@@ -90,23 +87,13 @@ int ff_del_syncobj (	/* 1:Function succeeded, 0:Could not delete due to an error
 	FF_SYNC_t sobj		/* Sync object tied to the logical drive to be deleted */
 )
 {
-	/* Win32 */
-	return (int)CloseHandle(sobj);
-
-	/* uITRON */
-//	return (int)(del_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexDel(sobj, OS_DEL_ALWAYS, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//  vSemaphoreDelete(sobj);
-//	return 1;
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexDelete(sobj) == osOK);
+#if defined(ESP_PLATFORM)
+	vSemaphoreDelete(sobj);
+#else
+	pthread_mutex_destroy(sobj);
+	free(sobj);
+#endif
+	return 1;
 }
 
 
@@ -121,22 +108,20 @@ int ff_req_grant (	/* 1:Got a grant to access the volume, 0:Could not get a gran
 	FF_SYNC_t sobj	/* Sync object to wait */
 )
 {
-	/* Win32 */
-	return (int)(WaitForSingleObject(sobj, FF_FS_TIMEOUT) == WAIT_OBJECT_0);
-
-	/* uITRON */
-//	return (int)(wai_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexPend(sobj, FF_FS_TIMEOUT, &err));
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	return (int)(xSemaphoreTake(sobj, FF_FS_TIMEOUT) == pdTRUE);
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexWait(sobj, FF_FS_TIMEOUT) == osOK);
+#if defined(ESP_PLATFORM)
+	return (int)(xSemaphoreTake(sobj, pdMS_TO_TICKS(FF_FS_TIMEOUT)) == pdTRUE);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += FF_FS_TIMEOUT / 1000;
+	ts.tv_nsec += (long)(FF_FS_TIMEOUT % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return (int)(pthread_mutex_timedlock(sobj, &ts) == 0);
+#endif
 }
 
 
@@ -150,20 +135,119 @@ void ff_rel_grant (
 	FF_SYNC_t sobj	/* Sync object to be signaled */
 )
 {
-	/* Win32 */
-	ReleaseMutex(sobj);
+#if defined(ESP_PLATFORM)
+	xSemaphoreGive(sobj);
+#else
+	pthread_mutex_unlock(sobj);
+#endif
+}
+
+#endif
+
+
+
+#if !FF_FS_READONLY && FF_FS_HINT	/* Allocation hints */
+
+/*------------------------------------------------------------------------*/
+/* Allocation Hint Table                                                  */
+/*------------------------------------------------------------------------*/
+/* One slot per physical drive. On ESP32 the table sits in RTC memory that
+/  is not initialized at boot, so it also survives a software reset; the
+/  check word rejects whatever is there after power-on.
+*/
+
+#if defined(ESP_PLATFORM)
+#include "esp_attr.h"
+#define HINT_ATTR	RTC_NOINIT_ATTR
+#else
+#define HINT_ATTR
+#endif
+
+#define HINT_MAGIC	0x544E4948	/* "HINT" */
+
+typedef struct {
+	DWORD magic;
+	DWORD key[3];		/* VSN, number of FAT entries, volume base sector */
+	DWORD free_clst;
+	DWORD last_clst;
+	DWORD check;
+} HINT;
+
+static HINT_ATTR HINT HintTbl[FF_VOLUMES];
+
+
+static DWORD hint_check (const HINT* h)
+{
+	return h->magic ^ h->key[0] ^ (h->key[1] << 1) ^ (h->key[2] << 2) ^ (h->free_clst << 3) ^ (h->last_clst << 4);
+}
+
+
+/*------------------------------------------------------------------------*/
+/* Get Saved Hints of a Volume                                            */
+/*------------------------------------------------------------------------*/
+/* This function is called in volume mount. It returns 1 only when the slot
+/  holds hints of the same volume layout.
+*/
+
+int ff_hint_load (		/* 1:Hints found, 0:No valid hints */
+	BYTE pdrv,			/* Physical drive */
+	const DWORD key[3],	/* Volume key */
+	DWORD* free_clst,	/* Returns the number of free clusters */
+	DWORD* last_clst	/* Returns the last allocated cluster */
+)
+{
+	const HINT* h;
+
+
+	if (pdrv >= FF_VOLUMES) return 0;
+	h = &HintTbl[pdrv];
+	if (h->magic != HINT_MAGIC || h->check != hint_check(h)) return 0;
+	if (h->key[0] != key[0] || h->key[1] != key[1] || h->key[2] != key[2]) return 0;
+	*free_clst = h->free_clst;
+	*last_clst = h->last_clst;
+	return 1;
+}
+
+
+/*------------------------------------------------------------------------*/
+/* Save Hints of a Volume                                                 */
+/*------------------------------------------------------------------------*/
+/* This function is called whenever FatFs has an exact free cluster count,
+/  at sync and after a full FAT scan.
+*/
+
+void ff_hint_save (
+	BYTE pdrv,			/* Physical drive */
+	const DWORD key[3],	/* Volume key */
+	DWORD free_clst,	/* Number of free clusters */
+	DWORD last_clst		/* Last allocated cluster */
+)
+{
+	HINT* h;
+
 
-	/* uITRON */
-//	sig_sem(sobj);
+	if (pdrv >= FF_VOLUMES) return;
+	h = &HintTbl[pdrv];
+	h->magic = HINT_MAGIC;
+	h->key[0] = key[0]; h->key[1] = key[1]; h->key[2] = key[2];
+	h->free_clst = free_clst;
+	h->last_clst = last_clst;
+	h->check = hint_check(h);
+}
 
-	/* uC/OS-II */
-//	OSMutexPost(sobj);
 
-	/* FreeRTOS */
-//	xSemaphoreGive(sobj);
+/*------------------------------------------------------------------------*/
+/* Forget Hints of a Drive                                                */
+/*------------------------------------------------------------------------*/
+/* Call this when something other than FatFs changes the FAT, e.g. a USB
+/  host writing the card.
+*/
 
-	/* CMSIS-RTOS */
-//	osMutexRelease(sobj);
+void ff_hint_clear (
+	BYTE pdrv			/* Physical drive */
+)
+{
+	if (pdrv < FF_VOLUMES) HintTbl[pdrv].magic = 0;
 }
 
 #endif
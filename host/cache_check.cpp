@@ -0,0 +1,188 @@
+/*-----------------------------------------------------------------------*/
+/* BlockCache consistency check on the host                              */
+/*-----------------------------------------------------------------------*/
+/* Drives the device's BlockCache over a RAM device through its Local and
+/  Host ports with a randomised mix of single and multi-sector reads,
+/  writes and trims, and compares every read with a shadow copy:
+/
+/  - one thread interleaving both ports, so each port reads back what the
+/    other just wrote, cached or not, with sessions opened and nested at
+/    random and the dirty spans checked against the writes;
+/  - one thread per port on disjoint halves, to exercise the cache lock.
+/
+/  After each phase the device itself must match the shadow, since the
+/  cache is write-through. Prints one JSON document like the benchmarks
+/  and exits non-zero on any mismatch. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+
+#include "BlockCache.h"
+#include "Metrics.h"
+
+#define SECTORS     512     /* device size */
+#define META_LIMIT  64      /* below: cached at any transfer size */
+#define MAX_RUN     8       /* longest multi-sector transfer */
+
+void metrics_record(metric_stage_t, uint32_t) {}
+void metrics_count(metric_counter_t, uint32_t) {}
+
+
+class RamDevice : public BlockDevice
+{
+public:
+    RamDevice() : data(SECTORS * 512, 0) {}
+
+    bool read(uint8_t* buffer, uint32_t sector) override { return readSectors(buffer, sector, 1); }
+    bool write(const uint8_t* buffer, uint32_t sector) override { return writeSectors(buffer, sector, 1); }
+    bool readSectors(uint8_t* buffer, uint32_t sector, uint32_t count) override
+    {
+        if (sector + count > SECTORS) return false;
+        memcpy(buffer, &data[sector * 512], count * 512);
+        return true;
+    }
+    bool writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count) override
+    {
+        if (sector + count > SECTORS) return false;
+        memcpy(&data[sector * 512], buffer, count * 512);
+        return true;
+    }
+    bool sync() override { return true; }
+    bool trim(uint32_t start, uint32_t end) override
+    {
+        if (end >= SECTORS || start > end) return false;
+        memset(&data[start * 512], 0, (end - start + 1) * 512);
+        return true;
+    }
+    sdcard_type_t type() override { return CARD_SDHC; }
+    uint32_t sectorCount() override { return SECTORS; }
+    uint32_t sectorSize() override { return 512; }
+
+    std::vector<uint8_t> data;
+};
+
+
+struct Worker {
+    BlockCache* cache;
+    std::vector<uint8_t>* shadow;
+    BlockCache::Owner owners[2];    /* ports to pick from */
+    unsigned nowners;
+    uint32_t first, last;           /* sectors this worker may touch */
+    unsigned ops;
+    uint32_t seed;
+    unsigned reads, writes, trims, bad, dirty_bad;
+};
+
+static uint32_t next (uint32_t* x)
+{
+    *x ^= *x << 13; *x ^= *x >> 17; *x ^= *x << 5;
+    return *x;
+}
+
+static void* run (void* arg)
+{
+    Worker* w = (Worker*)arg;
+    uint8_t buf[MAX_RUN * 512];
+    unsigned depth = 0;
+    BlockDevice* sessions[8];
+
+    for (unsigned i = 0; i < w->ops; i++) {
+        BlockCache::Owner owner = w->owners[next(&w->seed) % w->nowners];
+        BlockDevice* port = w->cache->port(owner);
+        uint32_t span = w->last - w->first + 1;
+        /* Mostly metadata-sized single sectors, some longer runs */
+        uint32_t count = next(&w->seed) % 4 ? 1 : 1 + next(&w->seed) % MAX_RUN;
+        uint32_t sector = w->first + next(&w->seed) % span;
+        if (sector + count > w->last + 1) count = w->last + 1 - sector;
+        uint32_t op = next(&w->seed) % 16;
+
+        if (op == 0 && depth < 8) {             /* open a session */
+            if (port->beginSession()) sessions[depth++] = port;
+        } else if (op == 1 && depth) {          /* close the innermost one */
+            sessions[--depth]->endSession();
+        } else if (op < 8) {
+            bool ok = count == 1 ? port->read(buf, sector) : port->readSectors(buf, sector, count);
+            w->reads++;
+            if (!ok || memcmp(buf, &(*w->shadow)[sector * 512], count * 512)) w->bad++;
+        } else if (op < 15) {
+            for (uint32_t k = 0; k < count * 512; k++) buf[k] = (uint8_t)next(&w->seed);
+            uint32_t first, last;
+            w->cache->takeDirty(owner, first, last);
+            bool ok = count == 1 ? port->write(buf, sector) : port->writeSectors(buf, sector, count);
+            w->writes++;
+            if (!ok) w->bad++;
+            memcpy(&(*w->shadow)[sector * 512], buf, count * 512);
+            if (w->nowners > 1 && (!w->cache->takeDirty(owner, first, last)
+                                   || first != sector || last != sector + count - 1)) w->dirty_bad++;
+        } else {
+            w->trims++;
+            if (!port->trim(sector, sector + count - 1)) w->bad++;
+            memset(&(*w->shadow)[sector * 512], 0, count * 512);
+        }
+    }
+    while (depth) sessions[--depth]->endSession();
+    return NULL;
+}
+
+static unsigned device_mismatches (const RamDevice& dev, const std::vector<uint8_t>& shadow)
+{
+    unsigned bad = 0;
+
+    for (uint32_t s = 0; s < SECTORS; s++) {
+        if (memcmp(&dev.data[s * 512], &shadow[s * 512], 512)) bad++;
+    }
+    return bad;
+}
+
+static void report (const char* phase, const Worker* w, unsigned n, unsigned device_bad, bool last)
+{
+    unsigned reads = 0, writes = 0, trims = 0, bad = 0, dirty_bad = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        reads += w[i].reads; writes += w[i].writes; trims += w[i].trims;
+        bad += w[i].bad; dirty_bad += w[i].dirty_bad;
+    }
+    printf("    {\"phase\": \"%s\", \"threads\": %u, \"reads\": %u, \"writes\": %u, \"trims\": %u,\n"
+           "     \"bad_reads\": %u, \"bad_dirty_spans\": %u, \"device_mismatches\": %u}%s\n",
+           phase, n, reads, writes, trims, bad, dirty_bad, device_bad, last ? "" : ",");
+}
+
+int main (int argc, char* argv[])
+{
+    unsigned ops = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : 200000;
+    RamDevice dev;
+    BlockCache cache;
+    std::vector<uint8_t> shadow(SECTORS * 512, 0);
+    unsigned failures = 0;
+
+    if (!cache.attach(&dev)) return 1;
+    cache.setMetadataLimit(META_LIMIT);
+    printf("{\"cache_check\": [\n");
+
+    /* Both ports from one thread over the whole device */
+    Worker mixed = { &cache, &shadow, { BlockCache::Local, BlockCache::Host }, 2, 0, SECTORS - 1,
+                     ops, 0x9E3779B9u, 0, 0, 0, 0, 0 };
+    run(&mixed);
+    unsigned device_bad = device_mismatches(dev, shadow);
+    report("interleaved", &mixed, 1, device_bad, false);
+    failures += mixed.bad + mixed.dirty_bad + device_bad;
+
+    /* One thread per port, each on its own half */
+    Worker split[2] = {
+        { &cache, &shadow, { BlockCache::Local }, 1, 0, SECTORS / 2 - 1, ops / 2, 0x12345678u, 0, 0, 0, 0, 0 },
+        { &cache, &shadow, { BlockCache::Host }, 1, SECTORS / 2, SECTORS - 1, ops / 2, 0x87654321u, 0, 0, 0, 0, 0 },
+    };
+    pthread_t tids[2];
+    for (unsigned i = 0; i < 2; i++) pthread_create(&tids[i], NULL, run, &split[i]);
+    for (unsigned i = 0; i < 2; i++) pthread_join(tids[i], NULL);
+    device_bad = device_mismatches(dev, shadow);
+    report("threaded", split, 2, device_bad, true);
+    failures += split[0].bad + split[1].bad + device_bad;
+
+    printf("]}\n");
+    cache.detach();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,587 @@
+/*-----------------------------------------------------------------------*/
+/* Trace-driven cache and read-ahead simulator                           */
+/*-----------------------------------------------------------------------*/
+/* Replays MSC traces (trace_format.h) through a model of the dispatch in
+/  esp32musicdrive.ino: a request inside a catalog file's sector range is
+/  a remote read over the network, anything else is the SD card. Sectors
+/  of the chosen scope go through a sector cache (LRU, ARC or CLOCK) with
+/  read-ahead on remote misses, bounded by the end of the file.
+/
+/  Every combination of --policy, --cache and --readahead is replayed and
+/  reported as one JSON document: hit rate, network requests and bytes,
+/  wasted read-ahead and the modeled request latency distribution.
+/
+/  Without a trace, --synth builds a catalog with FatLayout and makes up
+/  a host session (mount, FAT and directory scans, sequential playback
+/  with seeks). With a recorded trace, the catalog ranges are unknown, so
+/  each record's source says whether it was remote and read-ahead is
+/  bounded only by its depth. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "trace_format.h"
+#include "FatLayout.h"
+
+struct Range {
+    uint32_t sector;
+    uint32_t sectors;
+};
+
+struct Model {
+    double sd_base_us = 400, sd_sector_us = 40;         /* SD command + per sector */
+    double net_rtt_us = 4000, net_sector_us = 400;      /* Request round trip + per sector */
+    double net_jitter_us = 1500;                        /* Mean of the exponential tail */
+    double hit_us = 15;                                 /* Serving a request from RAM */
+    bool cache_local = false;                           /* Cache SD sectors too */
+};
+
+
+/*-----------------------------------------------------------------------*/
+/* Cache policies, keyed by sector                                       */
+/*-----------------------------------------------------------------------*/
+
+class Cache
+{
+public:
+    virtual ~Cache() {}
+    virtual bool lookup(uint32_t key) = 0;              /* Marks a hit as used */
+    virtual bool contains(uint32_t key) const = 0;      /* No side effects */
+    /* Returns the evicted key, or UINT32_MAX */
+    virtual uint32_t insert(uint32_t key) = 0;
+    virtual void erase(uint32_t key) = 0;
+};
+
+
+class LruCache : public Cache
+{
+public:
+    explicit LruCache(size_t capacity) : _capacity(capacity) {}
+
+    bool lookup(uint32_t key) override
+    {
+        auto it = _map.find(key);
+        if (it == _map.end()) return false;
+        _list.splice(_list.begin(), _list, it->second);
+        return true;
+    }
+    bool contains(uint32_t key) const override { return _map.count(key) != 0; }
+    uint32_t insert(uint32_t key) override
+    {
+        uint32_t evicted = UINT32_MAX;
+        if (lookup(key)) return evicted;
+        if (_map.size() >= _capacity) {
+            evicted = _list.back();
+            _map.erase(evicted);
+            _list.pop_back();
+        }
+        _list.push_front(key);
+        _map[key] = _list.begin();
+        return evicted;
+    }
+    void erase(uint32_t key) override
+    {
+        auto it = _map.find(key);
+        if (it == _map.end()) return;
+        _list.erase(it->second);
+        _map.erase(it);
+    }
+
+private:
+    size_t _capacity;
+    std::list<uint32_t> _list;
+    std::unordered_map<uint32_t, std::list<uint32_t>::iterator> _map;
+};
+
+
+/* Second chance: a hit sets the reference bit, the hand clears bits until
+/  it finds an unreferenced slot to replace. */
+class ClockCache : public Cache
+{
+public:
+    explicit ClockCache(size_t capacity) : _keys(capacity, UINT32_MAX), _ref(capacity, 0), _hand(0) {}
+
+    bool lookup(uint32_t key) override
+    {
+        auto it = _map.find(key);
+        if (it == _map.end()) return false;
+        _ref[it->second] = 1;
+        return true;
+    }
+    bool contains(uint32_t key) const override { return _map.count(key) != 0; }
+    uint32_t insert(uint32_t key) override
+    {
+        if (lookup(key)) return UINT32_MAX;
+        while (_keys[_hand] != UINT32_MAX && _ref[_hand]) {
+            _ref[_hand] = 0;
+            _hand = (_hand + 1) % _keys.size();
+        }
+        uint32_t evicted = _keys[_hand];
+        if (evicted != UINT32_MAX) _map.erase(evicted);
+        _keys[_hand] = key;
+        _ref[_hand] = 0;
+        _map[key] = _hand;
+        _hand = (_hand + 1) % _keys.size();
+        return evicted;
+    }
+    void erase(uint32_t key) override
+    {
+        auto it = _map.find(key);
+        if (it == _map.end()) return;
+        _keys[it->second] = UINT32_MAX;
+        _map.erase(it);
+    }
+
+private:
+    std::vector<uint32_t> _keys;
+    std::vector<uint8_t> _ref;
+    size_t _hand;
+    std::unordered_map<uint32_t, size_t> _map;
+};
+
+
+/* Adaptive Replacement Cache (Megiddo and Modha): T1 holds sectors seen
+/  once, T2 sectors seen again, B1/B2 remember what each recently evicted
+/  and steer the target size p of T1. */
+class ArcCache : public Cache
+{
+public:
+    explicit ArcCache(size_t capacity) : _c(capacity), _p(0) {}
+
+    bool lookup(uint32_t key) override
+    {
+        auto it = _where.find(key);
+        if (it == _where.end() || (it->second.list != T1 && it->second.list != T2)) return false;
+        move(key, T2);
+        return true;
+    }
+    bool contains(uint32_t key) const override
+    {
+        auto it = _where.find(key);
+        return it != _where.end() && (it->second.list == T1 || it->second.list == T2);
+    }
+    uint32_t insert(uint32_t key) override
+    {
+        uint32_t evicted = UINT32_MAX;
+        auto it = _where.find(key);
+        if (it != _where.end() && (it->second.list == T1 || it->second.list == T2)) {
+            move(key, T2);
+            return evicted;
+        }
+        if (it != _where.end() && it->second.list == B1) {
+            _p = std::min(_c, _p + std::max<size_t>(1, _lists[B2].size() / std::max<size_t>(1, _lists[B1].size())));
+            if (full()) evicted = replace(false);
+            move(key, T2);
+            return evicted;
+        }
+        if (it != _where.end() && it->second.list == B2) {
+            size_t d = std::max<size_t>(1, _lists[B1].size() / std::max<size_t>(1, _lists[B2].size()));
+            _p = _p > d ? _p - d : 0;
+            if (full()) evicted = replace(true);
+            move(key, T2);
+            return evicted;
+        }
+
+        size_t l1 = _lists[T1].size() + _lists[B1].size();
+        size_t total = l1 + _lists[T2].size() + _lists[B2].size();
+        if (l1 == _c) {
+            if (_lists[T1].size() < _c) {
+                drop(B1);
+                if (full()) evicted = replace(false);
+            } else {
+                evicted = _lists[T1].back();
+                drop(T1);
+            }
+        } else if (total >= _c) {
+            if (total == 2 * _c) drop(B2);
+            if (full()) evicted = replace(false);
+        }
+        push(key, T1);
+        return evicted;
+    }
+    void erase(uint32_t key) override
+    {
+        auto it = _where.find(key);
+        if (it == _where.end()) return;
+        _lists[it->second.list].erase(it->second.pos);
+        _where.erase(it);
+    }
+
+private:
+    enum { T1, T2, B1, B2 };
+    struct Pos {
+        int list;
+        std::list<uint32_t>::iterator pos;
+    };
+
+    /* Writes erase resident sectors, so T1 + T2 can be short of c even
+    /  when the ghost lists are full */
+    bool full() const { return _lists[T1].size() + _lists[T2].size() >= _c; }
+    void push(uint32_t key, int list)
+    {
+        _lists[list].push_front(key);
+        _where[key] = Pos{ list, _lists[list].begin() };
+    }
+    void move(uint32_t key, int list)
+    {
+        erase(key);
+        push(key, list);
+    }
+    void drop(int list)
+    {
+        uint32_t key = _lists[list].back();
+        _lists[list].pop_back();
+        _where.erase(key);
+    }
+    /* Moves the LRU page of T1 or T2 to its ghost list; returns it */
+    uint32_t replace(bool inB2)
+    {
+        size_t t1 = _lists[T1].size();
+        if (t1 && (t1 > _p || (inB2 && t1 == _p))) {
+            uint32_t key = _lists[T1].back();
+            move(key, B1);
+            return key;
+        }
+        if (_lists[T2].empty()) return UINT32_MAX;
+        uint32_t key = _lists[T2].back();
+        move(key, B2);
+        return key;
+    }
+
+    size_t _c, _p;
+    std::list<uint32_t> _lists[4];
+    std::unordered_map<uint32_t, Pos> _where;
+};
+
+
+static Cache* make_cache (const std::string& policy, size_t capacity)
+{
+    if (policy == "lru") return new LruCache(capacity);
+    if (policy == "clock") return new ClockCache(capacity);
+    if (policy == "arc") return new ArcCache(capacity);
+    return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Replay                                                                */
+/*-----------------------------------------------------------------------*/
+
+struct Request {
+    uint8_t op;
+    uint8_t source;     /* From the trace; used when there are no ranges */
+    uint32_t lba;
+    uint32_t sectors;
+};
+
+struct Result {
+    uint64_t requests = 0, hits = 0, sector_hits = 0, sector_misses = 0;
+    uint64_t net_requests = 0, net_sectors = 0, sd_requests = 0, sd_sectors = 0;
+    uint64_t prefetched = 0, prefetch_used = 0, prefetch_wasted = 0;
+    std::vector<double> latency;
+};
+
+
+static uint32_t rnd (void)
+{
+    static uint32_t x = 2463534242u;
+
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+
+
+/* Every replay draws the same jitter sequence, so runs compare policies
+/  rather than luck */
+static double jitter (double mean, uint32_t* x)
+{
+    *x ^= *x << 13; *x ^= *x >> 17; *x ^= *x << 5;
+    return mean > 0 ? -mean * log((*x + 1.0) / 4294967297.0) : 0;
+}
+
+
+/* Same lookup as findFile() on the device */
+static const Range* find_range (const std::vector<Range>& ranges, uint32_t lba)
+{
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), lba,
+                               [](uint32_t l, const Range& r) { return l < r.sector; });
+    if (it == ranges.begin()) return NULL;
+    --it;
+    return lba - it->sector < it->sectors ? &*it : NULL;
+}
+
+
+static Result replay (const std::vector<Request>& reqs, const std::vector<Range>& ranges, const Model& m,
+                      const std::string& policy, size_t capacity, uint32_t readahead)
+{
+    Cache* cache = make_cache(policy, capacity);
+    std::unordered_set<uint32_t> unused;    /* Read ahead, not yet asked for */
+    uint32_t seed = 88675123u;
+    Result res;
+
+    for (const Request& q : reqs) {
+        const Range* file = ranges.empty() ? NULL : find_range(ranges, q.lba);
+        bool remote = ranges.empty() ? (q.source == TRACE_SRC_REMOTE || q.source == TRACE_SRC_REMOTE_CACHE) : file != NULL;
+        bool cached = remote || m.cache_local;
+        double us = 0;
+
+        res.requests++;
+        if (q.op == TRACE_OP_WRITE) {
+            for (uint32_t i = 0; i < q.sectors; i++) {
+                cache->erase(q.lba + i);
+                unused.erase(q.lba + i);
+            }
+            res.sd_requests++;
+            res.sd_sectors += q.sectors;
+            res.latency.push_back(m.sd_base_us + m.sd_sector_us * q.sectors);
+            continue;
+        }
+        if (!cached) {
+            res.sd_requests++;
+            res.sd_sectors += q.sectors;
+            res.latency.push_back(m.sd_base_us + m.sd_sector_us * q.sectors);
+            continue;
+        }
+
+        /* Each run of missing sectors is one fetch; the last one is
+        /  extended by the read-ahead depth, up to the end of the file */
+        uint32_t i = 0, missing = 0;
+        while (i < q.sectors) {
+            uint32_t lba = q.lba + i;
+            if (cache->lookup(lba)) {
+                res.sector_hits++;
+                if (unused.erase(lba)) res.prefetch_used++;
+                i++;
+                continue;
+            }
+            uint32_t run = 0;
+            while (i + run < q.sectors && !cache->contains(q.lba + i + run)) run++;
+            uint32_t extra = 0;
+            if (i + run == q.sectors && remote) {
+                uint32_t limit = file ? file->sector + file->sectors : UINT32_MAX;
+                uint32_t end = q.lba + q.sectors;
+                while (extra < readahead && end + extra < limit && !cache->contains(end + extra)) extra++;
+            }
+            for (uint32_t k = 0; k < run + extra; k++) {
+                uint32_t evicted = cache->insert(lba + k);
+                if (evicted != UINT32_MAX && unused.erase(evicted)) res.prefetch_wasted++;
+                if (k >= run) unused.insert(lba + k);
+            }
+            if (remote) {
+                res.net_requests++;
+                res.net_sectors += run + extra;
+                us += m.net_rtt_us + m.net_sector_us * (run + extra) + jitter(m.net_jitter_us, &seed);
+            } else {
+                res.sd_requests++;
+                res.sd_sectors += run;
+                us += m.sd_base_us + m.sd_sector_us * run;
+            }
+            res.prefetched += extra;
+            res.sector_misses += run;
+            missing += run;
+            i += run;
+        }
+        if (!missing) {
+            res.hits++;
+            us = m.hit_us;
+        }
+        res.latency.push_back(us);
+    }
+    res.prefetch_wasted += unused.size();
+    delete cache;
+    return res;
+}
+
+
+static double pct (const std::vector<double>& v, unsigned p)
+{
+    return v.empty() ? 0 : v[(size_t)((v.size() - 1) * (uint64_t)p / 100)];
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Inputs                                                                */
+/*-----------------------------------------------------------------------*/
+
+static bool load_trace (const char* path, std::vector<Request>& reqs)
+{
+    FILE* f = fopen(path, "rb");
+    trace_header_t h;
+    trace_record_t r;
+
+    if (!f) return false;
+    if (fread(&h, sizeof h, 1, f) != 1 || memcmp(h.magic, TRACE_MAGIC, 4) || h.version != TRACE_VERSION
+        || h.record_size != sizeof r) {
+        fclose(f);
+        return false;
+    }
+    for (uint32_t i = 0; i < h.records && fread(&r, sizeof r, 1, f) == 1; i++) {
+        if (r.source == TRACE_SRC_ERROR) continue;
+        reqs.push_back(Request{ r.op, r.source, r.lba, std::max<uint32_t>(1, (r.size + 511) / 512) });
+    }
+    fclose(f);
+    return true;
+}
+
+
+/* A made-up host session on a FatLayout catalog: mount, a full directory
+/  scan, then playback. Tracks are read in 32 KiB requests from the start,
+/  with an occasional seek, and every few tracks the host rereads the
+/  directory and the FAT sectors of the next file, as car stereos do. */
+static void synth (unsigned files, unsigned tracks, std::vector<Request>& reqs, std::vector<Range>& ranges)
+{
+    FatLayout layout;
+    char name[64];
+
+    for (unsigned i = 0; i < files; i++) {
+        snprintf(name, sizeof name, "Artist %u - Track %u.flac", i % 37, i);
+        layout.add(name, 3000000 + (uint64_t)((i * 2654435761u) % 9000000));
+    }
+    layout.plan(64u * 1024 * 2048);     /* 64 GiB */
+
+    uint32_t fatSectors = (layout.clusterCount() + 2 + 127) / 128;
+    uint32_t fatStart = layout.dataStart() - 2 * fatSectors;
+    uint32_t dirSectors = (files * 4 * 32 + 511) / 512 + 1;
+
+    for (size_t i = 0; i < layout.count(); i++) {
+        const FatLayout::Entry& e = layout.entry(i);
+        if (e.cluster) ranges.push_back(Range{ e.sector, e.clusters * layout.sectorsPerCluster() });
+    }
+
+    reqs.push_back(Request{ TRACE_OP_READ, TRACE_SRC_LOCAL, 0, 1 });
+    for (uint32_t s = 0; s < 8; s++) reqs.push_back(Request{ TRACE_OP_READ, TRACE_SRC_LOCAL, layout.partitionStart() + s, 1 });
+    for (uint32_t s = 0; s < dirSectors; s += 8) reqs.push_back(Request{ TRACE_OP_READ, TRACE_SRC_LOCAL, layout.dataStart() + s, 8 });
+
+    for (unsigned t = 0; t < tracks; t++) {
+        const FatLayout::Entry& e = layout.entry(rnd() % layout.count());
+        if (!e.cluster) continue;
+        uint32_t len = (uint32_t)((e.size + 511) / 512);
+        uint32_t pos = 0, stop = (rnd() % 4) ? len : len / (1 + rnd() % 4);   /* Some tracks are skipped */
+
+        if (t % 4 == 0) {
+            for (uint32_t s = 0; s < dirSectors; s += 8) reqs.push_back(Request{ TRACE_OP_READ, TRACE_SRC_LOCAL, layout.dataStart() + s, 8 });
+        }
+        for (uint32_t c = e.cluster; c < e.cluster + e.clusters; c += 128) {
+            reqs.push_back(Request{ TRACE_OP_READ, TRACE_SRC_LOCAL, fatStart + c / 128, 1 });
+        }
+        while (pos < stop) {
+            uint32_t n = std::min<uint32_t>(64, len - pos);
+            reqs.push_back(Request{ TRACE_OP_READ, TRACE_SRC_REMOTE, e.sector + pos, n });
+            pos += n;
+            if (rnd() % 200 == 0) pos = rnd() % len;        /* Seek */
+        }
+    }
+}
+
+
+static std::vector<std::string> split (const char* s)
+{
+    std::vector<std::string> out;
+    std::string cur;
+
+    for (; *s; s++) {
+        if (*s == ',') { out.push_back(cur); cur.clear(); }
+        else cur += *s;
+    }
+    out.push_back(cur);
+    return out;
+}
+
+
+static void usage (const char* prog)
+{
+    fprintf(stderr,
+            "usage: %s (--trace FILE | --synth FILES [--tracks N])\n"
+            "          [--policy lru,arc,clock] [--cache SECTORS,...] [--readahead SECTORS,...]\n"
+            "          [--cache-local] [--sd-us BASE,PER_SECTOR] [--net-us RTT,PER_SECTOR,JITTER] [--hit-us US]\n", prog);
+}
+
+
+int main (int argc, char** argv)
+{
+    const char* trace = NULL;
+    unsigned synthFiles = 0, tracks = 200;
+    std::vector<std::string> policies = split("lru,arc,clock");
+    std::vector<std::string> caches = split("512,2048,8192");
+    std::vector<std::string> readaheads = split("0,16,64,256");
+    Model m;
+    std::vector<Request> reqs;
+    std::vector<Range> ranges;
+    int i, n = 0;
+
+    for (i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(a, "--cache-local")) { m.cache_local = true; continue; }
+        if (!v) { usage(argv[0]); return 2; }
+        if (!strcmp(a, "--trace")) trace = v;
+        else if (!strcmp(a, "--synth")) synthFiles = atoi(v);
+        else if (!strcmp(a, "--tracks")) tracks = atoi(v);
+        else if (!strcmp(a, "--policy")) policies = split(v);
+        else if (!strcmp(a, "--cache")) caches = split(v);
+        else if (!strcmp(a, "--readahead")) readaheads = split(v);
+        else if (!strcmp(a, "--sd-us")) sscanf(v, "%lf,%lf", &m.sd_base_us, &m.sd_sector_us);
+        else if (!strcmp(a, "--net-us")) sscanf(v, "%lf,%lf,%lf", &m.net_rtt_us, &m.net_sector_us, &m.net_jitter_us);
+        else if (!strcmp(a, "--hit-us")) m.hit_us = atof(v);
+        else { usage(argv[0]); return 2; }
+        i++;
+    }
+    for (const std::string& p : policies) {
+        Cache* c = make_cache(p, 1);
+        if (!c) { usage(argv[0]); return 2; }
+        delete c;
+    }
+
+    if (trace) {
+        if (!load_trace(trace, reqs)) {
+            fprintf(stderr, "cannot read trace %s\n", trace);
+            return 1;
+        }
+    } else if (synthFiles) {
+        synth(synthFiles, tracks, reqs, ranges);
+    } else {
+        usage(argv[0]);
+        return 2;
+    }
+
+    printf("{\n  \"config\": {\"input\": \"%s\", \"requests\": %zu, \"ranges\": %zu, \"cache_local\": %d,\n"
+           "             \"sd_us\": [%.0f, %.0f], \"net_us\": [%.0f, %.0f, %.0f], \"hit_us\": %.0f},\n"
+           "  \"results\": [\n", trace ? trace : "synth", reqs.size(), ranges.size(), m.cache_local,
+           m.sd_base_us, m.sd_sector_us, m.net_rtt_us, m.net_sector_us, m.net_jitter_us, m.hit_us);
+    for (const std::string& p : policies) {
+        for (const std::string& c : caches) {
+            for (const std::string& ra : readaheads) {
+                Result r = replay(reqs, ranges, m, p, (size_t)atol(c.c_str()), (uint32_t)atol(ra.c_str()));
+                double total = 0;
+                for (double l : r.latency) total += l;
+                std::sort(r.latency.begin(), r.latency.end());
+                printf("%s    {\"policy\": \"%s\", \"cache_sectors\": %s, \"readahead\": %s,\n"
+                       "     \"request_hit_rate\": %.4f, \"sector_hit_rate\": %.4f,\n"
+                       "     \"net_requests\": %llu, \"net_bytes\": %llu, \"sd_requests\": %llu, \"sd_bytes\": %llu,\n"
+                       "     \"prefetched\": %llu, \"prefetch_used\": %llu, \"prefetch_wasted\": %llu,\n"
+                       "     \"latency_us\": {\"mean\": %.0f, \"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f, \"total\": %.0f}}",
+                       n++ ? ",\n" : "", p.c_str(), c.c_str(), ra.c_str(),
+                       r.requests ? (double)r.hits / r.requests : 0.0,
+                       r.sector_hits + r.sector_misses ? (double)r.sector_hits / (r.sector_hits + r.sector_misses) : 0.0,
+                       (unsigned long long)r.net_requests, (unsigned long long)r.net_sectors * 512,
+                       (unsigned long long)r.sd_requests, (unsigned long long)r.sd_sectors * 512,
+                       (unsigned long long)r.prefetched, (unsigned long long)r.prefetch_used,
+                       (unsigned long long)r.prefetch_wasted,
+                       r.latency.empty() ? 0.0 : total / r.latency.size(), pct(r.latency, 50), pct(r.latency, 90),
+                       pct(r.latency, 99), r.latency.empty() ? 0.0 : r.latency.back(), total);
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
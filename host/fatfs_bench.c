@@ -0,0 +1,324 @@
+/*-----------------------------------------------------------------------*/
+/* FatFs workload benchmark on the host                                  */
+/*-----------------------------------------------------------------------*/
+/* Runs the device workloads (format, catalog build, directory listing,
+/  random reads) against host/ram_diskio.c and prints one JSON document
+/  with the disk I/O of every phase. With --threads the random reads run
+/  from several threads at once through the reentrant FatFs locks. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "io_stats.h"
+
+typedef struct {
+    const char* image;      /* NULL: RAM disk */
+    unsigned size_mb;
+    unsigned files;
+    unsigned reads;
+    unsigned read_size;
+    unsigned mkfs_buf;
+    unsigned seed;
+    int fastseek;
+    int mkfs_only;
+    unsigned threads;
+} bench_cfg_t;
+
+typedef struct {
+    const bench_cfg_t* cfg;
+    FIL* files;
+    unsigned first;         /* Reader t uses files first, first + threads, ... */
+    unsigned reads;
+    uint32_t seed;
+    FRESULT res;
+} reader_t;
+
+static FATFS fs;
+static int n_phases;
+
+
+static uint64_t now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static uint32_t rnd (void)
+{
+    static uint32_t x = 2463534242u;
+
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+
+
+static void file_name (char* buf, size_t len, unsigned i)
+{
+    snprintf(buf, len, "Artist %u - Some long track title number %u.flac", i % 37, i);
+}
+
+
+static FSIZE_t file_size (unsigned i)
+{
+    return 3000000 + (FSIZE_t)((i * 2654435761u) % 9000000);   /* 3..12 MB, stable per index */
+}
+
+
+static void phase_begin (uint64_t* t0)
+{
+    io_stats_reset();
+    *t0 = now_us();
+}
+
+
+static void phase_end (const char* name, uint64_t t0, unsigned ops, int res)
+{
+    io_stats_t st;
+    uint64_t us = now_us() - t0;
+
+    io_stats_get(&st);
+    printf("%s    {\"phase\": \"%s\", \"result\": %d, \"ops\": %u, \"wall_us\": %llu,\n"
+           "     \"read_calls\": %llu, \"read_sectors\": %llu, \"bytes_read\": %llu,\n"
+           "     \"write_calls\": %llu, \"write_sectors\": %llu, \"bytes_written\": %llu,\n"
+           "     \"ioctl_calls\": %llu, \"sync_calls\": %llu, \"trim_calls\": %llu, \"trim_sectors\": %llu}",
+           n_phases++ ? ",\n" : "", name, res, ops, (unsigned long long)us,
+           (unsigned long long)st.read_calls, (unsigned long long)st.read_sectors,
+           (unsigned long long)st.read_sectors * 512,
+           (unsigned long long)st.write_calls, (unsigned long long)st.write_sectors,
+           (unsigned long long)st.write_sectors * 512,
+           (unsigned long long)st.ioctl_calls, (unsigned long long)st.sync_calls,
+           (unsigned long long)st.trim_calls, (unsigned long long)st.trim_sectors);
+}
+
+
+static int run_mkfs (const bench_cfg_t* cfg)
+{
+    MKFS_PARM opt = { FM_FAT32, 0, 0, 0, 0 };
+    uint64_t t0;
+    void* work = malloc(cfg->mkfs_buf);
+    FRESULT res;
+
+    if (!work) return FR_NOT_ENOUGH_CORE;
+    phase_begin(&t0);
+    res = f_mkfs("", &opt, work, cfg->mkfs_buf);
+    phase_end("mkfs", t0, 1, res);
+    free(work);
+    return res;
+}
+
+
+static int run_create (const bench_cfg_t* cfg)
+{
+    char name[128];
+    uint64_t t0;
+    unsigned i;
+    FRESULT res = FR_OK;
+    FIL f;
+
+    phase_begin(&t0);
+    for (i = 0; i < cfg->files && res == FR_OK; i++) {
+        file_name(name, sizeof name, i);
+        res = f_open(&f, name, FA_CREATE_ALWAYS | FA_WRITE);
+        if (res != FR_OK) break;
+        res = f_expand(&f, file_size(i), 1);
+        f_close(&f);
+    }
+    phase_end("create_expanded", t0, i, res);
+    return res;
+}
+
+
+/* Remount with the FSInfo free count wiped, the way a PC that does not keep
+/  FSInfo up to date leaves it. With the hint table the count survives the
+/  remount; after ff_hint_clear() FatFs has to scan the whole FAT. */
+static int run_remount_getfree (void)
+{
+    BYTE sec[512];
+    DWORD nfree, n;
+    FATFS* pfs;
+    LBA_t fsi;
+    uint64_t t0;
+    int pass;
+    FRESULT res;
+
+    res = f_getfree("", &nfree, &pfs);
+    fsi = fs.volbase + 1;
+    for (pass = 0; pass < 2 && res == FR_OK; pass++) {
+        f_mount(0, "", 0);
+        if (disk_read(0, sec, fsi, 1) != RES_OK) return FR_DISK_ERR;
+        memset(sec + 488, 0xFF, 4);     /* FSI_Free_Count: unknown */
+        if (disk_write(0, sec, fsi, 1) != RES_OK) return FR_DISK_ERR;
+        if (pass == 1) ff_hint_clear(0);
+
+        phase_begin(&t0);
+        res = f_mount(&fs, "", 1);
+        if (res == FR_OK) res = f_getfree("", &n, &pfs);
+        if (res == FR_OK && n != nfree) res = FR_INT_ERR;
+        phase_end(pass ? "remount_getfree_scan" : "remount_getfree_hint", t0, 1, res);
+    }
+    return res;
+}
+
+
+static int run_enumerate (void)
+{
+    DIR dir;
+    FILINFO fno;
+    uint64_t t0;
+    unsigned n = 0;
+    FRESULT res;
+
+    phase_begin(&t0);
+    res = f_opendir(&dir, "/");
+    while (res == FR_OK) {
+        res = f_readdir(&dir, &fno);
+        if (res != FR_OK || fno.fname[0] == 0) break;
+        n++;
+    }
+    f_closedir(&dir);
+    phase_end("enumerate", t0, n, res);
+    return res;
+}
+
+
+/* Each reader owns its FIL objects; only the volume is shared */
+static void* reader (void* arg)
+{
+    reader_t* r = arg;
+    const bench_cfg_t* cfg = r->cfg;
+    unsigned per = (cfg->files - r->first + cfg->threads - 1) / cfg->threads;
+    BYTE* buf = malloc(cfg->read_size);
+    uint32_t x = r->seed;
+    unsigned i;
+    UINT br;
+
+    r->res = buf ? FR_OK : FR_NOT_ENOUGH_CORE;
+    for (i = 0; i < r->reads && r->res == FR_OK; i++) {
+        unsigned idx;
+        FSIZE_t ofs;
+
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        idx = r->first + (x % per) * cfg->threads;
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        ofs = x % (file_size(idx) - cfg->read_size);
+        r->res = f_lseek(&r->files[idx], ofs);
+        if (r->res == FR_OK) r->res = f_read(&r->files[idx], buf, cfg->read_size, &br);
+    }
+    r->reads = i;
+    free(buf);
+    return NULL;
+}
+
+
+static int run_random_reads (const bench_cfg_t* cfg)
+{
+    char name[128];
+    FIL* files = calloc(cfg->files, sizeof (FIL));
+    DWORD* clmt = calloc(cfg->files, 4 * sizeof (DWORD));
+    reader_t* readers = calloc(cfg->threads, sizeof (reader_t));
+    pthread_t* tids = calloc(cfg->threads, sizeof (pthread_t));
+    uint64_t t0;
+    unsigned i, n = 0;
+    FRESULT res = FR_OK;
+
+    if (!files || !clmt || !readers || !tids) return FR_NOT_ENOUGH_CORE;
+    for (i = 0; i < cfg->files && res == FR_OK; i++) {    /* Open everything up front, the directory scan is not measured here */
+        file_name(name, sizeof name, i);
+        res = f_open(&files[i], name, FA_READ);
+        if (res == FR_OK && cfg->fastseek) {
+            files[i].cltbl = clmt + i * 4;
+            files[i].cltbl[0] = 4;
+            res = f_lseek(&files[i], CREATE_LINKMAP);
+        }
+    }
+
+    phase_begin(&t0);
+    for (i = 0; i < cfg->threads && res == FR_OK; i++) {
+        readers[i].cfg = cfg;
+        readers[i].files = files;
+        readers[i].first = i;
+        readers[i].reads = cfg->reads / cfg->threads + (i < cfg->reads % cfg->threads);
+        readers[i].seed = rnd();
+        if (pthread_create(&tids[i], NULL, reader, &readers[i]) != 0) break;
+    }
+    while (i--) {
+        pthread_join(tids[i], NULL);
+        n += readers[i].reads;
+        if (readers[i].res != FR_OK) res = readers[i].res;
+    }
+    phase_end(cfg->fastseek ? "random_read_fastseek" : "random_read", t0, n, res);
+
+    for (i = 0; i < cfg->files; i++) f_close(&files[i]);
+    free(tids); free(readers); free(clmt); free(files);
+    return res;
+}
+
+
+static void usage (const char* prog)
+{
+    fprintf(stderr,
+            "usage: %s [--image FILE] [--size-mb N] [--files N] [--reads N]\n"
+            "          [--read-size BYTES] [--mkfs-buf BYTES] [--mkfs-only] [--fastseek]\n"
+            "          [--threads N]\n", prog);
+}
+
+
+int main (int argc, char** argv)
+{
+    bench_cfg_t cfg = { NULL, 8192, 500, 2000, 4096, 4096, 1, 0, 0, 1 };
+    uint64_t t0;
+    int i, res;
+
+    for (i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(a, "--fastseek")) { cfg.fastseek = 1; continue; }
+        if (!strcmp(a, "--mkfs-only")) { cfg.mkfs_only = 1; continue; }
+        if (!v) { usage(argv[0]); return 2; }
+        if (!strcmp(a, "--image")) cfg.image = v;
+        else if (!strcmp(a, "--size-mb")) cfg.size_mb = atoi(v);
+        else if (!strcmp(a, "--files")) cfg.files = atoi(v);
+        else if (!strcmp(a, "--reads")) cfg.reads = atoi(v);
+        else if (!strcmp(a, "--read-size")) cfg.read_size = atoi(v);
+        else if (!strcmp(a, "--mkfs-buf")) cfg.mkfs_buf = atoi(v);
+        else if (!strcmp(a, "--threads")) cfg.threads = atoi(v);
+        else { usage(argv[0]); return 2; }
+        i++;
+    }
+    if (cfg.files == 0 || cfg.read_size == 0 || cfg.mkfs_buf < 512 || cfg.threads == 0 || cfg.threads > cfg.files) { usage(argv[0]); return 2; }
+
+    if (hostdisk_open(cfg.image, (LBA_t)cfg.size_mb * 2048) != 0) {
+        fprintf(stderr, "cannot open disk\n");
+        return 1;
+    }
+
+    printf("{\n  \"config\": {\"image\": \"%s\", \"size_mb\": %u, \"files\": %u, \"reads\": %u, "
+           "\"read_size\": %u, \"mkfs_buf\": %u, \"fastseek\": %d, \"threads\": %u, \"win_fat_slots\": %d, \"win_dir_slots\": %d},\n"
+           "  \"phases\": [\n",
+           cfg.image ? cfg.image : "ram", cfg.size_mb, cfg.files, cfg.reads, cfg.read_size,
+           cfg.mkfs_buf, cfg.fastseek, cfg.threads, FF_WIN_FAT_SLOTS, FF_WIN_DIR_SLOTS);
+
+    res = run_mkfs(&cfg);
+    if (res == FR_OK && !cfg.mkfs_only) {
+        phase_begin(&t0);
+        res = f_mount(&fs, "", 1);
+        phase_end("mount", t0, 1, res);
+    }
+    if (res == FR_OK && !cfg.mkfs_only) res = run_create(&cfg);
+    if (res == FR_OK && !cfg.mkfs_only) res = run_remount_getfree();
+    if (res == FR_OK && !cfg.mkfs_only) res = run_enumerate();
+    if (res == FR_OK && !cfg.mkfs_only) res = run_random_reads(&cfg);
+
+    f_mount(0, "", 0);
+    printf("\n  ]\n}\n");
+    hostdisk_close();
+    return res == FR_OK ? 0 : 1;
+}
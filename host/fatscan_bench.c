@@ -0,0 +1,126 @@
+/*-----------------------------------------------------------------------*/
+/* FAT32 scanning kernel microbenchmark                                  */
+/*-----------------------------------------------------------------------*/
+/* Runs every kernel variant (scalar, word, SSE2) over whole 512-byte FAT
+/  sectors filled with typical patterns, checks the results against the
+/  scalar code and prints ns per sector as JSON. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ff.h"
+#include "ff_fatscan.h"
+
+#define ENTRIES		128			/* FAT32 entries per 512-byte sector */
+#define SECTORS		4096		/* 2 MiB of FAT, well past L1 like a real scan */
+
+typedef UINT (*scan_fn)(const BYTE* p, UINT n);
+typedef UINT (*chain_fn)(const BYTE* p, UINT n, DWORD next);
+
+typedef struct {
+    const char* name;
+    scan_fn count_free, first_free, free_run;
+    chain_fn chain_run;
+} variant_t;
+
+static const variant_t variants[] = {
+    { "scalar", ff_fat32_count_free_scalar, ff_fat32_first_free_scalar, ff_fat32_free_run_scalar, ff_fat32_chain_run_scalar },
+#if FF_FATSCAN_WORD
+    { "word", ff_fat32_count_free_word, ff_fat32_first_free_word, ff_fat32_free_run_word, ff_fat32_chain_run_word },
+#endif
+#if FF_FATSCAN_SSE2
+    { "sse2", ff_fat32_count_free_sse2, ff_fat32_first_free_sse2, ff_fat32_free_run_sse2, ff_fat32_chain_run_sse2 },
+#endif
+};
+
+static DWORD fat[SECTORS * ENTRIES];
+static int n_results;
+
+
+static uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint32_t rnd (void)
+{
+    static uint32_t x = 2463534242u;
+
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+
+
+/* free: empty FAT; chain: one long contiguous file; mixed: half the
+/  clusters in use at random; frag: runs of 8 linked clusters, then a jump */
+static void fill (const char* pattern)
+{
+    DWORD i;
+
+    for (i = 0; i < SECTORS * ENTRIES; i++) {
+        DWORD v = 0;
+        if (!strcmp(pattern, "chain")) v = i + 1;
+        else if (!strcmp(pattern, "mixed")) v = (rnd() & 1) ? 0x0FFFFFFF : 0;
+        else if (!strcmp(pattern, "frag")) v = (i % 8 == 7) ? i + 100 : i + 1;
+        fat[i] = v | (rnd() & 0xF0000000);	/* Reserved bits must be ignored */
+    }
+}
+
+
+/* Runs one kernel over every sector; returns a checksum of the results */
+static uint64_t run (const variant_t* v, unsigned kernel, unsigned reps, uint64_t* ns)
+{
+    scan_fn fn = (kernel == 0) ? v->count_free : (kernel == 1) ? v->first_free : v->free_run;
+    uint64_t sum = 0, t0 = now_ns();
+    unsigned r, s;
+
+    for (r = 0; r < reps; r++) {
+        if (kernel == 3) {
+            for (s = 0; s < SECTORS; s++) {
+                sum = sum * 31 + v->chain_run((const BYTE*)(fat + s * ENTRIES), ENTRIES, s * ENTRIES + 1);
+            }
+        } else {
+            for (s = 0; s < SECTORS; s++) {
+                sum = sum * 31 + fn((const BYTE*)(fat + s * ENTRIES), ENTRIES);
+            }
+        }
+    }
+    *ns = now_ns() - t0;
+    return sum;
+}
+
+
+int main (int argc, char** argv)
+{
+    static const char* patterns[] = { "free", "chain", "mixed", "frag" };
+    static const char* kernels[] = { "count_free", "first_free", "free_run", "chain_run" };	/* Order as in run() */
+    unsigned reps = (argc > 1) ? (unsigned)atoi(argv[1]) : 50;
+    unsigned p, k, v;
+    int bad = 0;
+
+    printf("{\n  \"config\": {\"sectors\": %u, \"reps\": %u},\n  \"results\": [\n", SECTORS, reps);
+    for (p = 0; p < sizeof patterns / sizeof patterns[0]; p++) {
+        fill(patterns[p]);
+        for (k = 0; k < sizeof kernels / sizeof kernels[0]; k++) {
+            uint64_t ref = 0, ref_ns = 0;
+            for (v = 0; v < sizeof variants / sizeof variants[0]; v++) {
+                uint64_t ns, sum = run(&variants[v], k, reps, &ns);
+                if (v == 0) { ref = sum; ref_ns = ns; }
+                if (sum != ref) bad = 1;
+                printf("%s    {\"pattern\": \"%s\", \"kernel\": \"%s\", \"variant\": \"%s\", "
+                       "\"ns_per_sector\": %.2f, \"speedup\": %.2f, \"match\": %s}",
+                       n_results++ ? ",\n" : "", patterns[p], kernels[k], variants[v].name,
+                       (double)ns / ((double)reps * SECTORS), (double)ref_ns / (double)ns,
+                       sum == ref ? "true" : "false");
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return bad;
+}
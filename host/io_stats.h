@@ -0,0 +1,40 @@
+/*-----------------------------------------------------------------------*/
+/* I/O counters of the host-side disk (host/ram_diskio.c)                */
+/*-----------------------------------------------------------------------*/
+
+#ifndef _IO_STATS_H_
+#define _IO_STATS_H_
+
+#include <stdint.h>
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint64_t read_calls;	/* disk_read() calls */
+    uint64_t read_sectors;	/* Sectors transferred by disk_read() */
+    uint64_t write_calls;	/* disk_write() calls */
+    uint64_t write_sectors;	/* Sectors transferred by disk_write() */
+    uint64_t ioctl_calls;	/* disk_ioctl() calls */
+    uint64_t trim_calls;	/* CTRL_TRIM requests */
+    uint64_t trim_sectors;	/* Sectors covered by CTRL_TRIM */
+    uint64_t sync_calls;	/* CTRL_SYNC requests */
+} io_stats_t;
+
+/* Backing store: a RAM buffer when path is NULL, otherwise a file that is
+/  created or resized to sectors * 512 bytes. */
+int hostdisk_open (const char* path, LBA_t sectors);
+void hostdisk_close (void);
+LBA_t hostdisk_sectors (void);
+
+/* Counters since the last reset */
+void io_stats_get (io_stats_t* st);
+void io_stats_reset (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IO_STATS_H_ */
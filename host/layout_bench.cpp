@@ -0,0 +1,213 @@
+/*-----------------------------------------------------------------------*/
+/* Prebuilt FAT32 layout benchmark on the host                           */
+/*-----------------------------------------------------------------------*/
+/* Builds the catalog volume with FatLayout (no FatFs calls), then mounts
+/  it with FatFs and checks every directory entry and cluster chain
+/  against the plan. Prints one JSON document like fatfs_bench. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+#include "ff.h"
+#include "diskio.h"
+#include "io_stats.h"
+#include "FatLayout.h"
+
+static FATFS fs;
+static int n_phases;
+
+
+/* FatLayout writes through the same disk the FatFs build uses */
+class HostBlockDevice : public BlockDevice
+{
+public:
+    bool read(uint8_t* buffer, uint32_t sector) override { return readSectors(buffer, sector, 1); }
+    bool write(const uint8_t* buffer, uint32_t sector) override { return writeSectors(buffer, sector, 1); }
+    bool readSectors(uint8_t* buffer, uint32_t sector, uint32_t count) override
+    {
+        return disk_read(0, buffer, sector, count) == RES_OK;
+    }
+    bool writeSectors(const uint8_t* buffer, uint32_t sector, uint32_t count) override
+    {
+        return disk_write(0, (BYTE*)buffer, sector, count) == RES_OK;
+    }
+    bool sync() override { return disk_ioctl(0, CTRL_SYNC, NULL) == RES_OK; }
+    bool trim(uint32_t start, uint32_t end) override
+    {
+        LBA_t range[2] = { start, end };
+        return disk_ioctl(0, CTRL_TRIM, range) == RES_OK;
+    }
+    sdcard_type_t type() override { return CARD_SDHC; }
+    uint32_t sectorCount() override { return (uint32_t)hostdisk_sectors(); }
+    uint32_t sectorSize() override { return 512; }
+};
+
+
+static uint64_t now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Mostly ASCII like fatfs_bench, with some names that need UTF-16 LFNs
+/  and short-name mangling. */
+static std::string file_name (unsigned i)
+{
+    char buf[160];
+
+    if (i % 7 == 3) {
+        snprintf(buf, sizeof buf, "Zo\xC3\xAB \xE2\x80\x93 \xE6\x9B\xB2 %u \xF0\x9F\x8E\xB5.flac", i);
+    } else if (i % 11 == 5) {
+        snprintf(buf, sizeof buf, "a.b+c;d [%u] ~1 .mp3", i);
+    } else {
+        snprintf(buf, sizeof buf, "Artist %u - Some long track title number %u.flac", i % 37, i);
+    }
+    return buf;
+}
+
+
+static uint64_t file_size (unsigned i)
+{
+    return (i % 97 == 0) ? 0 : 3000000 + (uint64_t)((i * 2654435761u) % 9000000);
+}
+
+
+static void phase_begin (uint64_t* t0)
+{
+    io_stats_reset();
+    *t0 = now_us();
+}
+
+
+static void phase_end (const char* name, uint64_t t0, unsigned ops, int res)
+{
+    io_stats_t st;
+    uint64_t us = now_us() - t0;
+
+    io_stats_get(&st);
+    printf("%s    {\"phase\": \"%s\", \"result\": %d, \"ops\": %u, \"wall_us\": %llu,\n"
+           "     \"read_calls\": %llu, \"read_sectors\": %llu,\n"
+           "     \"write_calls\": %llu, \"write_sectors\": %llu, \"bytes_written\": %llu}",
+           n_phases++ ? ",\n" : "", name, res, ops, (unsigned long long)us,
+           (unsigned long long)st.read_calls, (unsigned long long)st.read_sectors,
+           (unsigned long long)st.write_calls, (unsigned long long)st.write_sectors,
+           (unsigned long long)st.write_sectors * 512);
+}
+
+
+/* Every listed entry must come back from f_readdir in order with its size,
+/  and f_open must land on the planned first cluster. Returns the number of
+/  mismatches. */
+static unsigned verify (const FatLayout& layout, unsigned* checked)
+{
+    DIR dir;
+    FILINFO fno;
+    FIL f;
+    unsigned bad = 0, n = 0;
+    size_t i = 0;
+
+    if (f_opendir(&dir, "/") != FR_OK) return 1;
+    for (;;) {
+        if (f_readdir(&dir, &fno) != FR_OK) { bad++; break; }
+        if (fno.fname[0] == 0) break;
+        while (i < layout.count() && !layout.entry(i).lfnCount) i++;
+        if (i == layout.count()) { bad++; break; }
+        const FatLayout::Entry& e = layout.entry(i++);
+        n++;
+        if (e.name != fno.fname || e.size != fno.fsize) {
+            fprintf(stderr, "entry %u: '%s' %llu vs '%s' %llu\n", n, e.name.c_str(),
+                    (unsigned long long)e.size, fno.fname, (unsigned long long)fno.fsize);
+            bad++;
+            continue;
+        }
+        if (f_open(&f, fno.fname, FA_READ) != FR_OK) { bad++; continue; }
+        if (f.obj.sclust != e.cluster) bad++;
+        if (e.clusters) {   /* Walking to the last byte follows the whole chain */
+            if (f_lseek(&f, e.size - 1) != FR_OK || f.clust != e.cluster + e.clusters - 1) bad++;
+        }
+        f_close(&f);
+    }
+    f_closedir(&dir);
+    while (i < layout.count() && !layout.entry(i).lfnCount) i++;
+    if (i != layout.count()) bad++;
+    *checked = n;
+    return bad;
+}
+
+
+static void usage (const char* prog)
+{
+    fprintf(stderr, "usage: %s [--image PATH] [--size-mb N] [--files N] [--work BYTES]\n", prog);
+}
+
+
+int main (int argc, char** argv)
+{
+    const char* image = NULL;
+    unsigned size_mb = 65536, files = 5000, work_size = 65536;
+    HostBlockDevice device;
+    FatLayout layout;
+    uint64_t t0;
+    unsigned i, checked = 0, bad;
+    int res;
+
+    for (i = 1; i < (unsigned)argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < (unsigned)argc) ? argv[i + 1] : NULL;
+        if (!v) { usage(argv[0]); return 2; }
+        if (!strcmp(a, "--image")) image = v;
+        else if (!strcmp(a, "--size-mb")) size_mb = atoi(v);
+        else if (!strcmp(a, "--files")) files = atoi(v);
+        else if (!strcmp(a, "--work")) work_size = atoi(v);
+        else { usage(argv[0]); return 2; }
+        i++;
+    }
+    if (work_size < 512) { usage(argv[0]); return 2; }
+
+    if (hostdisk_open(image, (LBA_t)size_mb * 2048) != 0) {
+        fprintf(stderr, "cannot open disk\n");
+        return 1;
+    }
+    uint8_t* work = (uint8_t*)malloc(work_size);
+
+    printf("{\n  \"config\": {\"image\": \"%s\", \"size_mb\": %u, \"files\": %u, \"work\": %u},\n"
+           "  \"phases\": [\n", image ? image : "ram", size_mb, files, work_size);
+
+    phase_begin(&t0);
+    for (i = 0; i < files; i++) layout.add(file_name(i), file_size(i));
+    res = layout.plan(device.sectorCount()) ? 0 : 1;
+    phase_end("layout_plan", t0, files, res);
+
+    if (res == 0) {
+        phase_begin(&t0);
+        res = layout.write(&device, work, work_size) ? 0 : 1;
+        phase_end("layout_write", t0, files, res);
+    }
+    if (res == 0) {
+        phase_begin(&t0);
+        res = f_mount(&fs, "", 1);
+        phase_end("mount", t0, 1, res);
+    }
+    if (res == 0) {
+        phase_begin(&t0);
+        bad = verify(layout, &checked);
+        res = bad ? 1 : 0;
+        phase_end("verify", t0, checked, res);
+    }
+
+    printf("\n  ],\n  \"layout\": {\"partition_start\": %u, \"cluster_sectors\": %u, \"data_start\": %u, "
+           "\"clusters\": %u, \"free_clusters\": %u}\n}\n",
+           (unsigned)layout.partitionStart(), (unsigned)layout.sectorsPerCluster(),
+           (unsigned)layout.dataStart(), (unsigned)layout.clusterCount(), (unsigned)layout.freeClusters());
+
+    f_mount(0, "", 0);
+    free(work);
+    hostdisk_close();
+    return res;
+}
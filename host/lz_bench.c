@@ -0,0 +1,180 @@
+/*-----------------------------------------------------------------------*/
+/* Remote extent compression benchmark                                   */
+/*-----------------------------------------------------------------------*/
+/* Cuts each corpus into stripe-sized blocks as the server does, packs
+/  them with lz_compress() (raw when LZ_CAP is not met) and times
+/  lz_decode() both on whole blocks and fed in TCP-segment-sized pieces,
+/  which is how the device sees them. Built-in corpora stand in for the
+/  catalog's content; files named on the command line are added. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "lz_stream.h"
+
+#define BLOCK       8192        /* REMOTE_STRIPE_SECTORS * 512 */
+#define SEGMENT     1460        /* Bytes per TCP segment on Ethernet/Wi-Fi */
+
+
+static double now_s (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+static uint32_t rnd (uint32_t* s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+
+/* Playlists, cue sheets and tags: words from a small vocabulary */
+static void make_text (uint8_t* p, size_t n)
+{
+    static const char* const words[] = {
+        "Track", "Artist", "Album", "/music/", ".flac", ".mp3", "TITLE=", "ARTIST=", "01", "02",
+        "the", "of", "and", "Live", "Remastered", "#EXTINF:", "INDEX 01 00:00:00", "PERFORMER", "\n", " "
+    };
+    uint32_t s = 1;
+    size_t i = 0;
+
+    while (i < n) {
+        const char* w = words[rnd(&s) % 20];
+        size_t l = strlen(w);
+        if (l > n - i) l = n - i;
+        memcpy(p + i, w, l);
+        i += l;
+    }
+}
+
+
+/* 16-bit stereo PCM: a tone with a little noise, and one second in eight silent */
+static void make_wav (uint8_t* p, size_t n)
+{
+    uint32_t s = 7;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        size_t frame = i / 4;
+        int16_t v = 0;
+        if ((frame / 44100) % 8) v = (int16_t)(8000 * sin(frame * 0.0627) + (int)(rnd(&s) % 64) - 32);
+        memcpy(p + i, &v, 2);
+        memcpy(p + i + 2, &v, 2);
+    }
+}
+
+
+/* FLAC metadata: a long PADDING block and an embedded cover thumbnail */
+static void make_flac_meta (uint8_t* p, size_t n)
+{
+    uint32_t s = 3;
+    size_t i;
+
+    memset(p, 0, n);
+    for (i = n / 2; i < n; i++) p[i] = (uint8_t)(rnd(&s) & 0x0F ? p[i - 3] : rnd(&s));
+}
+
+
+/* Already compressed audio */
+static void make_random (uint8_t* p, size_t n)
+{
+    uint32_t s = 11;
+    size_t i;
+
+    for (i = 0; i < n; i++) p[i] = (uint8_t)rnd(&s);
+}
+
+
+static void run (const char* name, const uint8_t* data, size_t n)
+{
+    size_t blocks = n / BLOCK, b, wire = 0, packed = 0;
+    uint8_t* comp = malloc(blocks * BLOCK);
+    uint32_t* clen = malloc(blocks * sizeof *clen);
+    uint8_t* out = malloc(BLOCK);
+    double t, t_comp, t_dec, t_seg;
+    int bad = 0;
+
+    t = now_s();
+    for (b = 0; b < blocks; b++) {
+        clen[b] = lz_compress(data + b * BLOCK, BLOCK, comp + b * BLOCK, LZ_CAP(BLOCK));
+        wire += clen[b] ? clen[b] : BLOCK;
+        packed += clen[b] != 0;
+    }
+    t_comp = now_s() - t;
+
+    t = now_s();
+    for (b = 0; b < blocks; b++) {
+        lz_decoder_t d;
+        if (!clen[b]) continue;
+        lz_decode_init(&d, out, BLOCK);
+        if (lz_decode(&d, comp + b * BLOCK, clen[b]) || !lz_decode_done(&d)) bad++;
+    }
+    t_dec = now_s() - t;
+
+    t = now_s();
+    for (b = 0; b < blocks; b++) {
+        lz_decoder_t d;
+        uint32_t off;
+        if (!clen[b]) continue;
+        lz_decode_init(&d, out, BLOCK);
+        for (off = 0; off < clen[b]; off += SEGMENT) {
+            lz_decode(&d, comp + b * BLOCK + off, clen[b] - off < SEGMENT ? clen[b] - off : SEGMENT);
+        }
+        if (!lz_decode_done(&d) || memcmp(out, data + b * BLOCK, BLOCK)) bad++;
+    }
+    t_seg = now_s() - t;
+
+    printf("  {\"corpus\": \"%s\", \"mb\": %.1f, \"blocks_packed\": %.3f, \"wire_ratio\": %.3f, "
+           "\"compress_mb_s\": %.0f, \"decode_mb_s\": %.0f, \"decode_segmented_mb_s\": %.0f, \"bad\": %d}",
+           name, n / 1048576.0, blocks ? (double)packed / blocks : 0.0, n ? (double)wire / (blocks * BLOCK) : 0.0,
+           blocks * BLOCK / 1048576.0 / t_comp,
+           packed ? packed * BLOCK / 1048576.0 / t_dec : 0.0, packed ? packed * BLOCK / 1048576.0 / t_seg : 0.0, bad);
+    free(out);
+    free(clen);
+    free(comp);
+}
+
+
+int main (int argc, char** argv)
+{
+    static const struct {
+        const char* name;
+        void (*make) (uint8_t*, size_t);
+    } corpora[] = {
+        { "text", make_text }, { "wav", make_wav }, { "flac_meta", make_flac_meta }, { "random", make_random }
+    };
+    size_t n = 16 << 20;
+    uint8_t* buf = malloc(n);
+    unsigned i;
+    int a;
+
+    printf("[\n");
+    for (i = 0; i < sizeof corpora / sizeof corpora[0]; i++) {
+        corpora[i].make(buf, n);
+        if (i) printf(",\n");
+        run(corpora[i].name, buf, n);
+    }
+    for (a = 1; a < argc; a++) {
+        FILE* f = fopen(argv[a], "rb");
+        size_t len;
+        if (!f) continue;
+        len = fread(buf, 1, n, f);
+        fclose(f);
+        printf(",\n");
+        run(argv[a], buf, len);
+    }
+    printf("\n]\n");
+    free(buf);
+    return 0;
+}
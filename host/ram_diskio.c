@@ -0,0 +1,141 @@
+/*-----------------------------------------------------------------------*/
+/* Host-side disk I/O for FatFs: RAM or file backed, with I/O counters   */
+/*-----------------------------------------------------------------------*/
+
+#define _FILE_OFFSET_BITS 64
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "io_stats.h"
+
+#define SECTOR_SIZE    512
+
+static BYTE* ram;            /* RAM backing store (NULL when file backed) */
+static int fd = -1;            /* File backing store */
+static LBA_t n_sectors;
+static io_stats_t stats;
+
+
+int hostdisk_open (const char* path, LBA_t sectors)
+{
+    n_sectors = sectors;
+    if (!path) {    /* Zero pages are only committed once written */
+        ram = mmap(NULL, (size_t)sectors * SECTOR_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ram == MAP_FAILED) ram = NULL;
+        return ram ? 0 : -1;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)sectors * SECTOR_SIZE) != 0) {
+        close(fd); fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+void hostdisk_close (void)
+{
+    if (ram) munmap(ram, (size_t)n_sectors * SECTOR_SIZE);
+    ram = NULL;
+    if (fd >= 0) close(fd);
+    fd = -1;
+}
+
+
+LBA_t hostdisk_sectors (void)
+{
+    return n_sectors;
+}
+
+
+void io_stats_get (io_stats_t* st)
+{
+    *st = stats;
+}
+
+
+void io_stats_reset (void)
+{
+    memset(&stats, 0, sizeof stats);
+}
+
+
+DSTATUS disk_initialize (BYTE pdrv)
+{
+    return disk_status(pdrv);
+}
+
+
+DSTATUS disk_status (BYTE pdrv)
+{
+    return (pdrv == 0 && (ram || fd >= 0)) ? 0 : STA_NOINIT;
+}
+
+
+DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+{
+    if (disk_status(pdrv)) return RES_NOTRDY;
+    if (sector + count > n_sectors) return RES_PARERR;
+    stats.read_calls++;
+    stats.read_sectors += count;
+    if (ram) {
+        memcpy(buff, ram + (size_t)sector * SECTOR_SIZE, (size_t)count * SECTOR_SIZE);
+        return RES_OK;
+    }
+    return pread(fd, buff, (size_t)count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) == (ssize_t)count * SECTOR_SIZE ? RES_OK : RES_ERROR;
+}
+
+
+DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+{
+    if (disk_status(pdrv)) return RES_NOTRDY;
+    if (sector + count > n_sectors) return RES_PARERR;
+    stats.write_calls++;
+    stats.write_sectors += count;
+    if (ram) {
+        memcpy(ram + (size_t)sector * SECTOR_SIZE, buff, (size_t)count * SECTOR_SIZE);
+        return RES_OK;
+    }
+    return pwrite(fd, buff, (size_t)count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) == (ssize_t)count * SECTOR_SIZE ? RES_OK : RES_ERROR;
+}
+
+
+DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff)
+{
+    if (disk_status(pdrv)) return RES_NOTRDY;
+    stats.ioctl_calls++;
+    switch (cmd) {
+    case CTRL_SYNC:
+        stats.sync_calls++;
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *(LBA_t*)buff = n_sectors;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD*)buff = SECTOR_SIZE;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD*)buff = 1;
+        return RES_OK;
+    case CTRL_TRIM: {
+        LBA_t* range = (LBA_t*)buff;
+        stats.trim_calls++;
+        stats.trim_sectors += range[1] - range[0] + 1;
+        return RES_OK;
+    }
+    }
+    return RES_PARERR;
+}
+
+
+DWORD get_fattime (void)
+{
+    /* Fixed timestamp so that images are reproducible */
+    return (DWORD)(2024 - 1980) << 25 | (DWORD)1 << 21 | (DWORD)1 << 16;
+}
@@ -0,0 +1,291 @@
+/*-----------------------------------------------------------------------*/
+/* Catalog server                                                        */
+/*-----------------------------------------------------------------------*/
+/* Reference server for the device's remote catalog. Serves the regular
+/  files of a directory (sorted by name, id = position in the listing)
+/  and, with --synth, a generated file in front of them whose content the
+/  test clients can check without a copy.
+/
+/  TCP, one thread per connection:
+/    list /\n                       name \0 size version \n per file, the
+/                                   last line ending in \r\n; version is
+/                                   the modification time
+/    get <id> <sector> <count>\n    count * 512 bytes, zero padded
+/    getz <id> <sector> <count>\n   the same bytes behind a little endian
+/                                   length word; bit 31 set when they
+/                                   are an LZ block (lz_stream.h), clear
+/                                   when packing did not pay off
+/
+/  UDP on the same port: the datagram protocol of udp_fetch.h.
+/
+/  --drop PCT discards that share of outgoing DATA datagrams and
+/  --delay-ms N holds every request back, to try the transports against
+/  loss and latency on loopback. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "udp_fetch.h"
+#include "lz_stream.h"
+
+typedef struct {
+    char* name;
+    char* path;             /* NULL: the synthetic file */
+    uint64_t size;
+    uint32_t version;
+} entry_t;
+
+static entry_t* catalog;
+static uint32_t n_entries;
+static double drop_rate;
+static unsigned delay_ms;
+
+
+/* Word w of sector s of the synthetic file; udp_bench checks against it */
+static uint32_t synth_word (uint32_t s, uint32_t w)
+{
+    return (s << 7 | w) ^ 0xA5A5A5A5;
+}
+
+
+/* One sector of file id, zeros past its end */
+static void read_sector (uint32_t id, uint32_t sector, uint8_t* buf)
+{
+    const entry_t* e;
+    uint64_t pos = (uint64_t)sector * UDP_SECTOR;
+    uint32_t w;
+
+    memset(buf, 0, UDP_SECTOR);
+    if (id >= n_entries || pos >= catalog[id].size) return;
+    e = &catalog[id];
+    if (!e->path) {
+        for (w = 0; w < UDP_SECTOR / 4; w++) ((uint32_t*)buf)[w] = synth_word(sector, w);
+    } else {
+        int fd = open(e->path, O_RDONLY);
+        if (fd >= 0) {
+            if (pread(fd, buf, UDP_SECTOR, (off_t)pos) < 0) memset(buf, 0, UDP_SECTOR);
+            close(fd);
+        }
+    }
+    if (e->size - pos < UDP_SECTOR) memset(buf + (e->size - pos), 0, UDP_SECTOR - (size_t)(e->size - pos));
+}
+
+
+static int write_all (int fd, const void* data, size_t len)
+{
+    const char* p = data;
+
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+static int send_list (int fd)
+{
+    uint32_t i;
+
+    for (i = 0; i < n_entries; i++) {
+        char line[512];
+        int n = snprintf(line, sizeof line, "%s%c%llu %u%s", catalog[i].name, 0,
+                         (unsigned long long)catalog[i].size, catalog[i].version, i + 1 < n_entries ? "\n" : "\r\n");
+        if (write_all(fd, line, (size_t)n)) return -1;
+    }
+    return 0;
+}
+
+
+static int send_packed (int fd, uint32_t id, uint32_t sector, uint32_t count)
+{
+    uint32_t raw_len = count * UDP_SECTOR, len, word, i;
+    uint8_t* raw = malloc(raw_len ? raw_len : 1);
+    uint8_t* packed = malloc(raw_len ? raw_len : 1);
+    uint8_t le[4];
+    int res;
+
+    for (i = 0; i < count; i++) read_sector(id, sector + i, raw + i * UDP_SECTOR);
+    len = lz_compress(raw, raw_len, packed, LZ_CAP(raw_len));
+    word = len ? len | 0x80000000u : raw_len;
+    for (i = 0; i < 4; i++) le[i] = (uint8_t)(word >> (8 * i));
+    res = write_all(fd, le, sizeof le) || write_all(fd, len ? packed : raw, len ? len : raw_len);
+    free(packed);
+    free(raw);
+    return res;
+}
+
+
+static void* tcp_client (void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    FILE* in = fdopen(dup(fd), "r");
+    char line[128];
+    uint8_t buf[UDP_SECTOR];
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    while (in && fgets(line, sizeof line, in)) {
+        unsigned id, sector, count = 1, i;
+
+        if (delay_ms) usleep(delay_ms * 1000);
+        if (!strncmp(line, "list", 4)) {
+            if (send_list(fd)) break;
+        } else if (sscanf(line, "getz %u %u %u", &id, &sector, &count) == 3) {
+            if (send_packed(fd, id, sector, count)) break;
+        } else if (sscanf(line, "get %u %u %u", &id, &sector, &count) >= 2) {
+            for (i = 0; i < count; i++) {
+                read_sector(id, sector + i, buf);
+                if (write_all(fd, buf, sizeof buf)) goto done;
+            }
+        }
+    }
+done:
+    if (in) fclose(in);
+    close(fd);
+    return NULL;
+}
+
+
+static void send_data (int fd, const struct sockaddr_in* to, const udp_header_t* req, uint32_t index,
+                       unsigned* seed)
+{
+    uint32_t pkt[UDP_PACKET_MAX / 4];
+    udp_header_t* h = (udp_header_t*)pkt;
+
+    if (drop_rate > 0 && rand_r(seed) < drop_rate * RAND_MAX) return;
+    *h = *req;
+    h->type = UDP_DATA;
+    h->count = 1;
+    h->sector = req->sector + index;
+    read_sector(req->id, h->sector, (uint8_t*)pkt + sizeof *h);
+    sendto(fd, pkt, sizeof pkt, 0, (const struct sockaddr*)to, sizeof *to);
+}
+
+
+static void* udp_server (void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    unsigned seed = 1;
+
+    for (;;) {
+        uint32_t pkt[(sizeof (udp_header_t) + 256) / 4];
+        const udp_header_t* h = (const udp_header_t*)pkt;
+        const uint8_t* list = (const uint8_t*)pkt + sizeof *h;
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof from;
+        ssize_t len = recvfrom(fd, pkt, sizeof pkt, 0, (struct sockaddr*)&from, &from_len);
+        uint32_t i;
+
+        if (len < (ssize_t)sizeof *h || h->magic != UDP_MAGIC) continue;
+        if (delay_ms) usleep(delay_ms * 1000);
+        if (h->type == UDP_GET) {
+            for (i = 0; i < h->count; i++) send_data(fd, &from, h, i, &seed);
+        } else if (h->type == UDP_NACK && len >= (ssize_t)(sizeof *h + h->count)) {
+            for (i = 0; i < h->count; i++) send_data(fd, &from, h, list[i], &seed);
+        }
+    }
+    return NULL;
+}
+
+
+static int by_name (const void* a, const void* b)
+{
+    return strcmp(((const entry_t*)a)->name, ((const entry_t*)b)->name);
+}
+
+
+static void load_catalog (const char* dir, uint64_t synth_bytes)
+{
+    DIR* d;
+    struct dirent* de;
+    uint32_t first = 0;
+
+    catalog = malloc(sizeof (entry_t));
+    if (synth_bytes) {
+        catalog[0].name = strdup("synth.bin");
+        catalog[0].path = NULL;
+        catalog[0].size = synth_bytes;
+        catalog[0].version = 1;
+        n_entries = first = 1;
+    }
+    if (!dir || !(d = opendir(dir))) return;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        char* path;
+
+        if (asprintf(&path, "%s/%s", dir, de->d_name) < 0) continue;
+        if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        catalog = realloc(catalog, (n_entries + 1) * sizeof (entry_t));
+        catalog[n_entries].name = strdup(de->d_name);
+        catalog[n_entries].path = path;
+        catalog[n_entries].size = (uint64_t)st.st_size;
+        catalog[n_entries].version = (uint32_t)st.st_mtime;
+        n_entries++;
+    }
+    closedir(d);
+    qsort(catalog + first, n_entries - first, sizeof (entry_t), by_name);
+}
+
+
+int main (int argc, char** argv)
+{
+    struct sockaddr_in addr;
+    const char* dir = NULL;
+    unsigned port = 12345;
+    uint64_t synth_mb = 0;
+    int tcp, udp, i, one = 1;
+    pthread_t t;
+
+    for (i = 1; i < argc; i++) {
+        const char* v = i + 1 < argc ? argv[i + 1] : "0";
+        if (!strcmp(argv[i], "--port")) port = (unsigned)atoi(v), i++;
+        else if (!strcmp(argv[i], "--drop")) drop_rate = atof(v) / 100, i++;
+        else if (!strcmp(argv[i], "--delay-ms")) delay_ms = (unsigned)atoi(v), i++;
+        else if (!strcmp(argv[i], "--synth")) synth_mb = strtoull(v, NULL, 10), i++;
+        else if (argv[i][0] != '-') dir = argv[i];
+        else {
+            fprintf(stderr, "usage: %s [--port N] [--drop PCT] [--delay-ms N] [--synth MB] [DIR]\n", argv[0]);
+            return 2;
+        }
+    }
+    load_catalog(dir, synth_mb << 20);
+    fprintf(stderr, "serving %u files on port %u\n", n_entries, port);
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    tcp = socket(AF_INET, SOCK_STREAM, 0);
+    udp = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if (bind(tcp, (struct sockaddr*)&addr, sizeof addr) || listen(tcp, 16)
+        || bind(udp, (struct sockaddr*)&addr, sizeof addr)) {
+        perror("bind");
+        return 1;
+    }
+    pthread_create(&t, NULL, udp_server, (void*)(intptr_t)udp);
+
+    for (;;) {
+        int fd = accept(tcp, NULL, NULL);
+        if (fd < 0) continue;
+        if (pthread_create(&t, NULL, tcp_client, (void*)(intptr_t)fd)) close(fd);
+        else pthread_detach(t);
+    }
+}
@@ -0,0 +1,21 @@
+/*-----------------------------------------------------------------------*/
+/* Host stand-ins for the few Arduino-ESP32 and FreeRTOS calls made by   */
+/* the device modules built on the host (BlockCache)                     */
+/*-----------------------------------------------------------------------*/
+
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline unsigned long millis(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+#endif /* _HOST_ARDUINO_H_ */
@@ -0,0 +1,41 @@
+#ifndef _HOST_SEMPHR_H_
+#define _HOST_SEMPHR_H_
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+
+/* Only the recursive mutex; the timeout is ignored, takes always block */
+typedef pthread_mutex_t* SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    pthread_mutexattr_t attr;
+    SemaphoreHandle_t m = (SemaphoreHandle_t)malloc(sizeof(pthread_mutex_t));
+
+    if (!m) return NULL;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return m;
+}
+
+static inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t m, TickType_t ticks)
+{
+    (void)ticks;
+    return pthread_mutex_lock(m) == 0 ? pdTRUE : pdFALSE;
+}
+
+static inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t m)
+{
+    return pthread_mutex_unlock(m) == 0 ? pdTRUE : pdFALSE;
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t m)
+{
+    pthread_mutex_destroy(m);
+    free(m);
+}
+
+#endif /* _HOST_SEMPHR_H_ */
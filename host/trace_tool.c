@@ -0,0 +1,231 @@
+/*-----------------------------------------------------------------------*/
+/* MSC trace tool                                                        */
+/*-----------------------------------------------------------------------*/
+/* Works on traces recorded by the device tracer (trace_format.h):
+/
+/    extract CAPTURE OUT   cut every "trace dump" frame out of a raw serial
+/                          capture and join them into one trace file
+/    print TRACE           one CSV line per record
+/    summary TRACE         access pattern and latency summary as JSON
+/
+/  A trace saved to the card ("trace save") is already a trace file. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace_format.h"
+
+static const char* const op_names[] = { "read", "write" };
+static const char* const source_names[TRACE_SRC_COUNT] = { "local", "cache", "remote", "error", "remote_cache" };
+
+
+/* Loads a whole file into memory */
+static unsigned char* load (const char* path, size_t* len)
+{
+    FILE* f = fopen(path, "rb");
+    unsigned char* buf = NULL;
+    long n;
+
+    if (!f) return NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        buf = malloc(n ? (size_t)n : 1);
+        if (buf && fread(buf, 1, (size_t)n, f) != (size_t)n) {
+            free(buf);
+            buf = NULL;
+        }
+        *len = (size_t)n;
+    }
+    fclose(f);
+    return buf;
+}
+
+
+static int valid_header (const trace_header_t* h)
+{
+    return !memcmp(h->magic, TRACE_MAGIC, 4) && h->version == TRACE_VERSION
+        && h->record_size == sizeof (trace_record_t);
+}
+
+
+/* Reads a trace file; returns the records and fills in the header */
+static trace_record_t* load_trace (const char* path, trace_header_t* h)
+{
+    size_t len;
+    unsigned char* buf = load(path, &len);
+    trace_record_t* recs;
+
+    if (!buf) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return NULL;
+    }
+    if (len < sizeof *h) goto bad;
+    memcpy(h, buf, sizeof *h);
+    if (!valid_header(h) || len < sizeof *h + (size_t)h->records * sizeof (trace_record_t)) goto bad;
+    recs = malloc((size_t)h->records * sizeof (trace_record_t) + 1);
+    memcpy(recs, buf + sizeof *h, (size_t)h->records * sizeof (trace_record_t));
+    free(buf);
+    return recs;
+
+bad:
+    fprintf(stderr, "%s is not a trace file\n", path);
+    free(buf);
+    return NULL;
+}
+
+
+/* Frames are found by their header; log text between them is skipped. A
+/  frame cut short by the end of the capture is dropped. */
+static int cmd_extract (const char* capture, const char* out)
+{
+    size_t len, pos = 0, frames = 0;
+    unsigned char* buf = load(capture, &len);
+    trace_header_t total, h;
+    FILE* f;
+
+    if (!buf) {
+        fprintf(stderr, "cannot read %s\n", capture);
+        return 1;
+    }
+    f = fopen(out, "wb");
+    if (!f) {
+        fprintf(stderr, "cannot write %s\n", out);
+        free(buf);
+        return 1;
+    }
+    memset(&total, 0, sizeof total);
+    memcpy(total.magic, TRACE_MAGIC, 4);
+    total.version = TRACE_VERSION;
+    total.record_size = sizeof (trace_record_t);
+    fwrite(&total, sizeof total, 1, f);     /* Rewritten with the totals below */
+
+    while (pos + sizeof h <= len) {
+        size_t body;
+        memcpy(&h, buf + pos, sizeof h);
+        if (!valid_header(&h)) {
+            pos++;
+            continue;
+        }
+        body = (size_t)h.records * sizeof (trace_record_t);
+        if (pos + sizeof h + body > len) break;
+        fwrite(buf + pos + sizeof h, 1, body, f);
+        total.records += h.records;
+        total.dropped += h.dropped;
+        frames++;
+        pos += sizeof h + body;
+    }
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&total, sizeof total, 1, f);
+    fclose(f);
+    free(buf);
+    fprintf(stderr, "%zu frames, %u records, %u dropped\n", frames, total.records, total.dropped);
+    return frames ? 0 : 1;
+}
+
+
+static int cmd_print (const char* path)
+{
+    trace_header_t h;
+    trace_record_t* r = load_trace(path, &h);
+    uint32_t i;
+
+    if (!r) return 1;
+    printf("time_us,op,lba,offset,size,source,latency_us\n");
+    for (i = 0; i < h.records; i++) {
+        printf("%u,%s,%u,%u,%u,%s,%u\n", r[i].time_us, op_names[r[i].op & 1], r[i].lba, r[i].offset,
+               r[i].size, r[i].source < TRACE_SRC_COUNT ? source_names[r[i].source] : "?", r[i].latency_us);
+    }
+    free(r);
+    return 0;
+}
+
+
+static int cmp_u32 (const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static uint32_t pct (const uint32_t* sorted, uint32_t n, unsigned p)
+{
+    return n ? sorted[(uint32_t)(((uint64_t)(n - 1) * p) / 100)] : 0;
+}
+
+
+/* Sequential means the request starts where the previous one of the same
+/  op ended; reuse counts sectors read more than once. */
+static int cmd_summary (const char* path)
+{
+    trace_header_t h;
+    trace_record_t* r = load_trace(path, &h);
+    uint32_t* lat[TRACE_SRC_COUNT];
+    uint32_t n_lat[TRACE_SRC_COUNT] = { 0 };
+    uint64_t bytes[2] = { 0 }, reads = 0, writes = 0, seq = 0, sectors = 0;
+    uint32_t next[2] = { 0, 0 }, i, s, *seen;
+    uint64_t distinct = 0;
+
+    if (!r) return 1;
+    for (s = 0; s < TRACE_SRC_COUNT; s++) lat[s] = malloc(((size_t)h.records + 1) * sizeof (uint32_t));
+
+    for (i = 0; i < h.records; i++) {
+        unsigned op = r[i].op & 1;
+        if (op == TRACE_OP_READ) reads++; else writes++;
+        bytes[op] += r[i].size;
+        if (i && r[i].lba == next[op]) seq++;
+        next[op] = r[i].lba + (r[i].size + 511) / 512;
+        if (r[i].source < TRACE_SRC_COUNT) lat[r[i].source][n_lat[r[i].source]++] = r[i].latency_us;
+        if (op == TRACE_OP_READ) sectors += (r[i].size + 511) / 512;
+    }
+
+    /* Distinct read sectors: sort every read sector number and count runs */
+    seen = malloc((size_t)(sectors + 1) * sizeof (uint32_t));
+    sectors = 0;
+    for (i = 0; i < h.records; i++) {
+        uint32_t k, n = (r[i].size + 511) / 512;
+        if ((r[i].op & 1) != TRACE_OP_READ) continue;
+        for (k = 0; k < n; k++) seen[sectors++] = r[i].lba + k;
+    }
+    qsort(seen, (size_t)sectors, sizeof (uint32_t), cmp_u32);
+    for (i = 0; i < sectors; i++) {
+        if (i == 0 || seen[i] != seen[i - 1]) distinct++;
+    }
+
+    printf("{\n  \"records\": %u, \"dropped\": %u, \"duration_us\": %u,\n", h.records, h.dropped,
+           h.records ? r[h.records - 1].time_us - r[0].time_us : 0);
+    printf("  \"reads\": %llu, \"writes\": %llu, \"read_bytes\": %llu, \"write_bytes\": %llu,\n",
+           (unsigned long long)reads, (unsigned long long)writes,
+           (unsigned long long)bytes[0], (unsigned long long)bytes[1]);
+    printf("  \"sequential\": %.3f, \"read_sectors\": %llu, \"distinct_read_sectors\": %llu, \"read_reuse\": %.3f,\n",
+           h.records ? (double)seq / h.records : 0.0, (unsigned long long)sectors, (unsigned long long)distinct,
+           sectors ? 1.0 - (double)distinct / sectors : 0.0);
+    printf("  \"sources\": [\n");
+    for (s = 0; s < TRACE_SRC_COUNT; s++) {
+        qsort(lat[s], n_lat[s], sizeof (uint32_t), cmp_u32);
+        printf("    {\"source\": \"%s\", \"count\": %u, \"p50_us\": %u, \"p90_us\": %u, \"p99_us\": %u, \"max_us\": %u}%s\n",
+               source_names[s], n_lat[s], pct(lat[s], n_lat[s], 50), pct(lat[s], n_lat[s], 90),
+               pct(lat[s], n_lat[s], 99), n_lat[s] ? lat[s][n_lat[s] - 1] : 0, s < TRACE_SRC_COUNT - 1 ? "," : "");
+        free(lat[s]);
+    }
+    printf("  ]\n}\n");
+    free(seen);
+    free(r);
+    return 0;
+}
+
+
+static void usage (const char* prog)
+{
+    fprintf(stderr, "usage: %s extract CAPTURE OUT | print TRACE | summary TRACE\n", prog);
+}
+
+
+int main (int argc, char** argv)
+{
+    if (argc == 4 && !strcmp(argv[1], "extract")) return cmd_extract(argv[2], argv[3]);
+    if (argc == 3 && !strcmp(argv[1], "print")) return cmd_print(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "summary")) return cmd_summary(argv[2]);
+    usage(argv[0]);
+    return 2;
+}
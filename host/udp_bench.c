@@ -0,0 +1,159 @@
+/*-----------------------------------------------------------------------*/
+/* UDP transport loopback benchmark                                      */
+/*-----------------------------------------------------------------------*/
+/* Reads the synthetic file of remote_server (--synth) through
+/  udp_fetch(), the same engine the device runs, in fetches shaped like
+/  RemoteCache misses: --extents extents of --extent sectors each. Every
+/  sector is checked. Prints throughput, fetch latency and the
+/  retransmit counts as JSON.
+/
+/    remote_server --synth 64 --drop 5 &
+/    udp_bench --mb 64 */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "udp_fetch.h"
+
+
+/* Same content as synth_word() in remote_server.c */
+static uint32_t synth_word (uint32_t s, uint32_t w)
+{
+    return (s << 7 | w) ^ 0xA5A5A5A5;
+}
+
+
+static double now_us (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+
+static int link_send (void* ctx, const void* data, uint32_t len)
+{
+    return send(*(int*)ctx, data, len, 0) == (ssize_t)len;
+}
+
+
+static int link_recv (void* ctx, void* data, uint32_t len, uint32_t wait_ms)
+{
+    struct pollfd p = { *(int*)ctx, POLLIN, 0 };
+    ssize_t n;
+
+    if (poll(&p, 1, (int)wait_ms) <= 0) return 0;
+    n = recv(*(int*)ctx, data, len, 0);
+    return n > 0 ? (int)n : 0;
+}
+
+
+static uint32_t link_now (void* ctx)
+{
+    (void)ctx;
+    return (uint32_t)(now_us() / 1000);
+}
+
+
+static int cmp_double (const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+int main (int argc, char** argv)
+{
+    const char* host = "127.0.0.1";
+    unsigned port = 12345, mb = 16, extent = 64, extents = 4, id = 0;
+    struct sockaddr_in addr;
+    udp_stats_t st = { 0 };
+    udp_link_t link;
+    udp_extent_t* req;
+    uint8_t* buf;
+    double* lat;
+    uint32_t xid = 1, sectors, per_fetch, fetches, f, bad = 0, failed = 0;
+    double start, total;
+    int fd, i;
+
+    for (i = 1; i < argc; i++) {
+        const char* v = i + 1 < argc ? argv[i + 1] : "0";
+        if (!strcmp(argv[i], "--host")) host = v, i++;
+        else if (!strcmp(argv[i], "--port")) port = (unsigned)atoi(v), i++;
+        else if (!strcmp(argv[i], "--mb")) mb = (unsigned)atoi(v), i++;
+        else if (!strcmp(argv[i], "--extent")) extent = (unsigned)atoi(v), i++;
+        else if (!strcmp(argv[i], "--extents")) extents = (unsigned)atoi(v), i++;
+        else if (!strcmp(argv[i], "--id")) id = (unsigned)atoi(v), i++;
+        else {
+            fprintf(stderr, "usage: %s [--host IP] [--port N] [--mb N] [--extent SECTORS] [--extents N] [--id N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || connect(fd, (struct sockaddr*)&addr, sizeof addr)) {
+        fprintf(stderr, "cannot reach %s:%u\n", host, port);
+        return 1;
+    }
+    link.send = link_send;
+    link.recv = link_recv;
+    link.now = link_now;
+    link.ctx = &fd;
+
+    sectors = mb * 2048;
+    per_fetch = extent * extents;
+    fetches = sectors / per_fetch;
+    buf = malloc((size_t)per_fetch * UDP_SECTOR);
+    req = malloc(extents * sizeof *req);
+    lat = malloc((fetches + 1) * sizeof *lat);
+
+    start = now_us();
+    for (f = 0; f < fetches; f++) {
+        uint32_t first = f * per_fetch, s, w;
+        double t0 = now_us();
+
+        for (i = 0; i < (int)extents; i++) {
+            req[i].id = id;
+            req[i].sector = first + i * extent;
+            req[i].count = extent;
+            req[i].buffer = buf + (size_t)i * extent * UDP_SECTOR;
+        }
+        memset(buf, 0, (size_t)per_fetch * UDP_SECTOR);
+        if (udp_fetch(&link, &xid, req, extents, 2000, &st)) failed++;
+        lat[f] = now_us() - t0;
+
+        for (s = 0; s < per_fetch; s++) {
+            const uint32_t* p = (const uint32_t*)(buf + (size_t)s * UDP_SECTOR);
+            for (w = 0; w < UDP_SECTOR / 4 && p[w] == synth_word(first + s, w); w++) ;
+            if (w < UDP_SECTOR / 4) bad++;
+        }
+    }
+    total = now_us() - start;
+    qsort(lat, fetches, sizeof *lat, cmp_double);
+
+    printf("{\"mb\": %u, \"fetch_sectors\": %u, \"fetches\": %u, \"failed\": %u, \"bad_sectors\": %u,\n",
+           mb, per_fetch, fetches, failed, bad);
+    printf(" \"mb_per_s\": %.1f, \"fetch_p50_us\": %.0f, \"fetch_p99_us\": %.0f, \"fetch_max_us\": %.0f,\n",
+           fetches ? (double)fetches * per_fetch * UDP_SECTOR / total : 0.0,
+           fetches ? lat[fetches / 2] : 0.0, fetches ? lat[(fetches - 1) * 99 / 100] : 0.0,
+           fetches ? lat[fetches - 1] : 0.0);
+    printf(" \"requests\": %u, \"nacks\": %u, \"packets\": %u, \"stray\": %u}\n",
+           st.requests, st.nacks, st.packets, st.stray);
+    free(lat);
+    free(req);
+    free(buf);
+    close(fd);
+    return failed || bad;
+}
@@ -0,0 +1,219 @@
+/*-----------------------------------------------------------------------*/
+/* Streaming LZ decoder for remote extents                               */
+/*-----------------------------------------------------------------------*/
+
+#include <string.h>
+#include "lz_stream.h"
+
+#define MIN_MATCH       4
+#define LAST_LITERALS   5       /* A block ends with at least this many literals */
+#define MATCH_LIMIT     12      /* and its last match starts this far from the end */
+#define HASH_BITS       12
+
+enum {
+    LZ_TOKEN,
+    LZ_LIT_LEN,
+    LZ_LITERALS,
+    LZ_OFFSET_LO,
+    LZ_OFFSET_HI,
+    LZ_MATCH_LEN,
+    LZ_DONE,
+    LZ_ERROR
+};
+
+
+void lz_decode_init (lz_decoder_t* d, uint8_t* out, uint32_t size)
+{
+    memset(d, 0, sizeof *d);
+    d->out = out;
+    d->size = size;
+}
+
+
+/* The literals of a sequence are in: the block ends here or a match follows */
+static void end_literals (lz_decoder_t* d)
+{
+    d->state = d->pos == d->size ? LZ_DONE : LZ_OFFSET_LO;
+}
+
+
+/* A match may overlap its own output; copying at most offset bytes at a
+/  time keeps every piece a plain non-overlapping copy. */
+static int copy_match (lz_decoder_t* d)
+{
+    uint8_t* p = d->out + d->pos;
+    const uint8_t* q = p - d->offset;
+    uint32_t n = d->run;
+
+    if (n > d->size - d->pos) return -1;
+    d->pos += n;
+    if (d->offset == 1) {
+        memset(p, *q, n);
+    } else {
+        while (n) {
+            uint32_t chunk = n < d->offset ? n : d->offset;
+            memcpy(p, q, chunk);
+            p += chunk;
+            q += chunk;
+            n -= chunk;
+        }
+    }
+    d->state = LZ_TOKEN;
+    return 0;
+}
+
+
+int lz_decode (lz_decoder_t* d, const uint8_t* in, uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (i < len) {
+        uint8_t b;
+        uint32_t n;
+
+        switch (d->state) {
+        case LZ_TOKEN:
+            d->token = in[i++];
+            d->run = d->token >> 4;
+            if (d->run == 15) d->state = LZ_LIT_LEN;
+            else if (d->run) d->state = LZ_LITERALS;
+            else end_literals(d);
+            break;
+
+        case LZ_LIT_LEN:
+            b = in[i++];
+            d->run += b;
+            if (b != 255) d->state = LZ_LITERALS;
+            break;
+
+        case LZ_LITERALS:
+            n = len - i < d->run ? len - i : d->run;
+            if (n > d->size - d->pos) goto corrupt;
+            memcpy(d->out + d->pos, in + i, n);
+            d->pos += n;
+            d->run -= n;
+            i += n;
+            if (!d->run) end_literals(d);
+            break;
+
+        case LZ_OFFSET_LO:
+            d->offset = in[i++];
+            d->state = LZ_OFFSET_HI;
+            break;
+
+        case LZ_OFFSET_HI:
+            d->offset |= (uint16_t)in[i++] << 8;
+            if (!d->offset || d->offset > d->pos) goto corrupt;
+            d->run = d->token & 15;
+            if (d->run == 15) {
+                d->state = LZ_MATCH_LEN;
+            } else {
+                d->run += MIN_MATCH;
+                if (copy_match(d)) goto corrupt;
+            }
+            break;
+
+        case LZ_MATCH_LEN:
+            b = in[i++];
+            d->run += b;
+            if (b != 255) {
+                d->run += MIN_MATCH;
+                if (copy_match(d)) goto corrupt;
+            }
+            break;
+
+        default:
+            goto corrupt;       /* Input past the end of the block */
+        }
+    }
+    return 0;
+
+corrupt:
+    d->state = LZ_ERROR;
+    return -1;
+}
+
+
+int lz_decode_done (const lz_decoder_t* d)
+{
+    return d->state == LZ_DONE;
+}
+
+
+static uint32_t ld32 (const uint8_t* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+/* Writes a length that did not fit its 4-bit token field */
+static uint8_t* put_len (uint8_t* op, const uint8_t* end, uint32_t n)
+{
+    for (; n >= 255; n -= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+
+/* One sequence: the literals from anchor, then a match unless mlen is 0 */
+static uint8_t* put_sequence (uint8_t* op, const uint8_t* end, const uint8_t* lit, uint32_t nlit,
+                              uint32_t offset, uint32_t mlen)
+{
+    uint8_t* token = op++;
+    uint32_t mcode = mlen ? mlen - MIN_MATCH : 0;
+
+    if (op > end) return NULL;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15));
+    if (nlit >= 15 && !(op = put_len(op, end, nlit - 15))) return NULL;
+    if ((uint32_t)(end - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+
+    if (end - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    if (mcode >= 15 && !(op = put_len(op, end, mcode - 15))) return NULL;
+    return op;
+}
+
+
+uint32_t lz_compress (const uint8_t* src, uint32_t n, uint8_t* dst, uint32_t cap)
+{
+    uint32_t table[1 << HASH_BITS];     /* Position + 1 of the last 4 bytes with each hash */
+    const uint8_t* end = dst + cap;
+    uint8_t* op = dst;
+    uint32_t anchor = 0, ip = 0;
+
+    memset(table, 0, sizeof table);
+    if (n > MATCH_LIMIT) {
+        while (ip < n - MATCH_LIMIT) {
+            uint32_t seq = ld32(src + ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+            uint32_t ref = table[h];
+            uint32_t mlen;
+
+            table[h] = ip + 1;
+            if (!ref-- || ip - ref > 65535 || ld32(src + ref) != seq) {
+                ip++;
+                continue;
+            }
+            mlen = MIN_MATCH;
+            while (ip + mlen < n - LAST_LITERALS && src[ref + mlen] == src[ip + mlen]) mlen++;
+
+            op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, mlen);
+            if (!op) return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    op = put_sequence(op, end, src + anchor, n - anchor, 0, 0);
+    return op ? (uint32_t)(op - dst) : 0;
+}
@@ -0,0 +1,53 @@
+/*-----------------------------------------------------------------------*/
+/* Streaming LZ decoder for remote extents                               */
+/*-----------------------------------------------------------------------*/
+/* Blocks are in the LZ4 block format: sequences of a token, literals and
+/  a 16-bit back reference, the last sequence literals only. The decoder
+/  takes its input in pieces of any size, as they come off a socket, and
+/  writes straight into the destination buffer, which is also its only
+/  history: the state is a few words, with no window or staging copy.
+/
+/  lz_compress() is the matching greedy compressor for the server side
+/  and the host benchmark. */
+
+#ifndef LZ_STREAM_DEFINED
+#define LZ_STREAM_DEFINED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint8_t* out;
+    uint32_t size;          /* Bytes the block decodes to */
+    uint32_t pos;           /* Bytes decoded so far */
+    uint32_t run;           /* Bytes left of the current literal run or length */
+    uint16_t offset;
+    uint8_t token;
+    uint8_t state;
+} lz_decoder_t;
+
+void lz_decode_init (lz_decoder_t* d, uint8_t* out, uint32_t size);
+/* Feeds len more bytes of the block. Returns 0, or -1 when the block is
+/  corrupt or runs past size; the decoder is then stuck in the error. */
+int lz_decode (lz_decoder_t* d, const uint8_t* in, uint32_t len);
+/* Whether exactly size bytes were decoded and the block ended there */
+int lz_decode_done (const lz_decoder_t* d);
+
+/* A block is only worth sending when it saves at least 1/LZ_MIN_SAVING of
+/  the raw size; below that the decode time outweighs the bytes saved. */
+#define LZ_MIN_SAVING   16
+#define LZ_CAP(raw)     ((raw) - (raw) / LZ_MIN_SAVING)
+
+/* Compresses n bytes into at most cap bytes. Returns the block size, or 0
+/  when it does not fit, in which case the data is better sent raw.
+/  Needs 16 KiB of stack for its hash table. */
+uint32_t lz_compress (const uint8_t* src, uint32_t n, uint8_t* dst, uint32_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZ_STREAM_DEFINED */
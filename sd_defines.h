@@ -14,6 +14,8 @@
 #ifndef _SD_DEFINES_H_
 #define _SD_DEFINES_H_
 
+#include <stdint.h>
+
 typedef enum {
     CARD_NONE,
     CARD_MMC,
@@ -22,4 +24,20 @@ typedef enum {
     CARD_UNKNOWN
 } sdcard_type_t;
 
+typedef enum {
+    SD_WAIT_SELECT,
+    SD_WAIT_READ_TOKEN,
+    SD_WAIT_WRITE_BUSY,
+    SD_WAIT_ERASE,
+    SD_WAIT_KIND_MAX
+} sd_wait_kind_t;
+
+typedef struct {
+    uint32_t waits;         // waits that found the card busy
+    uint32_t sleeps;        // scheduler ticks given up while polling
+    uint32_t timeouts;      // waits that ran out of budget
+    uint32_t max_us;        // longest single wait
+    uint64_t busy_us;       // total time spent waiting
+} sdcard_busy_stats_t;
+
 #endif /* _SD_DISKIO_H_ */
@@ -12,7 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "sd_diskio.h"
+#include "Metrics.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
 extern "C" {
     char CRC7(const char* data, int length);
     unsigned short CRC16(const char* data, int length);
@@ -35,6 +39,9 @@ typedef enum {
     SET_WR_BLK_ERASE_COUNT  = 23,
     WRITE_BLOCK_SINGLE      = 24,
     WRITE_BLOCK_MULTIPLE    = 25,
+    ERASE_WR_BLK_START      = 32,
+    ERASE_WR_BLK_END        = 33,
+    ERASE                   = 38,
     APP_OP_COND             = 41,
     APP_CLR_CARD_DETECT     = 42,
     APP_CMD                 = 55,
@@ -50,11 +57,57 @@ typedef struct {
     sdcard_type_t type;
     unsigned long sectors;
     bool supports_crc;
+    bool supports_erase;
     int status;
+    bool defer_status;
+    uint8_t status_pending;
+    SPISettings settings;
+    uint32_t cs_mask;
+    uint32_t cs_set_reg;
+    uint32_t cs_clr_reg;
+    TaskHandle_t session_owner;
+    uint8_t session_depth;
+    bool selected;
 } ardu_sdcard_t;
 
 static ardu_sdcard_t* s_card = nullptr;
 
+/*
+ * Busy budgets (ms) for each kind of wait. The card is polled in bursts of
+ * SD_WAIT_BURST bytes; once a wait has spun for SD_WAIT_SPIN_US the poller
+ * sleeps a tick between bursts so the USB and network tasks keep running.
+ */
+#define SD_WAIT_BURST       16
+#define SD_WAIT_SPIN_US     200
+#define SD_RETRY_BACKOFF_MS 10
+
+/*
+ * With defer_status set, a single-block write whose data response token says
+ * "accepted" skips its own SEND_STATUS. The card keeps error bits latched
+ * until the next SEND_STATUS, so one check after SD_STATUS_BATCH writes, at
+ * the end of a multi-block write or at CTRL_SYNC covers every write before it.
+ * A failure is therefore reported late, by whichever of those runs the check,
+ * and the deferred writes before it have already returned success. Callers
+ * that must know before they answer (the MSC write callback) sync after
+ * writing; FatFs learns at f_sync/f_close.
+ */
+#define SD_STATUS_BATCH     16
+
+/*
+ * Larger trims are split so that one ERASE stays well inside the
+ * SD_WAIT_ERASE budget even on slow cards.
+ */
+#define SD_ERASE_CHUNK      65536
+
+static const uint16_t sdWaitBudget[SD_WAIT_KIND_MAX] = {
+    300,    // SD_WAIT_SELECT
+    500,    // SD_WAIT_READ_TOKEN
+    500,    // SD_WAIT_WRITE_BUSY
+    5000,   // SD_WAIT_ERASE
+};
+
+static sdcard_busy_stats_t s_busy_stats[SD_WAIT_KIND_MAX];
+
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_ERROR
 const char * fferr2str[] = {
     "(0) Succeeded",
@@ -84,14 +137,56 @@ const char * fferr2str[] = {
     SD SPI
  * */
 
-bool sdWait(int timeout)
+/*
+ * Clock 0xFF into the card until it returns something other than idle_value
+ * or the budget for this kind of wait runs out. Returns the last byte read.
+ */
+static uint8_t sdPollWhile(uint8_t idle_value, sd_wait_kind_t kind)
 {
-    char resp;
-    uint32_t start = millis();
+    uint8_t resp = s_card->spi->transfer(0xFF);
+    if (resp != idle_value) {
+        return resp;
+    }
+
+    sdcard_busy_stats_t* stats = &s_busy_stats[kind];
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + (int64_t)sdWaitBudget[kind] * 1000;
+    int64_t now = start;
+
+    while (resp == idle_value && now < deadline) {
+        for (int i = 0; i < SD_WAIT_BURST && resp == idle_value; i++) {
+            resp = s_card->spi->transfer(0xFF);
+        }
+        if (resp != idle_value) {
+            break;
+        }
+
+        now = esp_timer_get_time();
+        if (now - start < SD_WAIT_SPIN_US) {
+            yield();
+        } else {
+            vTaskDelay(1);
+            stats->sleeps++;
+        }
+        now = esp_timer_get_time();
+    }
 
-    do {
-        resp = s_card->spi->transfer(0xFF);
-    } while (resp == 0x00 && (millis() - start) < (unsigned int)timeout);
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+    METRIC_RECORD(METRIC_SD_BUSY, elapsed);
+    stats->waits++;
+    stats->busy_us += elapsed;
+    if (elapsed > stats->max_us) {
+        stats->max_us = elapsed;
+    }
+    if (resp == idle_value) {
+        stats->timeouts++;
+    }
+    return resp;
+}
+
+bool sdWait(sd_wait_kind_t kind)
+{
+    char resp = sdPollWhile(0x00, kind);
 
     if (!resp) {
         Serial.println("Wait Failed");
@@ -104,18 +199,49 @@ void sdStop()
     s_card->spi->write(0xFD);
 }
 
+static inline void sdCsHigh()
+{
+    REG_WRITE(s_card->cs_set_reg, s_card->cs_mask);
+    s_card->selected = false;
+}
+
+static inline void sdCsLow()
+{
+    REG_WRITE(s_card->cs_clr_reg, s_card->cs_mask);
+    s_card->selected = true;
+}
+
+/*
+ * Inside a session (sd_session_begin/end) chip-select stays asserted between
+ * commands; the card only needs CS high again when the bus is handed back.
+ */
 void sdDeselectCard()
 {
-    digitalWrite(s_card->ssPin, HIGH);
+    if (s_card->session_depth) {
+        return;
+    }
+    sdCsHigh();
+}
+
+/*
+ * A command that got no token or a CRC error needs a real CS high/low edge
+ * and a few clocks to resynchronise, also inside a session.
+ */
+static void sdResync()
+{
+    sdCsHigh();
+    s_card->spi->transfer(0xFF);
 }
 
 bool sdSelectCard()
 {
-    digitalWrite(s_card->ssPin, LOW);
-    bool s = sdWait(300);
+    if (!s_card->selected) {
+        sdCsLow();
+    }
+    bool s = sdWait(SD_WAIT_SELECT);
     if (!s) {
         log_e("Select Failed");
-        digitalWrite(s_card->ssPin, HIGH);
+        sdCsHigh();
         return false;
     }
     return true;
@@ -162,14 +288,14 @@ char sdCommand(char cmd, unsigned int arg, unsigned int* resp)
 
         if (token == 0xFF) {
             Serial.println("no token received");
-            sdDeselectCard();
-            delay(100);
+            sdResync();
+            vTaskDelay(pdMS_TO_TICKS(SD_RETRY_BACKOFF_MS << f));
             sdSelectCard();
             continue;
         } else if (token & 0x08) {
             Serial.println("crc error");
-            sdDeselectCard();
-            delay(100);
+            sdResync();
+            vTaskDelay(pdMS_TO_TICKS(SD_RETRY_BACKOFF_MS << f));
             sdSelectCard();
             continue;
         } else if (token > 1) {
@@ -197,10 +323,7 @@ bool sdReadBytes(char* buffer, int length)
     char token;
     unsigned short crc;
 
-    uint32_t start = millis();
-    do {
-        token = s_card->spi->transfer(0xFF);
-    } while (token == 0xFF && (millis() - start) < 500);
+    token = sdPollWhile(0xFF, SD_WAIT_READ_TOKEN);
 
     if (token != 0xFE) {
         return false;
@@ -214,7 +337,7 @@ bool sdReadBytes(char* buffer, int length)
 char sdWriteBytes(const char* buffer, char token)
 {
     unsigned short crc = (s_card->supports_crc) ? CRC16(buffer, 512) : 0xFFFF;
-    if (!sdWait(500)) {
+    if (!sdWait(SD_WAIT_WRITE_BUSY)) {
         return false;
     }
 
@@ -238,6 +361,18 @@ char sdTransaction(char cmd, unsigned int arg, unsigned int* resp)
     return token;
 }
 
+bool sdCheckStatus()
+{
+    unsigned int resp;
+
+    s_card->status_pending = 0;
+    if (sdTransaction(SEND_STATUS, 0, &resp) || resp) {
+        log_e("SEND_STATUS reported a write failure: 0x%x", resp);
+        return false;
+    }
+    return true;
+}
+
 bool sdReadSector(char* buffer, unsigned long long sector)
 {
     for (int f = 0; f < 3; f++) {
@@ -310,11 +445,11 @@ bool sdWriteSector(const char* buffer, unsigned long long sector)
                 return false;
             }
 
-            unsigned int resp;
-            if (sdTransaction(SEND_STATUS, 0, &resp) || resp) {
-                return false;
+            if (s_card->defer_status && token == 0x05
+                    && ++s_card->status_pending < SD_STATUS_BATCH) {
+                return true;
             }
-            return true;
+            return sdCheckStatus();
         } else {
             break;
         }
@@ -352,7 +487,7 @@ bool sdWriteSectors(const char* buffer, unsigned long long sector, int count)
                 f = 0;
             } while (--currentCount);
 
-            if (!sdWait(500)) {
+            if (!sdWait(SD_WAIT_WRITE_BUSY)) {
                 break;
             }
 
@@ -360,11 +495,7 @@ bool sdWriteSectors(const char* buffer, unsigned long long sector, int count)
                 sdStop();
                 sdDeselectCard();
 
-                unsigned int resp;
-                if (sdTransaction(SEND_STATUS, 0, &resp) || resp) {
-                    return false;
-                }
-                return true;
+                return sdCheckStatus();
             } else {
                 if (sdCommand(STOP_TRANSMISSION, 0, NULL)) {
                     break;
@@ -401,6 +532,30 @@ bool sdWriteSectors(const char* buffer, unsigned long long sector, int count)
     return false;
 }
 
+bool sdEraseSectors(unsigned long long start, unsigned long long end)
+{
+    unsigned int shift = (s_card->type == CARD_SDHC) ? 0 : 9;
+
+    if (sdTransaction(ERASE_WR_BLK_START, start << shift, NULL)) {
+        return false;
+    }
+    if (sdTransaction(ERASE_WR_BLK_END, end << shift, NULL)) {
+        return false;
+    }
+
+    if (!sdSelectCard()) {
+        return false;
+    }
+    if (sdCommand(ERASE, 0, NULL)) {
+        sdDeselectCard();
+        return false;
+    }
+    bool done = sdWait(SD_WAIT_ERASE);
+    sdDeselectCard();
+
+    return done && sdCheckStatus();
+}
+
 unsigned long sdGetSectorsCount()
 {
     for (int f = 0; f < 3; f++) {
@@ -413,6 +568,9 @@ unsigned long sdGetSectorsCount()
             bool success = sdReadBytes(csd, 16);
             sdDeselectCard();
             if (success) {
+                // SDHC erases single blocks; SDSC only when ERASE_BLK_EN is set,
+                // otherwise ERASE rounds out to whole erase sectors.
+                s_card->supports_erase = ((csd[0] >> 6) == 0x01) || (csd[10] & 0x40);
                 if ((csd[0] >> 6) == 0x01) {
                     unsigned long size = (
                                              ((unsigned long)(csd[7] & 0x3F) << 16)
@@ -449,19 +607,25 @@ namespace
 struct AcquireSPI
 {
         ardu_sdcard_t *card;
+        bool locked;
         explicit AcquireSPI(ardu_sdcard_t* card)
-            : card(card)
+            : card(card), locked(false)
         {
-            card->spi->beginTransaction(SPISettings(card->frequency, MSBFIRST, SPI_MODE0));
+            if (card->session_owner != xTaskGetCurrentTaskHandle()) {
+                card->spi->beginTransaction(card->settings);
+                locked = true;
+            }
         }
         AcquireSPI(ardu_sdcard_t* card, int frequency)
-            : card(card)
+            : card(card), locked(true)
         {
             card->spi->beginTransaction(SPISettings(frequency, MSBFIRST, SPI_MODE0));
         }
         ~AcquireSPI()
         {
-            card->spi->endTransaction();
+            if (locked) {
+                card->spi->endTransaction();
+            }
         }
     private:
         AcquireSPI(AcquireSPI const&);
@@ -482,7 +646,7 @@ DSTATUS sd_initialize()
 
     AcquireSPI card_locked(s_card, 400000);
 
-    digitalWrite(s_card->ssPin, HIGH);
+    sdCsHigh();
     for (uint8_t i = 0; i < 20; i++) {
         s_card->spi->transfer(0XFF);
     }
@@ -579,6 +743,7 @@ DSTATUS sd_initialize()
     if (s_card->frequency > 25000000) {
         s_card->frequency = 25000000;
     }
+    s_card->settings = SPISettings(s_card->frequency, MSBFIRST, SPI_MODE0);
     s_card->status &= ~STA_NOINIT;
     return s_card->status;
 
@@ -595,7 +760,7 @@ DSTATUS sd_status()
 bool sd_read(uint8_t* buffer, uint32_t sector)
 {
     if (s_card->status & STA_NOINIT) {
-        return RES_NOTRDY;
+        return false;
     }
 
     AcquireSPI lock(s_card);
@@ -603,7 +768,7 @@ bool sd_read(uint8_t* buffer, uint32_t sector)
     return sdReadSector((char*)buffer, sector);
 }
 
-bool sd_write(uint8_t* buffer, uint32_t sector)
+bool sd_write(const uint8_t* buffer, uint32_t sector)
 {
     if (s_card->status & STA_NOINIT) {
         return false;
@@ -618,6 +783,38 @@ bool sd_write(uint8_t* buffer, uint32_t sector)
     return sdWriteSector((const char*)buffer, sector);
 }
 
+bool sd_read_sectors(uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    if (s_card->status & STA_NOINIT) {
+        return false;
+    }
+
+    AcquireSPI lock(s_card);
+
+    if (count == 1) {
+        return sdReadSector((char*)buffer, sector);
+    }
+    return sdReadSectors((char*)buffer, sector, count);
+}
+
+bool sd_write_sectors(const uint8_t* buffer, uint32_t sector, uint32_t count)
+{
+    if (s_card->status & STA_NOINIT) {
+        return false;
+    }
+
+    if (s_card->status & STA_PROTECT) {
+        return false;
+    }
+
+    AcquireSPI lock(s_card);
+
+    if (count == 1) {
+        return sdWriteSector((const char*)buffer, sector);
+    }
+    return sdWriteSectors((const char*)buffer, sector, count);
+}
+
 DRESULT sd_ioctl(uint8_t cmd, void* buff)
 {
     switch (cmd) {
@@ -626,6 +823,9 @@ DRESULT sd_ioctl(uint8_t cmd, void* buff)
                 AcquireSPI lock(s_card);
                 if (sdSelectCard()) {
                     sdDeselectCard();
+                    if (s_card->status_pending && !sdCheckStatus()) {
+                        return RES_ERROR;
+                    }
                     return RES_OK;
                 }
             }
@@ -643,17 +843,113 @@ DRESULT sd_ioctl(uint8_t cmd, void* buff)
     return RES_PARERR;
 }
 
+bool sd_trim(uint32_t start, uint32_t end)
+{
+    if (s_card->status & STA_NOINIT) {
+        return false;
+    }
+
+    if (s_card->status & STA_PROTECT) {
+        return false;
+    }
+
+    if (start > end || end >= s_card->sectors) {
+        return false;
+    }
+
+    // MMC uses a different erase group command set and cards that cannot
+    // erase single blocks would lose neighbouring data; trim is only a hint.
+    if (s_card->type == CARD_MMC || !s_card->supports_erase) {
+        return true;
+    }
+
+    AcquireSPI lock(s_card);
+
+    while (start <= end) {
+        uint32_t last = end;
+        if (last - start >= SD_ERASE_CHUNK) {
+            last = start + SD_ERASE_CHUNK - 1;
+        }
+        if (!sdEraseSectors(start, last)) {
+            return false;
+        }
+        if (last == end) {
+            break;
+        }
+        start = last + 1;
+    }
+    return true;
+}
+
+bool sd_sync()
+{
+    if (s_card->status & STA_NOINIT) {
+        return false;
+    }
+
+    return sd_ioctl(CTRL_SYNC, NULL) == RES_OK;
+}
+
+bool sd_session_begin()
+{
+    if (s_card == nullptr || (s_card->status & STA_NOINIT)) {
+        return false;
+    }
+
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    if (s_card->session_owner == self) {
+        s_card->session_depth++;
+        return true;
+    }
+
+    s_card->spi->beginTransaction(s_card->settings);
+    s_card->session_owner = self;
+    s_card->session_depth = 1;
+    return true;
+}
+
+void sd_session_end()
+{
+    if (s_card == nullptr || s_card->session_owner != xTaskGetCurrentTaskHandle()) {
+        return;
+    }
+
+    if (--s_card->session_depth) {
+        return;
+    }
+
+    if (s_card->selected) {
+        sdCsHigh();
+    }
+    s_card->session_owner = NULL;
+    s_card->spi->endTransaction();
+}
+
 /*
     Public methods
  * */
 
+void sdcard_busy_stats(sdcard_busy_stats_t* stats, bool reset)
+{
+    memcpy(stats, s_busy_stats, sizeof(s_busy_stats));
+    if (reset) {
+        memset(s_busy_stats, 0, sizeof(s_busy_stats));
+    }
+}
+
 uint8_t sdcard_uninit()
 {
     if (s_card == NULL) {
         return 1;
     }
+    uint8_t err = 0;
+    if (s_card->status_pending) {
+        AcquireSPI lock(s_card);
+        if (!sdCheckStatus()) {
+            err = 1;
+        }
+    }
     sdTransaction(GO_IDLE_STATE, 0, NULL);
-    esp_err_t err = ESP_OK;
     if (s_card->base_path) {
         free(s_card->base_path);
     }
@@ -675,11 +971,30 @@ bool sdcard_init(uint8_t cs, SPIClass * spi, int hz)
     s_card->ssPin = cs;
 
     s_card->supports_crc = true;
+    s_card->supports_erase = false;
     s_card->type = CARD_NONE;
     s_card->status = STA_NOINIT;
+    s_card->defer_status = true;
+    s_card->status_pending = 0;
+
+    s_card->settings = SPISettings(hz, MSBFIRST, SPI_MODE0);
+    s_card->session_owner = NULL;
+    s_card->session_depth = 0;
+#if SOC_GPIO_PIN_COUNT > 32
+    if (cs >= 32) {
+        s_card->cs_mask = 1UL << (cs - 32);
+        s_card->cs_set_reg = GPIO_OUT1_W1TS_REG;
+        s_card->cs_clr_reg = GPIO_OUT1_W1TC_REG;
+    } else
+#endif
+    {
+        s_card->cs_mask = 1UL << cs;
+        s_card->cs_set_reg = GPIO_OUT_W1TS_REG;
+        s_card->cs_clr_reg = GPIO_OUT_W1TC_REG;
+    }
 
     pinMode(s_card->ssPin, OUTPUT);
-    digitalWrite(s_card->ssPin, HIGH);
+    sdCsHigh();
 
     return sd_initialize();
 }
@@ -20,12 +20,25 @@
 #include "sd_defines.h"
 
 bool sdcard_init(uint8_t cs, SPIClass * spi, int hz);
+// Non-zero if there is no card or its last deferred write failed.
 uint8_t sdcard_uninit();
 
 sdcard_type_t sdcard_type();
 uint32_t sdcard_num_sectors();
 uint32_t sdcard_sector_size();
 bool sd_read(uint8_t* buffer, uint32_t sector);
-bool sd_write(uint8_t* buffer, uint32_t sector);
+bool sd_write(const uint8_t* buffer, uint32_t sector);
+bool sd_read_sectors(uint8_t* buffer, uint32_t sector, uint32_t count);
+bool sd_write_sectors(const uint8_t* buffer, uint32_t sector, uint32_t count);
+bool sd_sync();
+bool sd_trim(uint32_t start, uint32_t end);
+
+// Hold the SPI bus and chip-select for the calling task across several
+// sd_* calls. Sessions nest; other tasks block until the outermost end.
+bool sd_session_begin();
+void sd_session_end();
+
+// Copies one sdcard_busy_stats_t per sd_wait_kind_t into stats.
+void sdcard_busy_stats(sdcard_busy_stats_t* stats, bool reset);
 
 #endif /* _SD_DISKIO_H_ */
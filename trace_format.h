@@ -0,0 +1,49 @@
+/*-----------------------------------------------------------------------*/
+/* MSC access trace format                                               */
+/*-----------------------------------------------------------------------*/
+/* Shared by the device tracer (Tracer.cpp) and the host tools. A trace
+/  is a header followed by header.records fixed-size records, all little
+/  endian. Over serial each dump is framed by the same header, so a
+/  capture can be cut out of a log that has text around it. */
+
+#ifndef TRACE_FORMAT_DEFINED
+#define TRACE_FORMAT_DEFINED
+
+#include <stdint.h>
+
+#define TRACE_MAGIC     "MSCT"
+#define TRACE_VERSION   1
+
+typedef enum {
+    TRACE_OP_READ,
+    TRACE_OP_WRITE
+} trace_op_t;
+
+typedef enum {
+    TRACE_SRC_LOCAL,        /* SD card through the block cache, missed */
+    TRACE_SRC_CACHE,        /* Every sector came from the block cache */
+    TRACE_SRC_REMOTE,       /* Catalog file sector, served over the network */
+    TRACE_SRC_ERROR,        /* The callback failed */
+    TRACE_SRC_REMOTE_CACHE, /* Catalog file sector, already in the remote cache */
+    TRACE_SRC_COUNT
+} trace_source_t;
+
+typedef struct {
+    char magic[4];          /* TRACE_MAGIC */
+    uint16_t version;       /* TRACE_VERSION */
+    uint16_t record_size;   /* sizeof (trace_record_t) */
+    uint32_t records;       /* Records following this header */
+    uint32_t dropped;       /* Records lost to a full ring before these */
+} trace_header_t;           /* 16 bytes */
+
+typedef struct {
+    uint32_t time_us;       /* Start of the request, from trace start (wraps after ~71 min) */
+    uint32_t lba;
+    uint32_t size;          /* Bytes transferred */
+    uint32_t latency_us;    /* Time spent in the callback */
+    uint16_t offset;        /* Byte offset into lba */
+    uint8_t op;             /* trace_op_t */
+    uint8_t source;         /* trace_source_t */
+} trace_record_t;           /* 20 bytes, no padding */
+
+#endif /* TRACE_FORMAT_DEFINED */
@@ -0,0 +1,166 @@
+/*-----------------------------------------------------------------------*/
+/* Datagram sector transport                                             */
+/*-----------------------------------------------------------------------*/
+
+#include <string.h>
+#include "udp_fetch.h"
+
+typedef struct {
+    uint32_t xid;
+    uint32_t id;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t* buffer;
+    uint32_t have;          /* Bit i: sector i is in */
+    uint32_t last;          /* Index the current round of DATA ends with */
+    uint32_t heard;         /* Time of the last request or DATA */
+    int used;
+} udp_slot_t;
+
+typedef struct {
+    const udp_extent_t* extents;
+    uint32_t n;
+    uint32_t e;             /* Extent being cut */
+    uint32_t done;          /* Sectors of it already handed out */
+} udp_cursor_t;
+
+
+static uint32_t full_mask (uint32_t count)
+{
+    return count >= 32 ? 0xFFFFFFFF : ((uint32_t)1 << count) - 1;
+}
+
+
+static void put_header (udp_header_t* h, uint8_t type, uint8_t count, const udp_slot_t* s)
+{
+    h->magic = UDP_MAGIC;
+    h->type = type;
+    h->count = count;
+    h->xid = s->xid;
+    h->id = s->id;
+    h->sector = s->sector;
+}
+
+
+/* Asks for every sector the slot is missing: a GET the first time, a
+/  NACK listing them afterwards. Each request gets a new xid. */
+static int request (const udp_link_t* link, udp_slot_t* s, uint32_t* xid, udp_stats_t* st)
+{
+    uint32_t pkt[(sizeof (udp_header_t) + 32) / 4];    /* Aligned for the header */
+    uint8_t* list = (uint8_t*)pkt + sizeof (udp_header_t);
+    uint32_t missing = full_mask(s->count) & ~s->have;
+    uint8_t n = 0;
+    uint32_t i;
+
+    s->xid = (*xid)++;
+    s->heard = link->now(link->ctx);
+    if (!s->have) {
+        put_header((udp_header_t*)pkt, UDP_GET, (uint8_t)s->count, s);
+        s->last = s->count - 1;
+        st->requests++;
+        return link->send(link->ctx, pkt, sizeof (udp_header_t));
+    }
+    for (i = 0; i < s->count; i++) {
+        if (missing & ((uint32_t)1 << i)) {
+            list[n++] = (uint8_t)i;
+            s->last = i;
+        }
+    }
+    put_header((udp_header_t*)pkt, UDP_NACK, n, s);
+    st->nacks++;
+    return link->send(link->ctx, pkt, sizeof (udp_header_t) + n);
+}
+
+
+/* Loads the next chunk into a free slot; returns 0 when none is left */
+static int next_chunk (udp_cursor_t* c, udp_slot_t* s)
+{
+    const udp_extent_t* ext;
+    uint32_t count;
+
+    while (c->e < c->n && c->done >= c->extents[c->e].count) {
+        c->e++;
+        c->done = 0;
+    }
+    if (c->e >= c->n) return 0;
+
+    ext = &c->extents[c->e];
+    count = ext->count - c->done;
+    if (count > UDP_CHUNK_SECTORS) count = UDP_CHUNK_SECTORS;
+    s->id = ext->id;
+    s->sector = ext->sector + c->done;
+    s->count = count;
+    s->buffer = ext->buffer + c->done * UDP_SECTOR;
+    s->have = 0;
+    s->used = 1;
+    c->done += count;
+    return 1;
+}
+
+
+int udp_fetch (const udp_link_t* link, uint32_t* xid, const udp_extent_t* extents, uint32_t n,
+               uint32_t timeout_ms, udp_stats_t* stats)
+{
+    udp_slot_t slots[UDP_WINDOW];
+    udp_cursor_t cursor = { extents, n, 0, 0 };
+    udp_stats_t dummy;
+    udp_stats_t* st = stats ? stats : &dummy;
+    uint32_t pkt[(UDP_PACKET_MAX + 3) / 4];
+    const udp_header_t* h = (const udp_header_t*)pkt;
+    uint32_t start = link->now(link->ctx);
+    int active = 0, i, len;
+
+    memset(slots, 0, sizeof slots);
+    for (i = 0; i < UDP_WINDOW && next_chunk(&cursor, &slots[i]); i++) {
+        request(link, &slots[i], xid, st);
+        active++;
+    }
+
+    while (active) {
+        uint32_t now;
+
+        len = link->recv(link->ctx, pkt, sizeof pkt, UDP_NACK_MS);
+        now = link->now(link->ctx);
+
+        if (len == (int)UDP_PACKET_MAX && h->magic == UDP_MAGIC && h->type == UDP_DATA) {
+            udp_slot_t* s = NULL;
+            uint32_t idx;
+
+            for (i = 0; i < UDP_WINDOW; i++) {
+                if (slots[i].used && slots[i].xid == h->xid) s = &slots[i];
+            }
+            idx = s ? h->sector - s->sector : 0;
+            if (!s || idx >= s->count || (s->have & ((uint32_t)1 << idx))) {
+                st->stray++;    /* An earlier round of this chunk, or an old fetch */
+            } else {
+                memcpy(s->buffer + idx * UDP_SECTOR, (const uint8_t*)pkt + sizeof (udp_header_t), UDP_SECTOR);
+                s->have |= (uint32_t)1 << idx;
+                s->heard = now;
+                st->packets++;
+                if (s->have == full_mask(s->count)) {
+                    s->used = 0;
+                    active--;
+                    if (next_chunk(&cursor, s)) {
+                        request(link, s, xid, st);
+                        active++;
+                    }
+                } else if (idx == s->last) {
+                    request(link, s, xid, st);  /* The round ended with gaps */
+                }
+            }
+            /* The server answers in order: DATA for this request means
+            /  every older request has been sent in full, gaps included. */
+            for (i = 0; s && i < UDP_WINDOW; i++) {
+                if (slots[i].used && (int32_t)(h->xid - slots[i].xid) > 0) request(link, &slots[i], xid, st);
+            }
+        } else if (len > 0) {
+            st->stray++;
+        }
+
+        for (i = 0; i < UDP_WINDOW; i++) {
+            if (slots[i].used && now - slots[i].heard >= UDP_NACK_MS) request(link, &slots[i], xid, st);
+        }
+        if (active && now - start >= timeout_ms) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*-----------------------------------------------------------------------*/
+/* Datagram sector transport                                             */
+/*-----------------------------------------------------------------------*/
+/* Catalog file sectors over UDP, for LANs where one TCP window and its
+/  head-of-line blocking cap the fetch rate. The client cuts extents into
+/  chunks of up to UDP_CHUNK_SECTORS, keeps UDP_WINDOW chunk requests in
+/  flight and asks again only for the sectors that did not arrive:
+/
+/    GET   header                      -> one DATA per sector of the chunk
+/    NACK  header + count indexes      -> one DATA per listed index
+/    DATA  header + 512 bytes          (header.sector: the sector carried)
+/
+/  The index of a sector is its distance from header.sector of the
+/  request, which is also its bit in the chunk's arrival mask. Requests
+/  carry everything the server needs, so the server keeps no state and a
+/  lost GET is repaired by a NACK for the whole chunk. Every request has
+/  a fresh xid, echoed in its DATA, so late packets of an earlier request
+/  are recognised and dropped.
+/
+/  The protocol engine is plain C on top of three callbacks, so the same
+/  code runs on the device (UdpSource) and in the host test client. */
+
+#ifndef UDP_FETCH_DEFINED
+#define UDP_FETCH_DEFINED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UDP_MAGIC       0x554D      /* "MU" on the wire */
+#define UDP_SECTOR      512
+
+/* Sectors per request; at most 32, one bit each in the arrival mask */
+#ifndef UDP_CHUNK_SECTORS
+#define UDP_CHUNK_SECTORS   32
+#endif
+/* Chunk requests in flight. Bounded by what the receiver can queue:
+/  lwIP drops datagrams once its UDP mailbox is full. */
+#ifndef UDP_WINDOW
+#define UDP_WINDOW          2
+#endif
+/* Silence after which the missing sectors of a chunk are asked for again */
+#ifndef UDP_NACK_MS
+#define UDP_NACK_MS         20
+#endif
+
+typedef enum {
+    UDP_GET = 1,
+    UDP_NACK,
+    UDP_DATA
+} udp_type_t;
+
+typedef struct {
+    uint16_t magic;         /* UDP_MAGIC */
+    uint8_t type;           /* udp_type_t */
+    uint8_t count;          /* GET: sectors; NACK: indexes that follow */
+    uint32_t xid;           /* Request number, echoed in DATA */
+    uint32_t id;            /* Catalog file id */
+    uint32_t sector;        /* First sector of the request; DATA: the one carried */
+} udp_header_t;             /* 16 bytes, little endian */
+
+#define UDP_PACKET_MAX  (sizeof (udp_header_t) + UDP_SECTOR)
+
+typedef struct {
+    uint32_t id;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t* buffer;        /* count * 512 bytes */
+} udp_extent_t;
+
+typedef struct {
+    /* Sends one datagram; returns 0 on failure */
+    int (*send) (void* ctx, const void* data, uint32_t len);
+    /* Receives one datagram, waiting up to wait_ms; returns its length,
+    /  0 when none arrived */
+    int (*recv) (void* ctx, void* data, uint32_t len, uint32_t wait_ms);
+    /* Milliseconds from any fixed point */
+    uint32_t (*now) (void* ctx);
+    void* ctx;
+} udp_link_t;
+
+typedef struct {
+    uint32_t requests;      /* GETs sent */
+    uint32_t nacks;         /* NACKs sent */
+    uint32_t packets;       /* DATA accepted */
+    uint32_t stray;         /* DATA that was late, duplicate or not ours */
+} udp_stats_t;
+
+/* Fills every extent; sectors past the end of a file come back as zeros
+/  from the server. xid is the caller's request counter and advances.
+/  Returns 0, or -1 when timeout_ms passed first. stats may be NULL. */
+int udp_fetch (const udp_link_t* link, uint32_t* xid, const udp_extent_t* extents, uint32_t n,
+               uint32_t timeout_ms, udp_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UDP_FETCH_DEFINED */